@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include "autobaud.h"
+#include "storage.h"
+#include "storage_keys.h"
+#include "constants.h"
+#include "hal/uart_ll.h"
+#include "soc/rtc.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "AUTOBAUD";
+
+static const uint32_t standard_rates[] = {
+    300, 600, 1200, 2400, 4800, 9600, 14400, 19200, 28800, 38400, 57600, 76800,
+    115200, 230400, 250000, 460800, 500000, 921600, 1000000};
+
+autobaud::autobaud(uart_port_t uart, QueueHandle_t events)
+    : _uart(uart), _events(events), _state(LOCKED), _stable(0), _detect_start(0), _errors(0),
+      _error_window_start(0), _stats()
+{
+    uart_get_baudrate(uart, &_stats.rate);
+    start();
+}
+
+const char *autobaud::state_name(state_t state)
+{
+    switch (state)
+    {
+    case DETECTING:
+        return "detecting";
+    case TRACKING:
+        return "tracking";
+    default:
+        return "locked";
+    }
+}
+
+uint32_t autobaud::snap(uint32_t apb_hz, uint32_t cycles)
+{
+    if (cycles == 0)
+        return 0;
+    uint32_t measured = apb_hz / cycles;
+    for (uint32_t rate : standard_rates)
+    {
+        uint32_t diff = measured > rate ? measured - rate : rate - measured;
+        if (diff * 100 <= rate * AUTOBAUD_TOLERANCE_PERCENT)
+            return rate;
+    }
+    return 0;
+}
+
+void autobaud::start()
+{
+    if (_state != DETECTING)
+    {
+        _stats.detections++;
+        ESP_LOGI(TAG, "Uart %d: detecting", _uart);
+    }
+    _state = DETECTING;
+    _stable = 0;
+    _detect_start = esp_timer_get_time();
+    restart_window();
+}
+
+// Clearing the enable bit resets the edge and pulse counters
+void autobaud::restart_window()
+{
+    uart_dev_t *hw = UART_LL_GET_HW(_uart);
+    uart_ll_set_autobaud_en(hw, false);
+    uart_ll_set_autobaud_en(hw, true);
+}
+
+void autobaud::poll()
+{
+    count_errors();
+    if (_state == LOCKED)
+        return;
+
+    uart_dev_t *hw = UART_LL_GET_HW(_uart);
+    if (uart_ll_get_rxd_edge_cnt(hw) < AUTOBAUD_EDGES)
+        return;
+    // A lone long pulse is several equal bits, the shortest one is a single bit
+    uint32_t cycles = std::min(uart_ll_get_low_pulse_cnt(hw), uart_ll_get_high_pulse_cnt(hw));
+    restart_window();
+
+    uint32_t apb_hz = rtc_clk_apb_freq_get();
+    _stats.measured = cycles ? apb_hz / cycles : 0;
+    uint32_t rate = snap(apb_hz, cycles);
+    if (rate == 0)
+    {
+        // Glitches or a line too noisy, try another window
+        _stats.rejected++;
+        _stable = 0;
+        return;
+    }
+
+    if (rate != _stats.rate || _state == DETECTING)
+    {
+        if (rate != _stats.rate)
+        {
+            uart_set_baudrate(_uart, rate);
+            // Bytes already received were decoded at the old rate
+            uart_flush_input(_uart);
+            _stats.rate = rate;
+            _stable = 0;
+        }
+        if (_state == DETECTING)
+        {
+            _stats.lock_ms = (esp_timer_get_time() - _detect_start) / 1000;
+            ESP_LOGI(TAG, "Uart %d: %u baud (measured %u) after %u ms", _uart, rate, _stats.measured, _stats.lock_ms);
+        }
+        _state = TRACKING;
+    }
+    if (++_stable < AUTOBAUD_STABLE)
+        return;
+
+    char STORAGE_KEY[50];
+    sprintf(STORAGE_KEY, STORAGE_UART_BAUDS, _uart);
+    int32_t saved = 0;
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &saved) != ESP_OK || saved != (int32_t)rate)
+    {
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, rate);
+        ESP_LOGI(TAG, "Uart %d: %u baud saved", _uart, rate);
+    }
+    uart_ll_set_autobaud_en(hw, false);
+    _state = LOCKED;
+    _errors = 0;
+}
+
+// Drains the driver event queue, a burst of line errors means the rate changed
+void autobaud::count_errors()
+{
+    uart_event_t event;
+    while (xQueueReceive(_events, &event, 0) == pdTRUE)
+    {
+        if (event.type != UART_FRAME_ERR && event.type != UART_PARITY_ERR)
+            continue;
+        int64_t now = esp_timer_get_time();
+        if (now - _error_window_start > AUTOBAUD_ERROR_WINDOW_MS * 1000LL)
+        {
+            _error_window_start = now;
+            _errors = 0;
+        }
+        if (++_errors >= AUTOBAUD_ERROR_BURST && _state == LOCKED)
+        {
+            _stats.error_bursts++;
+            ESP_LOGI(TAG, "Uart %d: %u line errors, rate lost", _uart, _errors);
+            _errors = 0;
+            start();
+        }
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef _AUTOBAUD_H_
+#define _AUTOBAUD_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/uart.h"
+
+// Automatic baud rate of a port, from the UART's own pulse width counters.
+// The shortest high and low pulses seen on RX are one bit time, in APB
+// cycles. Each measurement window of AUTOBAUD_EDGES edges gives a rate,
+// snapped to the nearest standard rate and applied at once. Once the same
+// rate came out of AUTOBAUD_STABLE windows in a row it is saved as the port's
+// baud rate and measuring stops. A burst of framing or parity errors starts
+// detection again.
+// Only the owning UART task may call it.
+#define AUTOBAUD_EDGES 64
+#define AUTOBAUD_STABLE 3
+// Measured rate off by more than this from every standard rate is rejected
+#define AUTOBAUD_TOLERANCE_PERCENT 4
+#define AUTOBAUD_ERROR_BURST 8
+#define AUTOBAUD_ERROR_WINDOW_MS 1000
+
+class autobaud
+{
+public:
+  enum state_t
+  {
+    DETECTING, // No rate yet, serial data is discarded
+    TRACKING,  // Rate applied, waiting for it to be stable
+    LOCKED,    // Rate saved, watching for error bursts
+  };
+
+  struct stats_t
+  {
+    uint32_t rate;
+    // Last raw measurement, before snapping
+    uint32_t measured;
+    uint32_t detections;
+    uint32_t rejected;
+    uint32_t error_bursts;
+    // From the start of the last detection to the first applied rate
+    uint32_t lock_ms;
+  };
+
+  // events: the driver event queue, from uart_driver_install
+  autobaud(uart_port_t uart, QueueHandle_t events);
+
+  // Called by the UART task on every loop
+  void poll();
+  void start();
+  state_t state() const { return _state; }
+  bool detecting() const { return _state == DETECTING; }
+  const stats_t &stats() const { return _stats; }
+  // New queue after the driver was reinstalled
+  void set_events(QueueHandle_t events) { _events = events; }
+
+  static const char *state_name(state_t state);
+  // Nearest standard rate to a pulse of cycles APB cycles, 0 if none is close
+  static uint32_t snap(uint32_t apb_hz, uint32_t cycles);
+
+private:
+  void restart_window();
+  void count_errors();
+
+  uart_port_t _uart;
+  QueueHandle_t _events;
+  state_t _state;
+  uint32_t _stable;
+  int64_t _detect_start;
+  uint32_t _errors;
+  int64_t _error_window_start;
+  stats_t _stats;
+};
+
+#endif
@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "uart_server.h"
+#include "mem.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/stream_buffer.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+// Holds what the UART task reads back while the test runs
+#define BENCH_TAP_SIZE 8192
+#define BENCH_MAX_SIZE 1024
+#define BENCH_MAX_SECONDS 60
+// Round trip given up after this long
+#define BENCH_TIMEOUT_US 1000000
+// Time for the last bytes to come back once writing stops
+#define BENCH_DRAIN_MS 200
+#define BENCH_TASK_STACK 4096
+
+namespace bench
+{
+    static const char *TAG = "BENCH";
+
+    static std::atomic<bool> running[UART_NUM_MAX];
+#if CONFIG_SER2IP32_BENCH_PORT > 0
+    MEM_STATIC_TASKS(bench_task, 1, BENCH_TASK_STACK)
+#define BENCH_TASK_STORAGE MEM_TASK_STORAGE(bench_task, 0)
+#else
+#define BENCH_TASK_STORAGE (mem::task_storage_t{NULL, NULL})
+#endif
+
+    bool parse_mode(const char *name, mode_t *mode)
+    {
+        if (!strcmp(name, "bulk"))
+            *mode = MODE_BULK;
+        else if (!strcmp(name, "pingpong"))
+            *mode = MODE_PINGPONG;
+        else if (!strcmp(name, "bursty"))
+            *mode = MODE_BURSTY;
+        else
+            return false;
+        return true;
+    }
+
+    const char *mode_name(mode_t mode)
+    {
+        switch (mode)
+        {
+        case MODE_BULK:
+            return "bulk";
+        case MODE_PINGPONG:
+            return "pingpong";
+        default:
+            return "bursty";
+        }
+    }
+
+    // Data is a running byte counter, checked on the way back
+    struct stream_t
+    {
+        StreamBufferHandle_t tap;
+        uint8_t *buffer;
+        uint8_t next_tx;
+        uint8_t next_rx;
+        result_t *result;
+    };
+
+    static void fill(stream_t &s, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+            s.buffer[i] = s.next_tx++;
+    }
+
+    static size_t receive(stream_t &s, TickType_t timeout)
+    {
+        uint8_t chunk[256];
+        size_t n = xStreamBufferReceive(s.tap, chunk, sizeof(chunk), timeout);
+        for (size_t i = 0; i < n; i++)
+        {
+            if (chunk[i] != s.next_rx)
+                s.result->errors++;
+            // Resynchronize on the received byte, a loss counts once
+            s.next_rx = chunk[i] + 1;
+        }
+        s.result->received += n;
+        return n;
+    }
+
+    static void run_bulk(uart_server *server, const config_t &config, stream_t &s, int64_t end)
+    {
+        while (esp_timer_get_time() < end)
+        {
+            fill(s, config.size);
+            server->inject(s.buffer, config.size);
+            s.result->sent += config.size;
+            while (receive(s, 0) > 0)
+                ;
+        }
+    }
+
+    // Pingpong waits for each block before sending the next, bursty also
+    // keeps a fixed period between blocks
+    static void run_blocks(uart_server *server, const config_t &config, stream_t &s, int64_t end)
+    {
+        result_t *result = s.result;
+        int64_t period = config.mode == MODE_BURSTY ? (int64_t)config.interval_ms * 1000 : 0;
+        int64_t previous = -1;
+        while (esp_timer_get_time() < end)
+        {
+            int64_t start = esp_timer_get_time();
+            uint64_t target = result->received + config.size;
+            fill(s, config.size);
+            server->inject(s.buffer, config.size);
+            result->sent += config.size;
+
+            while (result->received < target && esp_timer_get_time() - start < BENCH_TIMEOUT_US)
+                receive(s, 1);
+            int64_t latency = esp_timer_get_time() - start;
+            if (result->received < target)
+            {
+                result->timeouts++;
+                // Late bytes must not count for the next block
+                while (receive(s, pdMS_TO_TICKS(BENCH_DRAIN_MS)) > 0)
+                    ;
+                previous = -1;
+            }
+            else
+            {
+                result->samples++;
+                result->latency_sum_us += latency;
+                result->latency_min_us = std::min(result->latency_min_us, (uint32_t)latency);
+                result->latency_max_us = std::max(result->latency_max_us, (uint32_t)latency);
+                if (previous >= 0)
+                    result->jitter_sum_us += latency > previous ? latency - previous : previous - latency;
+                previous = latency;
+            }
+
+            int64_t wait = start + period - esp_timer_get_time();
+            if (wait > 0)
+                vTaskDelay(std::max((TickType_t)1, (TickType_t)pdMS_TO_TICKS(wait / 1000)));
+        }
+    }
+
+    esp_err_t run(uart_port_t uart, const config_t &config, result_t *result)
+    {
+        uart_server *server = uart_server::get(uart);
+        if (!server || server->framer() || config.size == 0 || config.size > BENCH_MAX_SIZE ||
+            config.seconds == 0 || config.seconds > BENCH_MAX_SECONDS)
+            return ESP_ERR_INVALID_ARG;
+        bool idle = false;
+        if (!running[uart].compare_exchange_strong(idle, true))
+            return ESP_ERR_INVALID_STATE;
+
+        memset(result, 0, sizeof(*result));
+        result->latency_min_us = UINT32_MAX;
+        stream_t s = {};
+        s.result = result;
+        s.tap = xStreamBufferCreate(BENCH_TAP_SIZE, 1);
+        s.buffer = (uint8_t *)malloc(config.size);
+        if (!s.tap || !s.buffer)
+        {
+            if (s.tap)
+                vStreamBufferDelete(s.tap);
+            free(s.buffer);
+            running[uart] = false;
+            return ESP_ERR_NO_MEM;
+        }
+
+        mem::count(mem::SUBSYSTEM_BENCH, BENCH_TAP_SIZE + config.size);
+        ESP_LOGI(TAG, "Uart %d: %s, %u s, %u bytes, loopback %d", uart, mode_name(config.mode), config.seconds,
+                 config.size, config.loopback);
+        if (config.loopback)
+            uart_set_loop_back(uart, true);
+        uart_flush_input(uart);
+        server->set_tap(s.tap);
+
+        int64_t start = esp_timer_get_time();
+        int64_t end = start + (int64_t)config.seconds * 1000000;
+        if (config.mode == MODE_BULK)
+            run_bulk(server, config, s, end);
+        else
+            run_blocks(server, config, s, end);
+
+        // What is still on the way is not lost yet
+        uart_wait_tx_done(uart, pdMS_TO_TICKS(1000));
+        while (receive(s, pdMS_TO_TICKS(BENCH_DRAIN_MS)) > 0)
+            ;
+        result->duration_ms = (esp_timer_get_time() - start) / 1000;
+
+        server->set_tap(NULL);
+        if (config.loopback)
+            uart_set_loop_back(uart, false);
+        vStreamBufferDelete(s.tap);
+        free(s.buffer);
+        mem::uncount(mem::SUBSYSTEM_BENCH, BENCH_TAP_SIZE + config.size);
+        running[uart] = false;
+        return ESP_OK;
+    }
+
+    int format(uart_port_t uart, const config_t &config, const result_t &result, char *out, size_t size)
+    {
+        uint64_t lost = result.sent > result.received ? result.sent - result.received : 0;
+        uint32_t duration = std::max(result.duration_ms, (uint32_t)1);
+        int length = snprintf(out, size, "uart %d %s, %u s, %u bytes: sent %llu, received %llu, lost %llu, errors %llu, %llu B/s\n",
+                              uart, mode_name(config.mode), config.seconds, config.size, result.sent, result.received,
+                              lost, result.errors, result.received * 1000 / duration);
+        if (config.mode != MODE_BULK && length < (int)size)
+        {
+            if (result.samples > 0)
+                length += snprintf(out + length, size - length, "latency min/avg/max %u/%llu/%u us, jitter %llu us, timeouts %u\n",
+                                   result.latency_min_us, result.latency_sum_us / result.samples, result.latency_max_us,
+                                   result.samples > 1 ? result.jitter_sum_us / (result.samples - 1) : 0, result.timeouts);
+            else
+                length += snprintf(out + length, size - length, "no round trip completed, timeouts %u\n", result.timeouts);
+        }
+        return length;
+    }
+
+    // Runs one test per connection, outside the io_context
+    static void server_task(void *arg)
+    {
+        auto acceptor = (asio::ip::tcp::acceptor *)arg;
+        while (1)
+        {
+            std::error_code ec;
+            asio::ip::tcp::socket socket(acceptor->get_executor());
+            acceptor->accept(socket, ec);
+            if (ec)
+            {
+                vTaskDelay(pdMS_TO_TICKS(1000));
+                continue;
+            }
+
+            char line[96] = {0};
+            size_t length = 0;
+            while (length < sizeof(line) - 1 && !strchr(line, '\n'))
+            {
+                size_t n = socket.read_some(asio::buffer(line + length, sizeof(line) - 1 - length), ec);
+                if (ec)
+                    break;
+                length += n;
+            }
+
+            char report[256];
+            int uart = -1;
+            char mode[16] = "bulk";
+            unsigned seconds = 5, size = 256, interval = 100, loopback = 1;
+            config_t config;
+            result_t result;
+            if (sscanf(line, "%d %15s %u %u %u %u", &uart, mode, &seconds, &size, &interval, &loopback) < 2 ||
+                uart < 0 || uart >= UART_NUM_MAX || !parse_mode(mode, &config.mode))
+                length = snprintf(report, sizeof(report), "usage: <uart> <bulk|pingpong|bursty> [seconds] [size] [interval_ms] [loopback]\n");
+            else
+            {
+                config.seconds = seconds;
+                config.size = size;
+                config.interval_ms = interval;
+                config.loopback = loopback != 0;
+                esp_err_t err = run((uart_port_t)uart, config, &result);
+                if (err == ESP_OK)
+                    length = format((uart_port_t)uart, config, result, report, sizeof(report));
+                else
+                    length = snprintf(report, sizeof(report), "error: %s\n", esp_err_to_name(err));
+            }
+            asio::write(socket, asio::buffer(report, std::min(length, sizeof(report) - 1)), ec);
+            socket.close(ec);
+        }
+    }
+
+    void start_server(asio::io_context *io_context, short port)
+    {
+        auto acceptor = new asio::ip::tcp::acceptor(*io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port));
+        ESP_LOGI(TAG, "Trigger on port %d", port);
+        mem::create_task(server_task, "bench", BENCH_TASK_STACK, acceptor, tskIDLE_PRIORITY + 5, tskNO_AFFINITY,
+                         mem::SUBSYSTEM_BENCH, BENCH_TASK_STORAGE);
+    }
+}
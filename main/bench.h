@@ -0,0 +1,60 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "driver/uart.h"
+#include "asio.hpp"
+
+// Self test of a port. Traffic is injected where TCP data enters the port
+// and read back through the port's UART task, with the UART in internal
+// loopback or echoed by the device on the line. A client connected to the
+// port meanwhile receives the traffic as usual, so socket writes are part
+// of the measurement.
+namespace bench
+{
+    enum mode_t
+    {
+        MODE_BULK,     // Continuous writes, throughput and loss
+        MODE_PINGPONG, // One block at a time, round trip latency
+        MODE_BURSTY,   // One block every interval, burst latency
+    };
+
+    struct config_t
+    {
+        mode_t mode;
+        uint32_t seconds;
+        uint32_t size;
+        uint32_t interval_ms;
+        bool loopback;
+    };
+
+    struct result_t
+    {
+        uint64_t sent;
+        uint64_t received;
+        uint64_t errors;
+        uint32_t duration_ms;
+        // Round trips, pingpong and bursty modes
+        uint32_t samples;
+        uint32_t timeouts;
+        uint32_t latency_min_us;
+        uint32_t latency_max_us;
+        uint64_t latency_sum_us;
+        // Sum of differences between consecutive latencies
+        uint64_t jitter_sum_us;
+    };
+
+    bool parse_mode(const char *name, mode_t *mode);
+    const char *mode_name(mode_t mode);
+    // Blocks for the duration of the test
+    esp_err_t run(uart_port_t uart, const config_t &config, result_t *result);
+    int format(uart_port_t uart, const config_t &config, const result_t &result, char *out, size_t size);
+
+    // Text trigger: a client sends "<uart> <mode> [seconds] [size] [interval_ms] [loopback]\n"
+    // and receives the report
+    void start_server(asio::io_context *io_context, short port);
+}
+
+#endif
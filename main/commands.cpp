@@ -9,12 +9,23 @@
 #include "argtable3/argtable3.h"
 #include "storage_keys.h"
 #include "driver/uart.h"
+#include "esp_heap_caps.h"
 #include <stdio.h>
 #include <string.h>
 
+// wifi.h first, constants.h redefines WIFI_MODE_AP
+#include "wifi.h"
+#include "network.h"
 #include "constants.h"
+#include "uart_server.h"
+#include "bench.h"
+#include "mem.h"
+#include "web.h"
+#include "cpu.h"
 
 #define STORAGE_NAMESPACE "storage"
+// Line editing, argtable parsing and printf of the stats tables
+#define CONSOLE_TASK_STACK 4096
 
 namespace commands
 {
@@ -31,6 +42,27 @@ namespace commands
         struct arg_int *data_bits;
         struct arg_int *parity;
         struct arg_int *stop_bits;
+        struct arg_int *tls;
+        struct arg_int *iface;
+        struct arg_int *sf_size;
+        struct arg_int *sf_spill;
+        struct arg_int *sf_markers;
+        struct arg_int *rts_pin;
+        struct arg_int *rs485;
+        struct arg_int *pre_guard;
+        struct arg_int *post_guard;
+        struct arg_int *echo;
+        struct arg_int *framing;
+        struct arg_int *priority;
+        struct arg_int *weight;
+        struct arg_int *rate;
+        struct arg_int *burst;
+        struct arg_int *autobaud;
+        struct arg_int *ws;
+        struct arg_int *ppp;
+        struct arg_int *mqtt;
+        struct arg_int *mqtt_qos;
+        struct arg_int *ipv6;
         struct arg_end *end;
     } uart_args;
 
@@ -43,7 +75,42 @@ namespace commands
         struct arg_end *end;
     } wifi_args;
 
+    static struct
+    {
+        struct arg_int *tcp_port;
+        struct arg_end *end;
+    } mux_args;
+
+    static struct
+    {
+        struct arg_int *uart;
+        struct arg_str *mode;
+        struct arg_int *seconds;
+        struct arg_int *size;
+        struct arg_int *interval;
+        struct arg_int *loopback;
+        struct arg_end *end;
+    } bench_args;
+
+    static struct
+    {
+        struct arg_int *uart;
+        struct arg_int *to;
+        struct arg_int *tee;
+        struct arg_end *end;
+    } route_args;
+
+    static struct
+    {
+        struct arg_int *uart;
+        struct arg_str *match;
+        struct arg_int *sample;
+        struct arg_lit *off;
+        struct arg_end *end;
+    } filter_args;
+
     static TaskHandle_t task_handle = NULL;
+    MEM_STATIC_TASKS(console_task, 1, CONSOLE_TASK_STACK)
 
     static void register_commands();
     // UART
@@ -52,6 +119,27 @@ namespace commands
     // Wifi
     static void register_wifi_commands();
     static int wifi_configure_command(int argc, char **argv);
+    // Mux
+    static void register_mux_commands();
+    static int mux_configure_command(int argc, char **argv);
+    // Route
+    static void register_route_command();
+    static int route_command(int argc, char **argv);
+    // Filter
+    static void register_filter_command();
+    static int filter_command(int argc, char **argv);
+    // Bench
+    static void register_bench_command();
+    static int bench_command(int argc, char **argv);
+    // Stats
+    static void register_stats_command();
+    static int stats_command(int argc, char **argv);
+    // Memory
+    static void register_mem_command();
+    static int mem_command(int argc, char **argv);
+    // CPU
+    static void register_cpu_command();
+    static int cpu_command(int argc, char **argv);
     // Reboot
     static void register_reboot_command();
     static int reboot_command(int argc, char **argv);
@@ -94,7 +182,7 @@ namespace commands
         /* Initialize the console */
         esp_console_config_t console_config = {
             .max_cmdline_length = 256,
-            .max_cmdline_args = 12,
+            .max_cmdline_args = 32,
         };
         ESP_ERROR_CHECK(esp_console_init(&console_config));
 
@@ -113,7 +201,8 @@ namespace commands
     }
     void start_console_task()
     {
-        xTaskCreate(&commands::run_console, "CONSOLE", 4096, NULL, configMAX_PRIORITIES, &task_handle);
+        task_handle = mem::create_task(&commands::run_console, "CONSOLE", CONSOLE_TASK_STACK, NULL, configMAX_PRIORITIES,
+                                       tskNO_AFFINITY, mem::SUBSYSTEM_CONSOLE, MEM_TASK_STORAGE(console_task, 0));
     }
     void run_console(void *arg)
     {
@@ -184,6 +273,13 @@ namespace commands
     {
         register_uart_commands();
         register_wifi_commands();
+        register_mux_commands();
+        register_route_command();
+        register_filter_command();
+        register_bench_command();
+        register_stats_command();
+        register_mem_command();
+        register_cpu_command();
         register_reboot_command();
         register_clear_nvs_commands();
     }
@@ -255,7 +351,7 @@ namespace commands
         sprintf(STORAGE_KEY, STORAGE_UART_TX_BUFFER, uart_num);
         if (uart_args.tx_buffer->count == 0)
         {
-            uart_args.tx_buffer->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_BUFFER;
+            uart_args.tx_buffer->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_AUTO_BUFFER;
         }
         storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.tx_buffer->ival[0]);
 
@@ -263,7 +359,7 @@ namespace commands
         sprintf(STORAGE_KEY, STORAGE_UART_RX_BUFFER, uart_num);
         if (uart_args.rx_buffer->count == 0)
         {
-            uart_args.rx_buffer->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_BUFFER;
+            uart_args.rx_buffer->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_AUTO_BUFFER;
         }
         storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.rx_buffer->ival[0]);
 
@@ -291,6 +387,165 @@ namespace commands
         }
         storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.stop_bits->ival[0]);
 
+        // TLS
+        sprintf(STORAGE_KEY, STORAGE_UART_TLS, uart_num);
+        if (uart_args.tls->count == 0)
+        {
+            uart_args.tls->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_TLS;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.tls->ival[0]);
+
+        // IFACE
+        sprintf(STORAGE_KEY, STORAGE_UART_IFACE, uart_num);
+        if (uart_args.iface->count == 0)
+        {
+            uart_args.iface->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_IFACE;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.iface->ival[0]);
+
+        // STORE AND FORWARD
+        sprintf(STORAGE_KEY, STORAGE_UART_SF_SIZE, uart_num);
+        if (uart_args.sf_size->count == 0)
+        {
+            uart_args.sf_size->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_SF_SIZE;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.sf_size->ival[0]);
+
+        sprintf(STORAGE_KEY, STORAGE_UART_SF_SPILL, uart_num);
+        if (uart_args.sf_spill->count == 0)
+        {
+            uart_args.sf_spill->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_SF_SPILL;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.sf_spill->ival[0]);
+
+        sprintf(STORAGE_KEY, STORAGE_UART_SF_MARKERS, uart_num);
+        if (uart_args.sf_markers->count == 0)
+        {
+            uart_args.sf_markers->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_SF_MARKERS;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.sf_markers->ival[0]);
+
+        // RTS_PIN
+        sprintf(STORAGE_KEY, STORAGE_UART_RTS_PIN, uart_num);
+        if (uart_args.rts_pin->count == 0)
+        {
+            uart_args.rts_pin->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_RTS_PIN[uart_num];
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.rts_pin->ival[0]);
+
+        // RS-485
+        sprintf(STORAGE_KEY, STORAGE_UART_RS485, uart_num);
+        if (uart_args.rs485->count == 0)
+        {
+            uart_args.rs485->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_RS485;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.rs485->ival[0]);
+
+        sprintf(STORAGE_KEY, STORAGE_UART_PRE_GUARD, uart_num);
+        if (uart_args.pre_guard->count == 0)
+        {
+            uart_args.pre_guard->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_PRE_GUARD_US;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.pre_guard->ival[0]);
+
+        sprintf(STORAGE_KEY, STORAGE_UART_POST_GUARD, uart_num);
+        if (uart_args.post_guard->count == 0)
+        {
+            uart_args.post_guard->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_POST_GUARD_US;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.post_guard->ival[0]);
+
+        sprintf(STORAGE_KEY, STORAGE_UART_ECHO, uart_num);
+        if (uart_args.echo->count == 0)
+        {
+            uart_args.echo->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_ECHO_SUPPRESS;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.echo->ival[0]);
+
+        // FRAMING
+        sprintf(STORAGE_KEY, STORAGE_UART_FRAMING, uart_num);
+        if (uart_args.framing->count == 0)
+        {
+            uart_args.framing->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_FRAMING;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.framing->ival[0]);
+
+        // EGRESS
+        sprintf(STORAGE_KEY, STORAGE_UART_PRIORITY, uart_num);
+        if (uart_args.priority->count == 0)
+        {
+            uart_args.priority->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_PRIORITY;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.priority->ival[0]);
+
+        sprintf(STORAGE_KEY, STORAGE_UART_WEIGHT, uart_num);
+        if (uart_args.weight->count == 0)
+        {
+            uart_args.weight->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_WEIGHT;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.weight->ival[0]);
+
+        sprintf(STORAGE_KEY, STORAGE_UART_RATE, uart_num);
+        if (uart_args.rate->count == 0)
+        {
+            uart_args.rate->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_RATE;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.rate->ival[0]);
+
+        sprintf(STORAGE_KEY, STORAGE_UART_BURST, uart_num);
+        if (uart_args.burst->count == 0)
+        {
+            uart_args.burst->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_BURST;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.burst->ival[0]);
+
+        // AUTOBAUD
+        sprintf(STORAGE_KEY, STORAGE_UART_AUTOBAUD, uart_num);
+        if (uart_args.autobaud->count == 0)
+        {
+            uart_args.autobaud->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_AUTOBAUD;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.autobaud->ival[0]);
+
+        // WEBSOCKET
+        sprintf(STORAGE_KEY, STORAGE_UART_WS, uart_num);
+        if (uart_args.ws->count == 0)
+        {
+            uart_args.ws->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_WS;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.ws->ival[0]);
+
+        // PPP
+        sprintf(STORAGE_KEY, STORAGE_UART_PPP, uart_num);
+        if (uart_args.ppp->count == 0)
+        {
+            uart_args.ppp->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_PPP;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.ppp->ival[0]);
+
+        // MQTT
+        sprintf(STORAGE_KEY, STORAGE_UART_MQTT, uart_num);
+        if (uart_args.mqtt->count == 0)
+        {
+            uart_args.mqtt->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_MQTT;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.mqtt->ival[0]);
+
+        sprintf(STORAGE_KEY, STORAGE_UART_MQTT_QOS, uart_num);
+        if (uart_args.mqtt_qos->count == 0)
+        {
+            uart_args.mqtt_qos->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_MQTT_QOS;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.mqtt_qos->ival[0]);
+
+        // IPV6
+        sprintf(STORAGE_KEY, STORAGE_UART_IPV6, uart_num);
+        if (uart_args.ipv6->count == 0)
+        {
+            uart_args.ipv6->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_IPV6;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, uart_args.ipv6->ival[0]);
+
         return 0;
     }
 
@@ -302,11 +557,32 @@ namespace commands
         uart_args.tcp_port = arg_int0(NULL, "tcp_port", "<tcp_port>", "Listening TCP Port");
         uart_args.tx_pin = arg_int0(NULL, "tx_pin", "<tx_pin>", "TX Pin");
         uart_args.rx_pin = arg_int0(NULL, "rx_pin", "<rx_pin>", "RX Pin");
-        uart_args.tx_buffer = arg_int0(NULL, "tx_buffer", "<tx_buffer>", "Transmission buffer in bytes (2048)");
-        uart_args.rx_buffer = arg_int0(NULL, "rx_buffer", "<rx_buffer>", "Reception buffer in bytes (2048)");
+        uart_args.tx_buffer = arg_int0(NULL, "tx_buffer", "<tx_buffer>", "Transmission buffer in bytes, 0 sizes it from the baud rate (0)");
+        uart_args.rx_buffer = arg_int0(NULL, "rx_buffer", "<rx_buffer>", "Reception buffer in bytes, 0 sizes it from the baud rate (0)");
         uart_args.data_bits = arg_int0(NULL, "data_bits", "<data_bits>", "Number of data bits (8)");
         uart_args.parity = arg_int0(NULL, "parity", "<odd=3|even=2|none=0>", "Parity (none)");
         uart_args.stop_bits = arg_int0(NULL, "stop_bits", "<stop_bits>", "Number of stop bits (1)");
+        uart_args.tls = arg_int0(NULL, "tls", "<enable=1|disable=0>", "Serve the port over TLS (disable)");
+        uart_args.iface = arg_int0(NULL, "iface", "<any=0|ethernet=1|wifi=2>", "Interface accepting clients (any)");
+        uart_args.sf_size = arg_int0(NULL, "sf_size", "<bytes>", "Store and forward RAM buffer, 0 disables (0)");
+        uart_args.sf_spill = arg_int0(NULL, "sf_spill", "<enable=1|disable=0>", "Spill store and forward buffer to flash (disable)");
+        uart_args.sf_markers = arg_int0(NULL, "sf_markers", "<enable=1|disable=0>", "Mark backlog begin/end in the stream (disable)");
+        uart_args.rts_pin = arg_int0(NULL, "rts_pin", "<rts_pin>", "RTS Pin, RS-485 driver enable");
+        uart_args.rs485 = arg_int0(NULL, "rs485", "<enable=1|disable=0>", "RS-485 half duplex mode (disable)");
+        uart_args.pre_guard = arg_int0(NULL, "pre_guard", "<us>", "RS-485 bus idle time before transmitting (0)");
+        uart_args.post_guard = arg_int0(NULL, "post_guard", "<us>", "RS-485 time after transmitting with reception discarded (0)");
+        uart_args.echo = arg_int0(NULL, "echo", "<enable=1|disable=0>", "RS-485 suppress echo of transmitted bytes (disable)");
+        uart_args.framing = arg_int0(NULL, "framing", "<integrity=2|enable=1|disable=0>", "Timestamp and sequence header on serial data, 2 adds CRC32 and gap entries (disable)");
+        uart_args.priority = arg_int0(NULL, "priority", "<0-7>", "Egress priority, higher levels are sent first (0)");
+        uart_args.weight = arg_int0(NULL, "weight", "<1-16>", "Egress share within a priority level (1)");
+        uart_args.rate = arg_int0(NULL, "rate", "<bytes/s>", "Egress rate cap, 0 disables (0)");
+        uart_args.burst = arg_int0(NULL, "burst", "<bytes>", "Egress bytes sent at once above the rate cap (1024)");
+        uart_args.autobaud = arg_int0(NULL, "autobaud", "<enable=1|disable=0>", "Detect the baud rate from the line and save it (disable)");
+        uart_args.ws = arg_int0(NULL, "ws", "<enable=1|disable=0>", "Serve the port as a WebSocket for browsers (disable)");
+        uart_args.ppp = arg_int0(NULL, "ppp", "<enable=1|disable=0>", "PPP server for the device on the line, routed with NAPT (disable)");
+        uart_args.mqtt = arg_int0(NULL, "mqtt", "<enable=1|disable=0>", "Publish serial data to the MQTT broker and write its tx topic (disable)");
+        uart_args.mqtt_qos = arg_int0(NULL, "mqtt_qos", "<0|1>", "QoS of the published serial data (0)");
+        uart_args.ipv6 = arg_int0(NULL, "ipv6", "<enable=1|disable=0>", "Dual-stack listener, IPv6 and IPv4 clients on one socket (disable)");
         uart_args.end = arg_end(8);
 
         static esp_console_cmd_t uart_config_cmd = {
@@ -353,9 +629,12 @@ namespace commands
         // WIFI channel
         if (wifi_args.channel->count == 0)
         {
-            wifi_args.channel->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_WIFI_MODE, &aux_int) == ESP_OK ? aux_int : 6;
+            wifi_args.channel->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_WIFI_CHANNEL, &aux_int) == ESP_OK ? aux_int : 6;
         }
-        storage::write_int32(STORAGE_NAMESPACE, STORAGE_WIFI_MODE, wifi_args.channel->ival[0]);
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_WIFI_CHANNEL, wifi_args.channel->ival[0]);
+
+        // Forget the cached station AP, it may belong to another network
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_WIFI_STA_CHANNEL, 0);
 
         return 0;
     }
@@ -378,6 +657,596 @@ namespace commands
         esp_console_cmd_register(&wifi_config_cmd);
     }
 
+    // MUX
+    int mux_configure_command(int argc, char **argv)
+    {
+        int nerrors = arg_parse(argc, argv, (void **)&mux_args);
+        if (nerrors != 0)
+        {
+            arg_print_errors(stderr, mux_args.end, argv[0]);
+            return 1;
+        }
+
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_MUX_TCP_PORT, mux_args.tcp_port->ival[0]);
+        return 0;
+    }
+
+    void register_mux_commands()
+    {
+        mux_args.tcp_port = arg_int1(NULL, NULL, "<tcp_port>", "Listening TCP port carrying all uarts, 0 disables (0)");
+        mux_args.end = arg_end(1);
+
+        static esp_console_cmd_t mux_config_cmd = {
+            .command = "mux_config",
+            .help = "Set multiplexed listener parameters",
+            .hint = NULL,
+            .func = &mux_configure_command,
+            .argtable = &mux_args};
+
+        esp_console_cmd_register(&mux_config_cmd);
+    }
+
+    // Route
+    int route_command(int argc, char **argv)
+    {
+        int nerrors = arg_parse(argc, argv, (void **)&route_args);
+        if (nerrors != 0)
+        {
+            arg_print_errors(stderr, route_args.end, argv[0]);
+            return 1;
+        }
+
+        char STORAGE_KEY[50];
+        int32_t aux_int = 0;
+
+        // No arguments: show the table
+        if (route_args.uart->count == 0)
+        {
+            printf("Uart  Routes to  Tee\n");
+            for (int i = 0; i < UART_NUM_MAX; i++)
+            {
+                sprintf(STORAGE_KEY, STORAGE_UART_ROUTE, i);
+                int32_t routes = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_ROUTE;
+                sprintf(STORAGE_KEY, STORAGE_UART_ROUTE_TEE, i);
+                int32_t tee = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_ROUTE_TEE;
+                printf("%-4d ", i);
+                for (int j = 0; j < UART_NUM_MAX; j++)
+                    printf(routes & BIT(j) ? " %d" : "  ", j);
+                printf("     %s\n", tee ? "yes" : "no");
+            }
+            return 0;
+        }
+
+        int uart_num = route_args.uart->ival[0];
+        if (uart_num < 0 || uart_num >= UART_NUM_MAX)
+        {
+            printf("Uart number is invalid, please insert 0, 1 or 2\n");
+            return 1;
+        }
+        int32_t routes = 0;
+        for (int i = 0; i < route_args.to->count; i++)
+        {
+            int target = route_args.to->ival[i];
+            if (target < 0 || target >= UART_NUM_MAX || target == uart_num)
+            {
+                printf("Target uart %d is invalid\n", target);
+                return 1;
+            }
+            routes |= BIT(target);
+        }
+
+        // ROUTE
+        sprintf(STORAGE_KEY, STORAGE_UART_ROUTE, uart_num);
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, routes);
+
+        // TEE
+        sprintf(STORAGE_KEY, STORAGE_UART_ROUTE_TEE, uart_num);
+        if (route_args.tee->count == 0)
+        {
+            route_args.tee->ival[0] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_ROUTE_TEE;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, route_args.tee->ival[0]);
+
+        // Running ports change at once
+        uart_server *server = uart_server::get((uart_port_t)uart_num);
+        if (server)
+            server->set_route(routes, route_args.tee->ival[0] != 0);
+        return 0;
+    }
+
+    void register_route_command()
+    {
+        route_args.uart = arg_int0(NULL, NULL, "<0|1|2>", "Source uart, none to show the table");
+        route_args.to = arg_intn(NULL, "to", "<0|1|2>", 0, 2, "Target uart, repeat for several, none clears the routes");
+        route_args.tee = arg_int0(NULL, "tee", "<enable=1|disable=0>", "Keep sending to the network too (disable)");
+        route_args.end = arg_end(2);
+
+        static esp_console_cmd_t route_cmd = {
+            .command = "route",
+            .help = "Route a uart's serial data to other uarts",
+            .hint = NULL,
+            .func = &route_command,
+            .argtable = &route_args};
+
+        esp_console_cmd_register(&route_cmd);
+    }
+
+    // Filter
+    int filter_command(int argc, char **argv)
+    {
+        int nerrors = arg_parse(argc, argv, (void **)&filter_args);
+        if (nerrors != 0)
+        {
+            arg_print_errors(stderr, filter_args.end, argv[0]);
+            return 1;
+        }
+
+        char STORAGE_KEY[50];
+        int32_t aux_int = 0;
+        char patterns[FILTER_PATTERNS_MAX + 1];
+        size_t length;
+
+        // No arguments: show the table
+        if (filter_args.uart->count == 0)
+        {
+            printf("Uart  Sample  Patterns\n");
+            for (int i = 0; i < UART_NUM_MAX; i++)
+            {
+                length = sizeof(patterns);
+                sprintf(STORAGE_KEY, STORAGE_UART_FILTER, i);
+                if (storage::read_string(STORAGE_NAMESPACE, STORAGE_KEY, patterns, &length) != ESP_OK)
+                    strcpy(patterns, UART_DEFAULT_FILTER);
+                sprintf(STORAGE_KEY, STORAGE_UART_SAMPLE, i);
+                int32_t sample = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_SAMPLE;
+                printf("%-4d  1/%-4d  %s\n", i, sample, patterns[0] ? patterns : "(every line)");
+            }
+            return 0;
+        }
+
+        int uart_num = filter_args.uart->ival[0];
+        if (uart_num < 0 || uart_num >= UART_NUM_MAX)
+        {
+            printf("Uart number is invalid, please insert 0, 1 or 2\n");
+            return 1;
+        }
+
+        // PATTERNS
+        length = sizeof(patterns);
+        sprintf(STORAGE_KEY, STORAGE_UART_FILTER, uart_num);
+        if (filter_args.off->count)
+            strcpy(patterns, UART_DEFAULT_FILTER);
+        else if (filter_args.match->count)
+        {
+            if (!line_filter::valid(filter_args.match->sval[0]))
+            {
+                printf("Patterns are invalid, at most %d of them in %d characters\n", FILTER_MAX_PATTERNS, FILTER_PATTERNS_MAX);
+                return 1;
+            }
+            strcpy(patterns, filter_args.match->sval[0]);
+        }
+        else if (storage::read_string(STORAGE_NAMESPACE, STORAGE_KEY, patterns, &length) != ESP_OK)
+            strcpy(patterns, UART_DEFAULT_FILTER);
+        storage::write_string(STORAGE_NAMESPACE, STORAGE_KEY, patterns);
+
+        // SAMPLE
+        sprintf(STORAGE_KEY, STORAGE_UART_SAMPLE, uart_num);
+        int32_t sample;
+        if (filter_args.off->count)
+            sample = UART_DEFAULT_SAMPLE;
+        else if (filter_args.sample->count)
+            sample = filter_args.sample->ival[0];
+        else
+            sample = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &aux_int) == ESP_OK ? aux_int : UART_DEFAULT_SAMPLE;
+        if (sample < 1)
+        {
+            printf("Sample is invalid, please insert 1 or more\n");
+            return 1;
+        }
+        storage::write_int32(STORAGE_NAMESPACE, STORAGE_KEY, sample);
+
+        // Running ports change at once
+        uart_server *server = uart_server::get((uart_port_t)uart_num);
+        if (server)
+            server->set_filter(patterns, sample);
+        return 0;
+    }
+
+    void register_filter_command()
+    {
+        filter_args.uart = arg_int0(NULL, NULL, "<0|1|2>", "Uart, none to show the table");
+        filter_args.match = arg_str0(NULL, "match", "<a|^b|...>", "Keep lines containing one of the patterns, ^ for a line prefix");
+        filter_args.sample = arg_int0(NULL, "sample", "<n>", "Keep 1 in n of the matching lines (1)");
+        filter_args.off = arg_lit0(NULL, "off", "Send every line again");
+        filter_args.end = arg_end(4);
+
+        static esp_console_cmd_t filter_cmd = {
+            .command = "filter",
+            .help = "Filter and sample the lines a uart sends to the network",
+            .hint = NULL,
+            .func = &filter_command,
+            .argtable = &filter_args};
+
+        esp_console_cmd_register(&filter_cmd);
+    }
+
+    // Bench
+    int bench_command(int argc, char **argv)
+    {
+        int nerrors = arg_parse(argc, argv, (void **)&bench_args);
+        if (nerrors != 0)
+        {
+            arg_print_errors(stderr, bench_args.end, argv[0]);
+            return 1;
+        }
+
+        bench::config_t config;
+        if (!bench::parse_mode(bench_args.mode->count ? bench_args.mode->sval[0] : "bulk", &config.mode))
+        {
+            printf("Mode is invalid, please insert bulk, pingpong or bursty\n");
+            return 1;
+        }
+        config.seconds = bench_args.seconds->count ? bench_args.seconds->ival[0] : 5;
+        config.size = bench_args.size->count ? bench_args.size->ival[0] : 256;
+        config.interval_ms = bench_args.interval->count ? bench_args.interval->ival[0] : 100;
+        config.loopback = bench_args.loopback->count ? bench_args.loopback->ival[0] != 0 : true;
+
+        int uart_num = bench_args.uart->ival[0];
+        if (uart_num < 0 || uart_num >= UART_NUM_MAX)
+        {
+            printf("Uart number is invalid, please insert 0, 1 or 2\n");
+            return 1;
+        }
+
+        bench::result_t result;
+        esp_err_t err = bench::run((uart_port_t)uart_num, config, &result);
+        if (err != ESP_OK)
+        {
+            printf("Bench failed: %s\n", esp_err_to_name(err));
+            return 1;
+        }
+        char report[256];
+        bench::format((uart_port_t)uart_num, config, result, report, sizeof(report));
+        printf("%s", report);
+        return 0;
+    }
+
+    void register_bench_command()
+    {
+        bench_args.uart = arg_int1(NULL, NULL, "<0|1|2>", "Uart number, must be enabled");
+        bench_args.mode = arg_str0(NULL, "mode", "<bulk|pingpong|bursty>", "Traffic pattern (bulk)");
+        bench_args.seconds = arg_int0(NULL, "seconds", "<seconds>", "Duration, up to 60 (5)");
+        bench_args.size = arg_int0(NULL, "size", "<bytes>", "Bytes per write or block, up to 1024 (256)");
+        bench_args.interval = arg_int0(NULL, "interval", "<ms>", "Period between bursts (100)");
+        bench_args.loopback = arg_int0(NULL, "loopback", "<enable=1|disable=0>", "Internal UART loopback, otherwise the line must echo (enable)");
+        bench_args.end = arg_end(2);
+
+        static esp_console_cmd_t bench_cmd = {
+            .command = "bench",
+            .help = "Measure throughput, latency and loss of a port",
+            .hint = NULL,
+            .func = &bench_command,
+            .argtable = &bench_args};
+
+        esp_console_cmd_register(&bench_cmd);
+    }
+
+    // Stats
+    int stats_command(int argc, char **argv)
+    {
+        printf("Interface  Link  RX bytes    TX bytes    Sessions  Failovers\n");
+        for (int i = network::IFACE_ETHERNET; i < network::IFACE_COUNT; i++)
+        {
+            network::iface_stats stats;
+            network::get_stats((network::iface_t)i, &stats);
+            printf("%-9s  %-4s  %-10llu  %-10llu  %-8u  %u\n", network::iface_name((network::iface_t)i),
+                   stats.up ? "up" : "down", stats.rx_bytes, stats.tx_bytes, stats.sessions, stats.failovers);
+        }
+#if CONFIG_SER2IP32_IPV6
+        for (int i = network::IFACE_ETHERNET; i < network::IFACE_COUNT; i++)
+        {
+            esp_ip6_addr_t addresses[LWIP_IPV6_NUM_ADDRESSES];
+            int count = network::get_ip6((network::iface_t)i, addresses);
+            for (int k = 0; k < count; k++)
+                printf("%-9s  " IPV6STR "\n", network::iface_name((network::iface_t)i), IPV62STR(addresses[k]));
+        }
+#endif
+
+        printf("\nPort  Client  Serial RX     Serial TX\n");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (!server)
+                continue;
+            printf("%-4d  %-6s  %-12llu  %llu\n", i, server->connected() ? "yes" : "no", server->serial_rx(), server->serial_tx());
+        }
+
+        printf("\nPort  RX ring     TX ring     Regrows     (budget %u, allocated %u)\n", uart_buffers::budget(),
+               uart_buffers::allocated());
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (!server)
+                continue;
+            const uart_buffers::sizes_t &rings = uart_buffers::installed((uart_port_t)i);
+            printf("%-4d  %-10u  %-10u  %u\n", i, rings.rx, rings.tx, server->regrows());
+        }
+
+        printf("\nPort  Backlog     Stored      Forwarded   Spilled     Dropped     Backlogs\n");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (!server || !server->sf())
+                continue;
+            const store_forward *sf = server->sf();
+            const store_forward::stats_t &sf_stats = sf->stats();
+            printf("%-4d  %-10u  %-10llu  %-10llu  %-10llu  %-10llu  %u\n", i, sf->size(), sf_stats.stored,
+                   sf_stats.forwarded, sf_stats.spilled, sf_stats.dropped, sf_stats.backlogs);
+        }
+
+        printf("\nPort  Spill B/s   Spill max us  Inline erases\n");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (!server || !server->sf() || server->sf()->stats().spilled == 0)
+                continue;
+            const store_forward::stats_t &sf_stats = server->sf()->stats();
+            uint64_t rate = sf_stats.spill_us ? sf_stats.spilled * 1000000 / sf_stats.spill_us : 0;
+            printf("%-4d  %-10llu  %-12u  %u\n", i, rate, sf_stats.spill_max_us, sf_stats.inline_erases);
+        }
+
+        printf("\nPort  Frames TX   Collisions  Echo        Echo lost   Guard drop  TX dropped  Turnaround min/avg/max us\n");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (!server || !server->rs485())
+                continue;
+            const rs485_port::stats_t &bus = server->rs485()->stats();
+            printf("%-4d  %-10u  %-10u  %-10llu  %-10llu  %-10llu  %-10llu  ", i, bus.frames_tx, bus.collisions,
+                   bus.echo_suppressed, bus.echo_missing, bus.guard_discarded, bus.tx_dropped);
+            if (bus.turnarounds)
+                printf("%u/%llu/%u\n", bus.turnaround_min_us, bus.turnaround_sum_us / bus.turnarounds, bus.turnaround_max_us);
+            else
+                printf("-\n");
+        }
+
+        if (egress::enabled())
+        {
+            printf("\nPort  Prio  Weight  Rate B/s    Queued      Sent        Dropped     Throttled   Blocked     Peak\n");
+            for (int i = 0; i < UART_NUM_MAX; i++)
+            {
+                if (!egress::registered((uart_port_t)i))
+                    continue;
+                const egress::port_config_t &eg = egress::config((uart_port_t)i);
+                const egress::stats_t &eg_stats = egress::stats((uart_port_t)i);
+                printf("%-4d  %-4u  %-6u  %-10u  %-10llu  %-10llu  %-10llu  %-10u  %-10u  %u\n", i, eg.priority, eg.weight,
+                       eg.rate, eg_stats.queued, eg_stats.sent, eg_stats.dropped, eg_stats.throttled, eg_stats.blocked,
+                       eg_stats.queue_peak);
+            }
+        }
+
+        printf("\nPort  Autobaud   Rate        Measured    Lock ms     Detections  Rejected    Error bursts\n");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (!server || !server->baud_detector())
+                continue;
+            const autobaud *detector = server->baud_detector();
+            const autobaud::stats_t &ab = detector->stats();
+            printf("%-4d  %-9s  %-10u  %-10u  %-10u  %-10u  %-10u  %u\n", i, autobaud::state_name(detector->state()),
+                   ab.rate, ab.measured, ab.lock_ms, ab.detections, ab.rejected, ab.error_bursts);
+        }
+
+#if CONFIG_SER2IP32_MQTT
+        printf("\nMQTT: %s, connects %u\n", mqtt_bridge::connected() ? "connected" : "disconnected", mqtt_bridge::connects());
+        printf("Port  QoS  Published   Bytes       Received    Dropped     Expired     Window full In flight\n");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            if (!mqtt_bridge::registered((uart_port_t)i))
+                continue;
+            const mqtt_bridge::stats_t &mq = mqtt_bridge::stats((uart_port_t)i);
+            printf("%-4d  %-3d  %-10llu  %-10llu  %-10llu  %-10u  %-10u  %-10u  %u\n", i, mqtt_bridge::qos((uart_port_t)i),
+                   mq.published, mq.published_bytes, mq.received, mq.dropped, mq.expired, mq.window_full, mq.in_flight);
+        }
+#endif
+
+#if CONFIG_SER2IP32_PPP
+        printf("\nPort  PPP        Device           Connects    Disconnects Last error\n");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (!server || !server->ppp())
+                continue;
+            const ppp_link *link = server->ppp();
+            const ppp_link::stats_t &ppp = link->stats();
+            uint32_t peer = link->peer_addr();
+            char device[16];
+            snprintf(device, sizeof(device), "%u.%u.%u.%u", peer & 0xff, (peer >> 8) & 0xff, (peer >> 16) & 0xff, peer >> 24);
+            printf("%-4d  %-9s  %-15s  %-10u  %-10u  %d\n", i, ppp_link::state_name(link->state()), device,
+                   ppp.connects, ppp.disconnects, ppp.last_error);
+        }
+#endif
+
+        printf("\nPort  Routes  Routed bytes  Dropped\n");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (!server || !server->routes())
+                continue;
+            printf("%-4d  0x%02x%s  %-12llu  %llu\n", i, server->routes(), server->route_tee() ? "+" : " ", server->routed(),
+                   server->route_drops());
+        }
+
+        printf("\nPort  Lines kept  Dropped     Bytes kept  Dropped     Overlong\n");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (!server || !server->filter())
+                continue;
+            const line_filter::stats_t &filter = server->filter()->stats();
+            printf("%-4d  %-10llu  %-10llu  %-10llu  %-10llu  %u\n", i, filter.lines_kept, filter.lines_dropped,
+                   filter.bytes_kept, filter.bytes_dropped, filter.overlong);
+        }
+
+        printf("\nPort  Frames      Batches     Overflows   Buffer full Errors\n");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (!server || !server->framer())
+                continue;
+            const frame_batcher::stats_t &framing = server->framer()->stats();
+            printf("%-4d  %-10u  %-10llu  %-10u  %-10u  %u\n", i, framing.seq, framing.batches, framing.overflows,
+                   framing.buffer_full, framing.errors);
+        }
+
+        printf("\nPort  Gap entries Discarded   Disc. bytes CRC bytes   CRC us/MB\n");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (!server || !server->framer() || !server->framer()->integrity())
+                continue;
+            const frame_batcher::stats_t &framing = server->framer()->stats();
+            uint64_t crc_us_per_mb = framing.crc_bytes ? framing.crc_cycles * 1000000 / framing.crc_bytes / CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ : 0;
+            printf("%-4d  %-10u  %-10llu  %-10llu  %-10llu  %llu\n", i, framing.gap_entries, framing.discarded_frames,
+                   framing.discarded_bytes, framing.crc_bytes, crc_us_per_mb);
+        }
+
+        mux_server::stats_t &mux = mux_server::stats();
+        printf("\nMux: %s, sessions %u, frames rx %llu tx %llu, overruns %llu, credit stalls %u/%u/%u\n",
+               mux_server::session() ? "connected" : "idle", mux.sessions, mux.frames_rx, mux.frames_tx, mux.overruns,
+               mux.credit_stalls[0], mux.credit_stalls[1], mux.credit_stalls[2]);
+
+#if CONFIG_SER2IP32_WEB
+        const web::stats_t &dashboard = web::stats();
+        printf("\nDashboard: clients %d, samples %u (%llu us), batches %u (%llu us), frames %u, send errors %u\n",
+               web::clients(), dashboard.samples, dashboard.sample_us, dashboard.batches, dashboard.push_us,
+               dashboard.frames_sent, dashboard.send_errors);
+#endif
+
+        wifi::reconnect_stats wifi_stats;
+        wifi::get_reconnect_stats(&wifi_stats);
+        printf("\nWifi station: %s, disconnections %u, roams %u, attempts %u, reconnect last %u ms max %u ms\n",
+               wifi::state_name(wifi::get_state()), wifi_stats.disconnections, wifi_stats.roams, wifi_stats.attempts,
+               wifi_stats.last_reconnect_ms, wifi_stats.max_reconnect_ms);
+        return 0;
+    }
+
+    void register_stats_command()
+    {
+        const esp_console_cmd_t cmd = {
+            .command = "stats",
+            .help = "Show link state and traffic counters",
+            .hint = NULL,
+            .func = &stats_command,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+    }
+
+    // Memory
+    int mem_command(int argc, char **argv)
+    {
+        printf("Task              Subsystem  Stack   Peak    Free    Static\n");
+        for (int i = 0; i < mem::task_count(); i++)
+        {
+            mem::task_info_t task;
+            if (!mem::get_task(i, &task))
+                continue;
+            printf("%-16s  %-9s  %-6u  %-6u  %-6u  %s\n", task.name, mem::subsystem_name(task.subsystem), task.stack_size,
+                   task.stack_size - task.high_water, task.high_water, task.is_static ? "yes" : "no");
+        }
+
+        size_t total_static = 0;
+        size_t total_heap = 0;
+        printf("\nSubsystem  Static      Heap\n");
+        for (int i = 0; i < mem::SUBSYSTEM_COUNT; i++)
+        {
+            mem::usage_t usage;
+            mem::get_usage((mem::subsystem_t)i, &usage);
+            if (!usage.static_bytes && !usage.heap_bytes)
+                continue;
+            printf("%-9s  %-10u  %u\n", mem::subsystem_name((mem::subsystem_t)i), usage.static_bytes, usage.heap_bytes);
+            total_static += usage.static_bytes;
+            total_heap += usage.heap_bytes;
+        }
+        printf("%-9s  %-10u  %u\n", "total", total_static, total_heap);
+
+        printf("\nUART driver rings: %u of %u bytes budget\n", uart_buffers::allocated(), uart_buffers::budget());
+        printf("Internal heap: free %u, minimum free %u, largest block %u\n",
+               heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT),
+               heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT),
+               heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+        return 0;
+    }
+
+    void register_mem_command()
+    {
+        const esp_console_cmd_t cmd = {
+            .command = "mem",
+            .help = "Show task stacks and RAM per subsystem",
+            .hint = NULL,
+            .func = &mem_command,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+    }
+
+    // CPU
+    int cpu_command(int argc, char **argv)
+    {
+#if CONFIG_SER2IP32_CPU_STATS
+        // Too large for the console stack
+        static cpu::window_t window;
+        if (!cpu::last_window(&window))
+        {
+            printf("No complete window yet\n");
+            return 1;
+        }
+        // Tenths of a percent of one core
+        auto share = [&](uint32_t us) { return (unsigned)((uint64_t)us * 1000 / window.length_us); };
+
+        printf("Window %u ms, sampled in %u us\n", window.length_us / 1000, window.sample_us);
+        printf("\nTask              Group    CPU %%\n");
+        for (int i = 0; i < window.task_count; i++)
+        {
+            const cpu::task_t &task = window.tasks[i];
+            if (!task.us)
+                continue;
+            unsigned s = share(task.us);
+            printf("%-16s  %-7s  %u.%u\n", task.name, cpu::group_name(task.group), s / 10, s % 10);
+        }
+
+        printf("\nGroup    CPU %%\n");
+        for (int g = 0; g < cpu::GROUP_COUNT; g++)
+        {
+            unsigned s = share(window.group_us[g]);
+            printf("%-7s  %u.%u\n", cpu::group_name((cpu::group_t)g), s / 10, s % 10);
+        }
+
+        printf("\nPort  CPU %%   Serial bytes  Cycles/byte\n");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            if (!uart_server::get((uart_port_t)i))
+                continue;
+            unsigned s = share(window.port_us[i]);
+            printf("%-4d  %3u.%u   %-12u  %u\n", i, s / 10, s % 10, window.port_bytes[i], cpu::cycles_per_byte(window, i));
+        }
+        printf("\nDevice: %u cycles per serial byte, all tasks but idle\n", cpu::device_cycles_per_byte(window));
+        return 0;
+#else
+        printf("Firmware built without CPU accounting (CONFIG_SER2IP32_CPU_STATS)\n");
+        return 1;
+#endif
+    }
+
+    void register_cpu_command()
+    {
+        const esp_console_cmd_t cmd = {
+            .command = "cpu",
+            .help = "Show CPU time per task, group and port over the last window",
+            .hint = NULL,
+            .func = &cpu_command,
+        };
+        ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+    }
+
     // Reboot
     int reboot_command(int argc, char **argv)
     {
@@ -14,9 +14,42 @@
 
 #define UART_DEFAULT_BAUDS 115200
 #define UART_DEFAULT_BUFFER 2048
+#define UART_AUTO_BUFFER 0 // Driver rings sized from the baud rate
 #define UART_DEFAULT_DATA_BITS UART_DATA_8_BITS
 #define UART_DEFAULT_STOP_BITS UART_STOP_BITS_1
 #define UART_DEFAULT_PARITY UART_PARITY_DISABLE
+#define UART_DEFAULT_TLS 0
+#define UART_DEFAULT_IFACE 0 // Any
+#define UART_DEFAULT_SF_SIZE 0 // Store and forward disabled
+#define UART_DEFAULT_SF_SPILL 0
+#define UART_DEFAULT_SF_MARKERS 0
+#define UART_DEFAULT_RS485 0 // Full duplex
+#define UART_DEFAULT_PRE_GUARD_US 0
+#define UART_DEFAULT_POST_GUARD_US 0
+#define UART_DEFAULT_ECHO_SUPPRESS 0
+#define UART_DEFAULT_FRAMING 0
+#define UART_DEFAULT_ROUTE 0 // No routing
+#define UART_DEFAULT_ROUTE_TEE 0
+#define UART_DEFAULT_PRIORITY 0
+#define UART_DEFAULT_WEIGHT 1
+#define UART_DEFAULT_RATE 0 // No egress rate cap
+#define UART_DEFAULT_BURST 0
+#define UART_DEFAULT_AUTOBAUD 0
+#define UART_DEFAULT_WS 0
+#define UART_DEFAULT_PPP 0
+#define UART_DEFAULT_MQTT 0
+#define UART_DEFAULT_MQTT_QOS 0
+#define UART_DEFAULT_FILTER "" // Every line
+#define UART_DEFAULT_SAMPLE 1
+#define UART_DEFAULT_IPV6 0 // IPv4 only listener
+#define UART_EVENT_QUEUE_SIZE 32
+
+// Multiplexed listener carrying all UARTs, 0 disables
+#define MUX_DEFAULT_TCP_PORT 0
+
+// Store and forward flash spill partition (see partitions.csv)
+#define SF_PARTITION_LABEL "sfbuf"
+#define SF_PARTITION_SUBTYPE 0x40
 
 // WIFI
 #define WIFI_MODE_AP 0
@@ -0,0 +1,863 @@
+#include <algorithm>
+#include <array>
+#include <stdio.h>
+#include <string.h>
+#include "control.h"
+#include "wifi.h"
+#include "storage.h"
+#include "storage_keys.h"
+#include "constants.h"
+#include "network.h"
+#include "uart_server.h"
+#include "mem.h"
+#include "ota.h"
+#include "cpu.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "lwip/sockets.h"
+#include "sdkconfig.h"
+
+// Entries in one SET, a whole configuration fits
+#define CONTROL_MAX_ENTRIES 96
+// Largest stored value, a port's filter patterns and their terminator
+#define CONTROL_MAX_VALUE (FILTER_PATTERNS_MAX + 1)
+// Previous strings and blobs of one SET, for the rollback: every filter,
+// the SSID, the password and the BSSID
+#define CONTROL_ROLLBACK_SIZE (UART_NUM_MAX * FILTER_PATTERNS_MAX + WIFI_SSID_MAX_LENGTH + WIFI_PASSWD_MAX_LENGTH + 6)
+
+// Strings are read and written with their terminator
+static_assert(CONTROL_MAX_VALUE >= FILTER_PATTERNS_MAX + 1, "filter patterns do not fit a control value");
+static_assert(CONTROL_MAX_VALUE >= WIFI_SSID_MAX_LENGTH + 1, "SSID does not fit a control value");
+static_assert(CONTROL_MAX_VALUE >= WIFI_PASSWD_MAX_LENGTH + 1, "password does not fit a control value");
+// A silent client is dropped after this long, the next one waits meanwhile
+#define CONTROL_IDLE_TIMEOUT_S 60
+#define CONTROL_TASK_STACK 6144
+
+namespace control
+{
+    static const char *TAG = "CONTROL";
+
+#if CONFIG_SER2IP32_CONTROL_PORT > 0
+    MEM_STATIC_TASKS(control_task, 1, CONTROL_TASK_STACK)
+#define CONTROL_TASK_STORAGE MEM_TASK_STORAGE(control_task, 0)
+#else
+#define CONTROL_TASK_STORAGE (mem::task_storage_t{NULL, NULL})
+#endif
+
+    // How a new value reaches a running port, the rest waits for a restart
+    enum apply_t
+    {
+        APPLY_RESTART,
+        APPLY_BAUDS,
+        APPLY_DATA_BITS,
+        APPLY_PARITY,
+        APPLY_STOP_BITS,
+        APPLY_ROUTE,
+        APPLY_ROUTE_TEE,
+        APPLY_FILTER,
+        APPLY_SAMPLE,
+    };
+
+    struct setting_t
+    {
+        const char *format;
+        bool per_port;
+        type_t type;
+        // Value range of integers, length range of strings and blobs
+        int32_t min;
+        int32_t max;
+        apply_t apply;
+        // Not sent back by GET and LIST
+        bool write_only;
+    };
+
+    static const setting_t keys[] = {
+        {STORAGE_UART_ENABLE, true, TYPE_INT32, 0, 1, APPLY_RESTART, false},
+        {STORAGE_UART_BAUDS, true, TYPE_INT32, 300, 5000000, APPLY_BAUDS, false},
+        {STORAGE_UART_TCP_PORT, true, TYPE_INT32, 0, 65535, APPLY_RESTART, false},
+        {STORAGE_UART_TX_PIN, true, TYPE_INT32, -1, GPIO_NUM_MAX - 1, APPLY_RESTART, false},
+        {STORAGE_UART_RX_PIN, true, TYPE_INT32, -1, GPIO_NUM_MAX - 1, APPLY_RESTART, false},
+        {STORAGE_UART_TX_BUFFER, true, TYPE_INT32, 0, UART_BUFFER_MAX, APPLY_RESTART, false},
+        {STORAGE_UART_RX_BUFFER, true, TYPE_INT32, 0, UART_BUFFER_MAX, APPLY_RESTART, false},
+        {STORAGE_UART_DATA_BITS, true, TYPE_INT32, UART_DATA_5_BITS, UART_DATA_8_BITS, APPLY_DATA_BITS, false},
+        {STORAGE_UART_PARITY, true, TYPE_INT32, UART_PARITY_DISABLE, UART_PARITY_ODD, APPLY_PARITY, false},
+        {STORAGE_UART_STOP_BITS, true, TYPE_INT32, UART_STOP_BITS_1, UART_STOP_BITS_2, APPLY_STOP_BITS, false},
+        {STORAGE_UART_TLS, true, TYPE_INT32, 0, 1, APPLY_RESTART, false},
+        {STORAGE_UART_IFACE, true, TYPE_INT32, 0, network::IFACE_COUNT - 1, APPLY_RESTART, false},
+        {STORAGE_UART_SF_SIZE, true, TYPE_INT32, 0, 1 << 20, APPLY_RESTART, false},
+        {STORAGE_UART_SF_SPILL, true, TYPE_INT32, 0, 1, APPLY_RESTART, false},
+        {STORAGE_UART_SF_MARKERS, true, TYPE_INT32, 0, 1, APPLY_RESTART, false},
+        {STORAGE_UART_RTS_PIN, true, TYPE_INT32, -1, GPIO_NUM_MAX - 1, APPLY_RESTART, false},
+        {STORAGE_UART_RS485, true, TYPE_INT32, 0, 1, APPLY_RESTART, false},
+        {STORAGE_UART_PRE_GUARD, true, TYPE_INT32, 0, 1000000, APPLY_RESTART, false},
+        {STORAGE_UART_POST_GUARD, true, TYPE_INT32, 0, 1000000, APPLY_RESTART, false},
+        {STORAGE_UART_ECHO, true, TYPE_INT32, 0, 1, APPLY_RESTART, false},
+        {STORAGE_UART_FRAMING, true, TYPE_INT32, 0, 2, APPLY_RESTART, false},
+        {STORAGE_UART_ROUTE, true, TYPE_INT32, 0, (1 << UART_NUM_MAX) - 1, APPLY_ROUTE, false},
+        {STORAGE_UART_ROUTE_TEE, true, TYPE_INT32, 0, 1, APPLY_ROUTE_TEE, false},
+        {STORAGE_UART_PRIORITY, true, TYPE_INT32, 0, EGRESS_PRIORITIES - 1, APPLY_RESTART, false},
+        {STORAGE_UART_WEIGHT, true, TYPE_INT32, 1, EGRESS_MAX_WEIGHT, APPLY_RESTART, false},
+        {STORAGE_UART_RATE, true, TYPE_INT32, 0, INT32_MAX, APPLY_RESTART, false},
+        {STORAGE_UART_BURST, true, TYPE_INT32, 0, INT32_MAX, APPLY_RESTART, false},
+        {STORAGE_UART_AUTOBAUD, true, TYPE_INT32, 0, 1, APPLY_RESTART, false},
+        {STORAGE_UART_WS, true, TYPE_INT32, 0, 1, APPLY_RESTART, false},
+        {STORAGE_UART_PPP, true, TYPE_INT32, 0, 1, APPLY_RESTART, false},
+        {STORAGE_UART_MQTT, true, TYPE_INT32, 0, 1, APPLY_RESTART, false},
+        {STORAGE_UART_MQTT_QOS, true, TYPE_INT32, 0, 1, APPLY_RESTART, false},
+        {STORAGE_UART_FILTER, true, TYPE_STRING, 0, FILTER_PATTERNS_MAX, APPLY_FILTER, false},
+        {STORAGE_UART_SAMPLE, true, TYPE_INT32, 1, INT32_MAX, APPLY_SAMPLE, false},
+        {STORAGE_UART_IPV6, true, TYPE_INT32, 0, 1, APPLY_RESTART, false},
+        {STORAGE_MUX_TCP_PORT, false, TYPE_INT32, 0, 65535, APPLY_RESTART, false},
+        {STORAGE_WIFI_MODE, false, TYPE_INT32, WIFI_MODE_STA, WIFI_MODE_AP, APPLY_RESTART, false},
+        {STORAGE_WIFI_SSID, false, TYPE_STRING, 1, WIFI_SSID_MAX_LENGTH, APPLY_RESTART, false},
+        {STORAGE_WIFI_PASSWD, false, TYPE_STRING, 0, WIFI_PASSWD_MAX_LENGTH, APPLY_RESTART, true},
+        {STORAGE_WIFI_CHANNEL, false, TYPE_INT32, 1, 13, APPLY_RESTART, false},
+        {STORAGE_WIFI_BSSID, false, TYPE_BLOB, 6, 6, APPLY_RESTART, false},
+        {STORAGE_WIFI_STA_CHANNEL, false, TYPE_INT32, 0, 14, APPLY_RESTART, false},
+    };
+
+    static bool find_key(const char *name, const setting_t **key, int *port)
+    {
+        char expanded[16];
+        for (const setting_t &k : keys)
+            for (int i = 0; i < (k.per_port ? UART_NUM_MAX : 1); i++)
+            {
+                snprintf(expanded, sizeof(expanded), k.format, i);
+                if (!strcmp(expanded, name))
+                {
+                    *key = &k;
+                    *port = k.per_port ? i : -1;
+                    return true;
+                }
+            }
+        return false;
+    }
+
+    // Response payload, entries are dropped once it is full
+    struct writer_t
+    {
+        uint8_t *data;
+        size_t length;
+        bool full;
+
+        bool put(const void *bytes, size_t n)
+        {
+            if (full || length + n > CONTROL_MAX_PAYLOAD)
+            {
+                full = true;
+                return false;
+            }
+            memcpy(data + length, bytes, n);
+            length += n;
+            return true;
+        }
+
+        void byte(uint8_t value) { put(&value, 1); }
+
+        void entry(const char *name, type_t type, const void *value, size_t value_length)
+        {
+            size_t name_length = strlen(name);
+            if (full || length + 1 + name_length + 3 + value_length > CONTROL_MAX_PAYLOAD)
+            {
+                full = true;
+                return;
+            }
+            byte(name_length);
+            put(name, name_length);
+            byte(type);
+            byte(value_length >> 8);
+            byte(value_length & 0xFF);
+            put(value, value_length);
+        }
+
+        void int32(const char *name, int32_t value)
+        {
+            uint8_t be[4] = {(uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value};
+            entry(name, TYPE_INT32, be, sizeof(be));
+        }
+
+        void u64(const char *name, uint64_t value)
+        {
+            uint8_t be[8];
+            for (int i = 0; i < 8; i++)
+                be[i] = value >> (56 - 8 * i);
+            entry(name, TYPE_U64, be, sizeof(be));
+        }
+    };
+
+    // Request payload, every read is bounds checked
+    struct reader_t
+    {
+        const uint8_t *data;
+        size_t length;
+        size_t offset;
+
+        bool done() const { return offset >= length; }
+
+        bool take(const uint8_t **bytes, size_t n)
+        {
+            if (offset + n > length)
+                return false;
+            *bytes = data + offset;
+            offset += n;
+            return true;
+        }
+
+        bool name(char *out, size_t size)
+        {
+            const uint8_t *n;
+            const uint8_t *bytes;
+            if (!take(&n, 1) || *n == 0 || *n >= size || !take(&bytes, *n))
+                return false;
+            memcpy(out, bytes, *n);
+            out[*n] = 0;
+            return true;
+        }
+
+        bool value(type_t *type, const uint8_t **bytes, size_t *n)
+        {
+            const uint8_t *header;
+            if (!take(&header, 3))
+                return false;
+            *type = (type_t)header[0];
+            *n = header[1] << 8 | header[2];
+            return take(bytes, *n);
+        }
+    };
+
+    struct change_t
+    {
+        const setting_t *key;
+        int port;
+        char name[16];
+        type_t type;
+        const uint8_t *value;
+        uint16_t length;
+        int32_t number;
+        // Stored value before the batch, integers in place, the rest in the rollback area
+        bool was_set;
+        int32_t old_number;
+        uint16_t old_offset;
+        uint16_t old_length;
+    };
+
+    // Used by the one client being served
+    struct buffers_t
+    {
+        uint8_t request[CONTROL_MAX_PAYLOAD];
+        uint8_t response[CONTROL_MAX_PAYLOAD];
+        change_t changes[CONTROL_MAX_ENTRIES];
+        uint8_t rollback[CONTROL_ROLLBACK_SIZE];
+    };
+
+#if CONFIG_SER2IP32_STATIC_ALLOC && CONFIG_SER2IP32_CONTROL_PORT > 0
+    static buffers_t static_buffers;
+#endif
+    static buffers_t *buffers = NULL;
+
+    static status_t validate(change_t &c)
+    {
+        if (c.type == TYPE_UNSET)
+            return c.length == 0 ? STATUS_OK : STATUS_BAD_REQUEST;
+        if (c.type != c.key->type)
+            return STATUS_BAD_TYPE;
+        if (c.type == TYPE_INT32)
+        {
+            if (c.length != 4)
+                return STATUS_BAD_TYPE;
+            c.number = (int32_t)(c.value[0] << 24 | c.value[1] << 16 | c.value[2] << 8 | c.value[3]);
+            if (c.number < c.key->min || c.number > c.key->max)
+                return STATUS_OUT_OF_RANGE;
+            // UART_PARITY_DISABLE, EVEN and ODD are 0, 2 and 3
+            if (c.key->apply == APPLY_PARITY && c.number == 1)
+                return STATUS_OUT_OF_RANGE;
+            return STATUS_OK;
+        }
+        if ((int32_t)c.length < c.key->min || (int32_t)c.length > c.key->max)
+            return STATUS_OUT_OF_RANGE;
+        if (c.type == TYPE_STRING && memchr(c.value, 0, c.length))
+            return STATUS_BAD_REQUEST;
+        if (c.key->apply == APPLY_FILTER)
+        {
+            char patterns[FILTER_PATTERNS_MAX + 1];
+            memcpy(patterns, c.value, c.length);
+            patterns[c.length] = 0;
+            if (!line_filter::valid(patterns))
+                return STATUS_OUT_OF_RANGE;
+        }
+        return STATUS_OK;
+    }
+
+    static esp_err_t read_value(const setting_t *key, const char *name, uint8_t *out, size_t *length)
+    {
+        if (key->type == TYPE_INT32)
+        {
+            int32_t value;
+            esp_err_t err = storage::read_int32(STORAGE_NAMESPACE, name, &value);
+            if (err == ESP_OK)
+            {
+                memcpy(out, &value, sizeof(value));
+                *length = sizeof(value);
+            }
+            return err;
+        }
+        size_t size = CONTROL_MAX_VALUE;
+        esp_err_t err = key->type == TYPE_STRING ? storage::read_string(STORAGE_NAMESPACE, name, (char *)out, &size)
+                                                 : storage::read_blob(STORAGE_NAMESPACE, name, out, &size);
+        if (err == ESP_OK)
+            // Strings are read with their terminator
+            *length = key->type == TYPE_STRING ? strlen((char *)out) : size;
+        return err;
+    }
+
+    static esp_err_t write_value(const setting_t *key, const char *name, const uint8_t *value, size_t length)
+    {
+        if (key->type == TYPE_INT32)
+        {
+            int32_t number;
+            memcpy(&number, value, sizeof(number));
+            return storage::write_int32(STORAGE_NAMESPACE, name, number);
+        }
+        if (key->type == TYPE_STRING)
+        {
+            char text[CONTROL_MAX_VALUE];
+            memcpy(text, value, length);
+            text[length] = 0;
+            return storage::write_string(STORAGE_NAMESPACE, name, text);
+        }
+        return storage::write_blob(STORAGE_NAMESPACE, name, value, length);
+    }
+
+    static void put_value(writer_t &out, const setting_t *key, const char *name, const uint8_t *value, size_t length)
+    {
+        if (key->type == TYPE_INT32)
+        {
+            int32_t number;
+            memcpy(&number, value, sizeof(number));
+            out.int32(name, number);
+        }
+        else
+            out.entry(name, key->type, value, length);
+    }
+
+    // Running port, false if the value has to wait for a restart
+    static bool apply(const change_t &c)
+    {
+        uart_server *server = c.port >= 0 ? uart_server::get((uart_port_t)c.port) : NULL;
+        if (c.key->apply == APPLY_RESTART || !server || c.type == TYPE_UNSET)
+            return false;
+        uart_port_t uart = (uart_port_t)c.port;
+        switch (c.key->apply)
+        {
+        case APPLY_BAUDS:
+            return uart_set_baudrate(uart, c.number) == ESP_OK;
+        case APPLY_DATA_BITS:
+            return uart_set_word_length(uart, (uart_word_length_t)c.number) == ESP_OK;
+        case APPLY_PARITY:
+            return uart_set_parity(uart, (uart_parity_t)c.number) == ESP_OK;
+        case APPLY_STOP_BITS:
+            return uart_set_stop_bits(uart, (uart_stop_bits_t)c.number) == ESP_OK;
+        case APPLY_ROUTE:
+            server->set_route(c.number, server->route_tee());
+            return true;
+        case APPLY_ROUTE_TEE:
+            server->set_route(server->routes(), c.number != 0);
+            return true;
+        case APPLY_FILTER:
+        {
+            char patterns[FILTER_PATTERNS_MAX + 1];
+            memcpy(patterns, c.value, c.length);
+            patterns[c.length] = 0;
+            return server->set_filter(patterns, server->filter() ? server->filter()->sample() : UART_DEFAULT_SAMPLE);
+        }
+        case APPLY_SAMPLE:
+            return server->set_filter(server->filter() ? server->filter()->patterns() : UART_DEFAULT_FILTER, c.number);
+        default:
+            return false;
+        }
+    }
+
+    static const uint8_t *old_value(const change_t &c)
+    {
+        return c.key->type == TYPE_INT32 ? (const uint8_t *)&c.old_number : buffers->rollback + c.old_offset;
+    }
+
+    // Stored values of the batch, before anything is written
+    static status_t save_old(size_t count)
+    {
+        size_t used = 0;
+        uint8_t value[CONTROL_MAX_VALUE];
+        for (size_t i = 0; i < count; i++)
+        {
+            change_t &c = buffers->changes[i];
+            size_t length = 0;
+            c.was_set = read_value(c.key, c.name, value, &length) == ESP_OK;
+            if (!c.was_set)
+                continue;
+            c.old_length = length;
+            if (c.key->type == TYPE_INT32)
+            {
+                memcpy(&c.old_number, value, sizeof(c.old_number));
+                continue;
+            }
+            if (used + length > CONTROL_ROLLBACK_SIZE)
+                return STATUS_BAD_REQUEST;
+            c.old_offset = used;
+            memcpy(buffers->rollback + used, value, length);
+            used += length;
+        }
+        return STATUS_OK;
+    }
+
+    static void set_reply(writer_t &out, status_t status, size_t entry, uint8_t flags)
+    {
+        out.byte(status);
+        out.byte(entry);
+        out.byte(flags);
+    }
+
+    // All entries are checked before the first write. NVS has no
+    // transactions: if a write fails, the ones before it are put back
+    static void handle_set(reader_t &in, writer_t &out)
+    {
+        size_t count = 0;
+        while (!in.done())
+        {
+            if (count == CONTROL_MAX_ENTRIES)
+                return set_reply(out, STATUS_BAD_REQUEST, count, 0);
+            change_t &c = buffers->changes[count];
+            const uint8_t *value;
+            size_t length;
+            status_t status = STATUS_OK;
+            if (!in.name(c.name, sizeof(c.name)) || !in.value(&c.type, &value, &length))
+                status = STATUS_BAD_REQUEST;
+            else if (!find_key(c.name, &c.key, &c.port))
+                status = STATUS_UNKNOWN_KEY;
+            else
+            {
+                c.value = value;
+                c.length = length;
+                status = validate(c);
+            }
+            if (status != STATUS_OK)
+                return set_reply(out, status, count, 0);
+            count++;
+        }
+        if (count == 0)
+            return set_reply(out, STATUS_BAD_REQUEST, 0, 0);
+        status_t saved = save_old(count);
+        if (saved != STATUS_OK)
+            return set_reply(out, saved, 0, 0);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            change_t &c = buffers->changes[i];
+            esp_err_t err;
+            if (c.type == TYPE_UNSET)
+            {
+                err = storage::erase_key(STORAGE_NAMESPACE, c.name);
+                if (err == ESP_ERR_NVS_NOT_FOUND)
+                    err = ESP_OK;
+            }
+            else if (c.type == TYPE_INT32)
+                err = write_value(c.key, c.name, (const uint8_t *)&c.number, sizeof(c.number));
+            else
+                err = write_value(c.key, c.name, c.value, c.length);
+            if (err == ESP_OK)
+                continue;
+
+            ESP_LOGE(TAG, "Writing %s failed: %s, rolling back", c.name, esp_err_to_name(err));
+            for (size_t j = 0; j <= i; j++)
+            {
+                change_t &done = buffers->changes[j];
+                if (done.was_set)
+                    write_value(done.key, done.name, old_value(done), done.old_length);
+                else
+                    storage::erase_key(STORAGE_NAMESPACE, done.name);
+            }
+            return set_reply(out, STATUS_STORAGE_ERROR, i, 0);
+        }
+
+        uint8_t flags = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            const change_t &c = buffers->changes[i];
+            if (!apply(c))
+                flags |= CONTROL_FLAG_RESTART;
+            ESP_LOGI(TAG, "%s %s", c.name, c.type == TYPE_UNSET ? "back to default" : "set");
+        }
+        set_reply(out, STATUS_OK, 0, flags);
+    }
+
+    static void handle_get(reader_t &in, writer_t &out)
+    {
+        // Status first, replaced if a name fails
+        out.byte(STATUS_OK);
+        uint8_t value[CONTROL_MAX_VALUE];
+        while (!in.done())
+        {
+            char name[16];
+            const setting_t *key;
+            int port;
+            size_t length;
+            status_t status = STATUS_OK;
+            if (!in.name(name, sizeof(name)))
+                status = STATUS_BAD_REQUEST;
+            else if (!find_key(name, &key, &port))
+                status = STATUS_UNKNOWN_KEY;
+            else if (key->write_only)
+                status = STATUS_WRITE_ONLY;
+            if (status != STATUS_OK)
+            {
+                out.length = 0;
+                out.full = false;
+                out.byte(status);
+                return;
+            }
+            if (read_value(key, name, value, &length) == ESP_OK)
+                put_value(out, key, name, value, length);
+            else
+                out.entry(name, TYPE_UNSET, NULL, 0);
+        }
+    }
+
+    static void handle_list(writer_t &out)
+    {
+        out.byte(STATUS_OK);
+        uint8_t value[CONTROL_MAX_VALUE];
+        char name[16];
+        for (const setting_t &k : keys)
+        {
+            if (k.write_only)
+                continue;
+            for (int i = 0; i < (k.per_port ? UART_NUM_MAX : 1); i++)
+            {
+                size_t length;
+                snprintf(name, sizeof(name), k.format, i);
+                if (read_value(&k, name, value, &length) == ESP_OK)
+                    put_value(out, &k, name, value, length);
+            }
+        }
+    }
+
+    static void handle_stats(writer_t &out)
+    {
+        static const char *iface_names[network::IFACE_COUNT] = {"any", "eth", "wifi"};
+        char name[40];
+        out.byte(STATUS_OK);
+        out.u64("uptime_ms", esp_timer_get_time() / 1000);
+        out.u64("heap.free", heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+        out.u64("heap.min_free", heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+
+        for (int i = network::IFACE_ETHERNET; i < network::IFACE_COUNT; i++)
+        {
+            network::iface_stats stats;
+            network::get_stats((network::iface_t)i, &stats);
+#define IFACE_STAT(field, value)                                   \
+    snprintf(name, sizeof(name), "%s." field, iface_names[i]); \
+    out.u64(name, value)
+            IFACE_STAT("up", stats.up);
+            IFACE_STAT("rx_bytes", stats.rx_bytes);
+            IFACE_STAT("tx_bytes", stats.tx_bytes);
+            IFACE_STAT("sessions", stats.sessions);
+            IFACE_STAT("failovers", stats.failovers);
+#undef IFACE_STAT
+        }
+
+#if CONFIG_SER2IP32_CPU_STATS
+        // Microseconds of CPU in the last window, per group and port
+        static cpu::window_t window;
+        bool have_cpu = cpu::last_window(&window);
+        if (have_cpu)
+        {
+            out.u64("cpu.window_us", window.length_us);
+            out.u64("cpu.sample_us", window.sample_us);
+            for (int g = 0; g < cpu::GROUP_COUNT; g++)
+            {
+                snprintf(name, sizeof(name), "cpu.%s_us", cpu::group_name((cpu::group_t)g));
+                out.u64(name, window.group_us[g]);
+            }
+            out.u64("cpu.cycles_per_byte", cpu::device_cycles_per_byte(window));
+        }
+#endif
+
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (!server)
+                continue;
+#define PORT_STAT(field, value)                          \
+    snprintf(name, sizeof(name), "uart%d." field, i); \
+    out.u64(name, value)
+            const uart_buffers::sizes_t &rings = uart_buffers::installed((uart_port_t)i);
+            PORT_STAT("serial_rx", server->serial_rx());
+            PORT_STAT("serial_tx", server->serial_tx());
+            PORT_STAT("connected", server->connected());
+            PORT_STAT("rx_ring", rings.rx);
+            PORT_STAT("tx_ring", rings.tx);
+            PORT_STAT("regrows", server->regrows());
+            PORT_STAT("routed", server->routed());
+            PORT_STAT("route_drops", server->route_drops());
+#if CONFIG_SER2IP32_CPU_STATS
+            if (have_cpu)
+            {
+                PORT_STAT("cpu_us", window.port_us[i]);
+                PORT_STAT("cycles_per_byte", cpu::cycles_per_byte(window, i));
+            }
+#endif
+            if (server->filter())
+            {
+                const line_filter::stats_t &filter = server->filter()->stats();
+                PORT_STAT("filter.lines_kept", filter.lines_kept);
+                PORT_STAT("filter.lines_dropped", filter.lines_dropped);
+                PORT_STAT("filter.bytes_kept", filter.bytes_kept);
+                PORT_STAT("filter.bytes_dropped", filter.bytes_dropped);
+                PORT_STAT("filter.overlong", filter.overlong);
+            }
+            if (server->sf())
+            {
+                const store_forward::stats_t &sf = server->sf()->stats();
+                PORT_STAT("sf.stored", sf.stored);
+                PORT_STAT("sf.forwarded", sf.forwarded);
+                PORT_STAT("sf.spilled", sf.spilled);
+                PORT_STAT("sf.spill_us", sf.spill_us);
+                PORT_STAT("sf.spill_max_us", sf.spill_max_us);
+                PORT_STAT("sf.inline_erases", sf.inline_erases);
+                PORT_STAT("sf.dropped", sf.dropped);
+                PORT_STAT("sf.backlogs", sf.backlogs);
+            }
+            if (server->rs485())
+            {
+                const rs485_port::stats_t &bus = server->rs485()->stats();
+                PORT_STAT("rs485.frames_tx", bus.frames_tx);
+                PORT_STAT("rs485.collisions", bus.collisions);
+                PORT_STAT("rs485.echo_missing", bus.echo_missing);
+                PORT_STAT("rs485.guard_discarded", bus.guard_discarded);
+                PORT_STAT("rs485.tx_dropped", bus.tx_dropped);
+            }
+            if (server->framer())
+            {
+                const frame_batcher::stats_t &framing = server->framer()->stats();
+                PORT_STAT("framing.frames", framing.seq);
+                PORT_STAT("framing.overflows", framing.overflows);
+                PORT_STAT("framing.errors", framing.errors);
+                if (server->framer()->integrity())
+                {
+                    PORT_STAT("framing.gap_entries", framing.gap_entries);
+                    PORT_STAT("framing.discarded_frames", framing.discarded_frames);
+                    PORT_STAT("framing.discarded_bytes", framing.discarded_bytes);
+                    PORT_STAT("framing.crc_bytes", framing.crc_bytes);
+                    PORT_STAT("framing.crc_cycles", framing.crc_cycles);
+                }
+            }
+            if (server->baud_detector())
+            {
+                const autobaud::stats_t &ab = server->baud_detector()->stats();
+                PORT_STAT("autobaud.rate", ab.rate);
+                PORT_STAT("autobaud.error_bursts", ab.error_bursts);
+            }
+            if (server->ppp())
+            {
+                const ppp_link::stats_t &ppp = server->ppp()->stats();
+                PORT_STAT("ppp.up", server->ppp()->state() == ppp_link::STATE_UP);
+                PORT_STAT("ppp.connects", ppp.connects);
+                PORT_STAT("ppp.disconnects", ppp.disconnects);
+            }
+#if CONFIG_SER2IP32_MQTT
+            if (mqtt_bridge::registered((uart_port_t)i))
+            {
+                const mqtt_bridge::stats_t &mq = mqtt_bridge::stats((uart_port_t)i);
+                PORT_STAT("mqtt.published", mq.published);
+                PORT_STAT("mqtt.received", mq.received);
+                PORT_STAT("mqtt.dropped", mq.dropped);
+                PORT_STAT("mqtt.expired", mq.expired);
+                PORT_STAT("mqtt.window_full", mq.window_full);
+                PORT_STAT("mqtt.in_flight", mq.in_flight);
+            }
+#endif
+            if (egress::registered((uart_port_t)i))
+            {
+                const egress::stats_t &eg = egress::stats((uart_port_t)i);
+                PORT_STAT("egress.sent", eg.sent);
+                PORT_STAT("egress.dropped", eg.dropped);
+                PORT_STAT("egress.throttled", eg.throttled);
+                PORT_STAT("egress.blocked", eg.blocked);
+            }
+#undef PORT_STAT
+        }
+
+        const ota::stats_t &update = ota::stats();
+        out.u64("ota.state", ota::state());
+        out.u64("ota.written", update.written);
+        out.u64("ota.throttled_ms", update.throttled_ms);
+
+        mux_server::stats_t &mux = mux_server::stats();
+        out.u64("mux.sessions", mux.sessions);
+        out.u64("mux.overruns", mux.overruns);
+
+        wifi::reconnect_stats wifi_stats;
+        wifi::get_reconnect_stats(&wifi_stats);
+        out.u64("wifi.disconnections", wifi_stats.disconnections);
+        out.u64("wifi.roams", wifi_stats.roams);
+    }
+
+    static bool check_token(const uint8_t *token, size_t length)
+    {
+        const char *expected = CONFIG_SER2IP32_CONTROL_TOKEN;
+        size_t expected_length = strlen(expected);
+        // Same time whatever byte differs
+        uint8_t diff = length != expected_length;
+        for (size_t i = 0; i < expected_length; i++)
+            diff |= expected[i] ^ (i < length ? token[i] : 0);
+        return diff == 0;
+    }
+
+    // A firmware image replaces everything, so an open control plane can not
+    // update it, and an image is only taken unsigned if allowed in menuconfig
+    static bool ota_allowed()
+    {
+#if CONFIG_SECURE_SIGNED_APPS || CONFIG_SER2IP32_OTA_UNSIGNED
+        return strlen(CONFIG_SER2IP32_CONTROL_TOKEN) != 0;
+#else
+        return false;
+#endif
+    }
+
+    static bool read_frame(asio::ip::tcp::socket &socket, uint8_t *header, uint8_t *payload, size_t *length)
+    {
+        std::error_code ec;
+        asio::read(socket, asio::buffer(header, CONTROL_HEADER_SIZE), ec);
+        if (ec)
+            return false;
+        *length = header[2] << 8 | header[3];
+        if (*length > CONTROL_MAX_PAYLOAD)
+            return false;
+        asio::read(socket, asio::buffer(payload, *length), ec);
+        return !ec;
+    }
+
+    static bool write_frame(asio::ip::tcp::socket &socket, uint8_t op, uint8_t id, const uint8_t *payload, size_t length)
+    {
+        std::error_code ec;
+        uint8_t header[CONTROL_HEADER_SIZE] = {op, id, (uint8_t)(length >> 8), (uint8_t)length};
+        std::array<asio::const_buffer, 2> buffers = {asio::buffer(header), asio::buffer(payload, length)};
+        asio::write(socket, buffers, ec);
+        return !ec;
+    }
+
+    static void serve(asio::ip::tcp::socket &socket)
+    {
+        struct timeval timeout = {CONTROL_IDLE_TIMEOUT_S, 0};
+        setsockopt(socket.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        bool authenticated = strlen(CONFIG_SER2IP32_CONTROL_TOKEN) == 0;
+        uint8_t ports = 0;
+        for (int i = 0; i < UART_NUM_MAX; i++)
+            if (uart_server::get((uart_port_t)i))
+                ports |= BIT(i);
+        uint8_t hello[] = {CONTROL_VERSION, !authenticated, ports};
+        if (!write_frame(socket, OP_HELLO, 0, hello, sizeof(hello)))
+            return;
+
+        uint8_t header[CONTROL_HEADER_SIZE];
+        size_t length;
+        while (read_frame(socket, header, buffers->request, &length))
+        {
+            reader_t in = {buffers->request, length, 0};
+            writer_t out = {buffers->response, 0, false};
+            op_t op = (op_t)header[0];
+            bool restart = false;
+            if (op == OP_AUTH)
+            {
+                authenticated = authenticated || check_token(buffers->request, length);
+                out.byte(authenticated ? STATUS_OK : STATUS_AUTH_REQUIRED);
+                if (!authenticated)
+                    ESP_LOGW(TAG, "Wrong token");
+            }
+            else if (!authenticated)
+                out.byte(STATUS_AUTH_REQUIRED);
+            else if (op == OP_GET)
+                handle_get(in, out);
+            else if (op == OP_SET)
+                handle_set(in, out);
+            else if (op == OP_LIST)
+                handle_list(out);
+            else if (op == OP_STATS)
+                handle_stats(out);
+            else if ((op == OP_OTA_BEGIN || op == OP_OTA_DATA || op == OP_OTA_END) && !ota_allowed())
+                out.byte(STATUS_OTA_DISABLED);
+            else if (op == OP_OTA_BEGIN)
+            {
+                const uint8_t *size;
+                if (!in.take(&size, 4))
+                    out.byte(STATUS_BAD_REQUEST);
+                else
+                    out.byte(ota::begin(size[0] << 24 | size[1] << 16 | size[2] << 8 | size[3]) == ESP_OK ? STATUS_OK : STATUS_OTA_ERROR);
+            }
+            else if (op == OP_OTA_DATA)
+                out.byte(ota::write(buffers->request, length) == ESP_OK ? STATUS_OK : STATUS_OTA_ERROR);
+            else if (op == OP_OTA_END)
+                out.byte(ota::end() == ESP_OK ? STATUS_OK : STATUS_OTA_ERROR);
+            else if (op == OP_RESTART)
+            {
+                out.byte(STATUS_OK);
+                restart = true;
+            }
+            else
+                out.byte(STATUS_BAD_REQUEST);
+
+            if (!write_frame(socket, op, header[1], buffers->response, out.length))
+                return;
+            if (restart)
+            {
+                ESP_LOGI(TAG, "Restart requested");
+                std::error_code ec;
+                socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+                vTaskDelay(pdMS_TO_TICKS(100));
+                esp_restart();
+            }
+        }
+    }
+
+    // One client at a time, outside the io_context: NVS writes block
+    static void server_task(void *arg)
+    {
+        auto acceptor = (asio::ip::tcp::acceptor *)arg;
+        while (1)
+        {
+            std::error_code ec;
+            asio::ip::tcp::socket socket(acceptor->get_executor());
+            acceptor->accept(socket, ec);
+            if (ec)
+            {
+                vTaskDelay(pdMS_TO_TICKS(1000));
+                continue;
+            }
+            serve(socket);
+            // An update is only kept if the client finished it
+            ota::abort();
+            socket.close(ec);
+        }
+    }
+
+    void start_server(asio::io_context *io_context, short port)
+    {
+#if CONFIG_SER2IP32_STATIC_ALLOC && CONFIG_SER2IP32_CONTROL_PORT > 0
+        buffers = &static_buffers;
+        mem::count(mem::SUBSYSTEM_CONTROL, sizeof(buffers_t), true);
+#else
+        buffers = new buffers_t;
+        mem::count(mem::SUBSYSTEM_CONTROL, sizeof(buffers_t));
+#endif
+        auto acceptor = new asio::ip::tcp::acceptor(*io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port));
+        ESP_LOGI(TAG, "Control on port %d%s%s", port, strlen(CONFIG_SER2IP32_CONTROL_TOKEN) ? ", token required" : "",
+                 ota_allowed() ? "" : ", firmware updates disabled");
+        // Lowest priority: firmware updates are written from this task and must not delay the ports
+        mem::create_task(server_task, "control", CONTROL_TASK_STACK, acceptor, tskIDLE_PRIORITY + 1, tskNO_AFFINITY,
+                         mem::SUBSYSTEM_CONTROL, CONTROL_TASK_STORAGE);
+    }
+}
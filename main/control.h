@@ -0,0 +1,72 @@
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "asio.hpp"
+
+// Binary control plane: every NVS setting of storage_keys.h, statistics and
+// restart over TCP, without the console jumper. One client is served at a
+// time. Requests and responses share one frame, big endian like the mux:
+//
+//   | op (1) | id (1) | length (2) | payload (length) |
+//
+// A response echoes op and id, its payload starts with a status byte. Values
+// are carried in entries:
+//
+//   | name length (1) | name | type (1) | value length (2) | value |
+//
+// Names are the NVS keys with the port number filled in, e.g. UART_BAUDS_1.
+// On connect the device sends OP_HELLO: version (1), auth required
+// (1), enabled ports mask (1). With CONFIG_SER2IP32_CONTROL_TOKEN set, only
+// OP_AUTH with the token is accepted until it succeeded.
+#define CONTROL_HEADER_SIZE 4
+#define CONTROL_VERSION 1
+#define CONTROL_MAX_PAYLOAD 2048
+// SET response flag: some of the values take effect after a restart
+#define CONTROL_FLAG_RESTART 0x01
+
+namespace control
+{
+    enum op_t : uint8_t
+    {
+        OP_HELLO = 0x01,
+        OP_AUTH = 0x02,      // Token; response: status
+        OP_GET = 0x10,       // Names, each length (1) and name; response: status, entries
+        OP_SET = 0x11,       // Entries, all or none; response: status, failed entry (1), flags (1)
+        OP_LIST = 0x12,      // Response: status, an entry per stored setting
+        OP_STATS = 0x20,     // Response: status, TYPE_U64 entries
+        OP_RESTART = 0x30,   // Response: status, then the device restarts
+        OP_OTA_BEGIN = 0x40, // Image size (4); response: status
+        OP_OTA_DATA = 0x41,  // Next bytes of the image; response: status
+        OP_OTA_END = 0x42    // Response: status, the image boots after OP_RESTART
+    };
+
+    enum type_t : uint8_t
+    {
+        TYPE_UNSET = 0,  // In SET: erase, back to the firmware default
+        TYPE_INT32 = 1,
+        TYPE_STRING = 2, // Without terminator
+        TYPE_BLOB = 3,
+        TYPE_U64 = 4,
+    };
+
+    enum status_t : uint8_t
+    {
+        STATUS_OK = 0,
+        STATUS_BAD_REQUEST,
+        STATUS_UNKNOWN_KEY,
+        STATUS_BAD_TYPE,
+        STATUS_OUT_OF_RANGE,
+        STATUS_STORAGE_ERROR,
+        STATUS_AUTH_REQUIRED,
+        STATUS_WRITE_ONLY,
+        STATUS_OTA_ERROR,
+        // Firmware updates need a token, and signed images unless allowed
+        STATUS_OTA_DISABLED,
+    };
+
+    void start_server(asio::io_context *io_context, short port);
+}
+
+#endif
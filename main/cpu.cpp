@@ -0,0 +1,172 @@
+#include "cpu.h"
+
+#if CONFIG_SER2IP32_CPU_STATS
+
+#include <mutex>
+#include <string.h>
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "uart_server.h"
+
+#if !CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS || !CONFIG_FREERTOS_USE_TRACE_FACILITY
+#error "CPU accounting needs FreeRTOS run-time stats (CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS)"
+#endif
+
+namespace cpu
+{
+    static const char *TAG = "CPU";
+
+    struct counter_t
+    {
+        TaskHandle_t handle;
+        uint32_t counter;
+    };
+
+    static esp_timer_handle_t timer = NULL;
+    static TaskHandle_t io_handle = NULL;
+    // Only used from the esp_timer task
+    static TaskStatus_t status[CPU_MAX_TASKS];
+    static counter_t previous[CPU_MAX_TASKS];
+    static int previous_count = 0;
+    static int64_t previous_time = 0;
+    static uint64_t previous_bytes[UART_NUM_MAX];
+    static window_t building;
+    // Last complete window, copied out under the lock
+    static window_t last;
+    static bool have_last = false;
+    static std::mutex lock;
+
+    static group_t group_of(const TaskStatus_t &task, int *port)
+    {
+        *port = -1;
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            if (server && server->task() == task.xHandle)
+            {
+                *port = i;
+                return GROUP_UART;
+            }
+        }
+        if (task.xHandle == io_handle)
+            return GROUP_IO;
+        if (!strcmp(task.pcTaskName, "CONSOLE"))
+            return GROUP_CONSOLE;
+        if (!strcmp(task.pcTaskName, "wifi"))
+            return GROUP_WIFI;
+        if (!strcmp(task.pcTaskName, "tiT"))
+            return GROUP_LWIP;
+        if (!strncmp(task.pcTaskName, "IDLE", 4))
+            return GROUP_IDLE;
+        return GROUP_OTHER;
+    }
+
+    static uint32_t elapsed(TaskHandle_t handle, uint32_t counter)
+    {
+        for (int i = 0; i < previous_count; i++)
+            if (previous[i].handle == handle)
+                return counter - previous[i].counter;
+        // Created during the window
+        return counter;
+    }
+
+    // esp_timer task. uxTaskGetSystemState suspends the scheduler while it
+    // walks the task lists, a few tens of microseconds for the whole device
+    static void sample(void *arg)
+    {
+        int64_t start = esp_timer_get_time();
+        uint32_t total;
+        int count = uxTaskGetSystemState(status, CPU_MAX_TASKS, &total);
+        if (count == 0)
+        {
+            ESP_LOGW(TAG, "More than %d tasks, raise CPU_MAX_TASKS", CPU_MAX_TASKS);
+            return;
+        }
+
+        window_t &w = building;
+        memset(&w, 0, sizeof(w));
+        w.length_us = start - previous_time;
+        w.task_count = count;
+        for (int i = 0; i < count; i++)
+        {
+            const TaskStatus_t &s = status[i];
+            task_t &t = w.tasks[i];
+            int port;
+            strlcpy(t.name, s.pcTaskName, sizeof(t.name));
+            t.group = group_of(s, &port);
+            t.port = port;
+            // Counters wrap after 71 minutes, windows are far shorter
+            t.us = elapsed(s.xHandle, s.ulRunTimeCounter);
+            w.group_us[t.group] += t.us;
+            if (port >= 0)
+                w.port_us[port] += t.us;
+        }
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *server = uart_server::get((uart_port_t)i);
+            uint64_t bytes = server ? server->serial_rx() + server->serial_tx() : 0;
+            w.port_bytes[i] = bytes - previous_bytes[i];
+            previous_bytes[i] = bytes;
+        }
+
+        for (int i = 0; i < count; i++)
+            previous[i] = {status[i].xHandle, status[i].ulRunTimeCounter};
+        previous_count = count;
+        bool first = previous_time == 0;
+        previous_time = start;
+        w.sample_us = esp_timer_get_time() - start;
+        // The first pass only sets the baseline
+        if (first)
+            return;
+
+        std::lock_guard<std::mutex> guard(lock);
+        last = w;
+        have_last = true;
+    }
+
+    void start(TaskHandle_t io_task)
+    {
+        io_handle = io_task;
+        sample(NULL);
+        esp_timer_create_args_t timer_args = {};
+        timer_args.callback = &sample;
+        timer_args.name = "cpu_sample";
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer));
+        ESP_ERROR_CHECK(esp_timer_start_periodic(timer, CONFIG_SER2IP32_CPU_WINDOW_MS * 1000));
+    }
+
+    bool last_window(window_t *window)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (have_last)
+            *window = last;
+        return have_last;
+    }
+
+    const char *group_name(group_t group)
+    {
+        static const char *names[GROUP_COUNT] = {"uart", "io", "console", "wifi", "lwip", "idle", "other"};
+        return group < GROUP_COUNT ? names[group] : "?";
+    }
+
+    uint32_t cycles_per_byte(const window_t &window, int port)
+    {
+        if (!window.port_bytes[port])
+            return 0;
+        return (uint64_t)window.port_us[port] * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ / window.port_bytes[port];
+    }
+
+    uint32_t device_cycles_per_byte(const window_t &window)
+    {
+        uint64_t bytes = 0;
+        uint64_t busy = 0;
+        for (int i = 0; i < UART_NUM_MAX; i++)
+            bytes += window.port_bytes[i];
+        for (int g = 0; g < GROUP_COUNT; g++)
+            if (g != GROUP_IDLE)
+                busy += window.group_us[g];
+        return bytes ? busy * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ / bytes : 0;
+    }
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef _CPU_H_
+#define _CPU_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/uart.h"
+#include "sdkconfig.h"
+
+// CPU accounting, built with CONFIG_SER2IP32_CPU_STATS. FreeRTOS run-time
+// stats add the esp_timer microseconds a task ran to its counter at every
+// context switch. Every CONFIG_SER2IP32_CPU_WINDOW_MS a timer reads all the
+// counters at once and keeps what each task used during the window, so the
+// figures are recent load and not averages since boot.
+//
+// Tasks are put in groups: the UART task of each port, the io_context
+// (main task, every socket of the ports), console, Wi-Fi, lwIP and idle.
+// A port's cycles per byte are the cycles of its UART task over the serial
+// bytes it read and wrote in the window. The io_context, lwIP and Wi-Fi are
+// shared by the ports, so the device's cycles per byte, all busy cycles over
+// all serial bytes, is given as well.
+#define CPU_MAX_TASKS 32
+
+namespace cpu
+{
+    enum group_t
+    {
+        GROUP_UART,
+        GROUP_IO,
+        GROUP_CONSOLE,
+        GROUP_WIFI,
+        GROUP_LWIP,
+        GROUP_IDLE,
+        GROUP_OTHER,
+        GROUP_COUNT
+    };
+
+    struct task_t
+    {
+        char name[configMAX_TASK_NAME_LEN];
+        group_t group;
+        // Port of a UART task, -1 otherwise
+        int8_t port;
+        uint32_t us;
+    };
+
+    struct window_t
+    {
+        uint32_t length_us;
+        int task_count;
+        task_t tasks[CPU_MAX_TASKS];
+        uint32_t group_us[GROUP_COUNT];
+        uint32_t port_us[UART_NUM_MAX];
+        uint32_t port_bytes[UART_NUM_MAX];
+        // Time taken to read the counters and build this window
+        uint32_t sample_us;
+    };
+
+    // io_task: the task running the io_context
+    void start(TaskHandle_t io_task);
+    // Copy of the last complete window, false before the first one
+    bool last_window(window_t *window);
+    const char *group_name(group_t group);
+    // 0 without serial traffic in the window
+    uint32_t cycles_per_byte(const window_t &window, int port);
+    uint32_t device_cycles_per_byte(const window_t &window);
+}
+
+#endif
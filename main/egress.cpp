@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <atomic>
+#include "egress.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/stream_buffer.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "lwip/opt.h"
+#include "esp_timer.h"
+#include "trace.h"
+#include "mem.h"
+#include "sdkconfig.h"
+
+// Bytes queued per port, a full queue holds back the port's UART task
+#define EGRESS_QUEUE_SIZE 4096
+// Bytes per weight unit and turn
+#define EGRESS_QUANTUM 512
+// Largest single socket write
+#define EGRESS_CHUNK 1024
+// WebSocket header or TLS record expansion of a chunk
+#define EGRESS_RECORD_OVERHEAD 128
+// Tokens are kept in byte microseconds, slow rates keep their remainder
+#define EGRESS_TOKEN 1000000LL
+#define EGRESS_TASK_STACK 4096
+
+// A socket is writable with more than TCP_SNDLOWAT bytes free, a chunk
+// written then never waits for the peer
+static_assert(EGRESS_CHUNK + EGRESS_RECORD_OVERHEAD < TCP_SNDLOWAT, "Egress chunk larger than the TCP send low water mark");
+
+#if CONFIG_SER2IP32_EGRESS
+MEM_STATIC_TASKS(egress_task, 1, EGRESS_TASK_STACK)
+#define EGRESS_TASK_STORAGE MEM_TASK_STORAGE(egress_task, 0)
+#else
+#define EGRESS_TASK_STORAGE (mem::task_storage_t{NULL, NULL})
+#endif
+#if CONFIG_SER2IP32_STATIC_ALLOC && CONFIG_SER2IP32_EGRESS
+// Stream buffers need one byte more than they hold
+static uint8_t queue_storage[UART_NUM_MAX][EGRESS_QUEUE_SIZE + 1];
+static StaticStreamBuffer_t queue_buffers[UART_NUM_MAX];
+static StaticSemaphore_t idle_buffers[UART_NUM_MAX];
+#endif
+
+namespace egress
+{
+    static const char *TAG = "EGRESS";
+
+    struct port_t
+    {
+        StreamBufferHandle_t queue;
+        sink_t sink;
+        writable_t writable;
+        port_config_t config;
+        int64_t tokens;
+        int64_t refilled;
+        stats_t stats;
+        // Pushed and not yet written or dropped, the semaphore is given when
+        // it drops to 0
+        std::atomic<size_t> pending;
+        SemaphoreHandle_t idle;
+        std::atomic<uint32_t> drops;
+    };
+
+    static port_t ports[UART_NUM_MAX];
+    static TaskHandle_t task = NULL;
+    // Port to start from in each level, rotated after every turn
+    static int next_port[EGRESS_PRIORITIES];
+    static uint8_t chunk[EGRESS_CHUNK];
+
+    bool enabled()
+    {
+#if CONFIG_SER2IP32_EGRESS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    static int64_t bucket_size(const port_t &p)
+    {
+        return (int64_t)(p.config.burst ? p.config.burst : EGRESS_CHUNK) * EGRESS_TOKEN;
+    }
+
+    static void refill(port_t &p, int64_t now)
+    {
+        if (p.config.rate == 0)
+            return;
+        p.tokens = std::min(bucket_size(p), p.tokens + (now - p.refilled) * p.config.rate);
+        p.refilled = now;
+    }
+
+    static bool ready(const port_t &p)
+    {
+        return p.queue && xStreamBufferBytesAvailable(p.queue) > 0 &&
+               (p.config.rate == 0 || p.tokens >= EGRESS_TOKEN) && p.writable();
+    }
+
+    // Highest level first, round robin within the level
+    static int pick()
+    {
+        for (int level = EGRESS_PRIORITIES - 1; level >= 0; level--)
+            for (int k = 0; k < UART_NUM_MAX; k++)
+            {
+                int i = (next_port[level] + k) % UART_NUM_MAX;
+                if (ports[i].config.priority == level && ready(ports[i]))
+                    return i;
+            }
+        return -1;
+    }
+
+    // One turn: up to weight quanta, less if the queue empties, the tokens
+    // run out or the socket fills. Queues are byte streams, so nothing is
+    // left to carry over
+    static void serve(int i)
+    {
+        port_t &p = ports[i];
+        int64_t budget = (int64_t)p.config.weight * EGRESS_QUANTUM;
+        while (budget > 0)
+        {
+            size_t n = std::min((size_t)budget, (size_t)EGRESS_CHUNK);
+            if (p.config.rate)
+            {
+                n = std::min(n, (size_t)(p.tokens / EGRESS_TOKEN));
+                if (n == 0)
+                {
+                    p.stats.throttled++;
+                    break;
+                }
+            }
+            n = xStreamBufferReceive(p.queue, chunk, n, 0);
+            if (n == 0)
+                break;
+            TRACE(DEQUEUE, i, n);
+            if (p.sink(chunk, n))
+                p.stats.sent += n;
+            else
+            {
+                p.stats.dropped += n;
+                p.drops++;
+            }
+            if ((p.pending -= n) == 0)
+                xSemaphoreGive(p.idle);
+            budget -= n;
+            if (p.config.rate)
+                p.tokens -= (int64_t)n * EGRESS_TOKEN;
+            if (budget > 0 && xStreamBufferBytesAvailable(p.queue) > 0 && !p.writable())
+            {
+                p.stats.blocked++;
+                break;
+            }
+        }
+        next_port[p.config.priority] = (i + 1) % UART_NUM_MAX;
+    }
+
+    // Until the first throttled port has a byte of tokens again. A port
+    // waiting for its socket is polled every tick
+    static TickType_t idle_wait()
+    {
+        TickType_t wait = portMAX_DELAY;
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            const port_t &p = ports[i];
+            if (!p.queue || xStreamBufferBytesAvailable(p.queue) == 0)
+                continue;
+            if (p.config.rate == 0 || p.tokens >= EGRESS_TOKEN)
+            {
+                wait = 1;
+                continue;
+            }
+            int64_t us = (EGRESS_TOKEN - p.tokens) / p.config.rate + 1;
+            TickType_t ticks = (us + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000);
+            wait = std::min(wait, std::max((TickType_t)1, ticks));
+        }
+        return wait;
+    }
+
+    static void egress_task(void *arg)
+    {
+        while (1)
+        {
+            int64_t now = esp_timer_get_time();
+            for (int i = 0; i < UART_NUM_MAX; i++)
+                refill(ports[i], now);
+            int i = pick();
+            if (i < 0)
+                ulTaskNotifyTake(pdTRUE, idle_wait());
+            else
+                serve(i);
+        }
+    }
+
+    void register_port(uart_port_t uart, const port_config_t &config, sink_t sink, writable_t writable)
+    {
+        port_t &p = ports[uart];
+        p.sink = sink;
+        p.writable = writable;
+        p.config = config;
+        p.config.priority = std::min(config.priority, (uint8_t)(EGRESS_PRIORITIES - 1));
+        p.config.weight = std::max((uint8_t)1, std::min(config.weight, (uint8_t)EGRESS_MAX_WEIGHT));
+        p.tokens = bucket_size(p);
+        p.refilled = esp_timer_get_time();
+        p.stats = {};
+        p.pending = 0;
+        p.drops = 0;
+#if CONFIG_SER2IP32_STATIC_ALLOC && CONFIG_SER2IP32_EGRESS
+        p.queue = xStreamBufferCreateStatic(EGRESS_QUEUE_SIZE, 1, queue_storage[uart], &queue_buffers[uart]);
+        p.idle = xSemaphoreCreateBinaryStatic(&idle_buffers[uart]);
+        mem::count(mem::SUBSYSTEM_EGRESS, EGRESS_QUEUE_SIZE + 1 + sizeof(StaticStreamBuffer_t) + sizeof(StaticSemaphore_t), true);
+#else
+        p.queue = xStreamBufferCreate(EGRESS_QUEUE_SIZE, 1);
+        p.idle = xSemaphoreCreateBinary();
+        mem::count(mem::SUBSYSTEM_EGRESS, EGRESS_QUEUE_SIZE + 1 + sizeof(StaticStreamBuffer_t) + sizeof(StaticSemaphore_t));
+#endif
+        ESP_LOGI(TAG, "Uart %d: priority %u, weight %u, rate %u B/s, burst %u", uart, p.config.priority,
+                 p.config.weight, p.config.rate, p.config.burst);
+
+        if (!task)
+            task = mem::create_task(egress_task, "egress", EGRESS_TASK_STACK, NULL, configMAX_PRIORITIES - 1,
+                                    CONFIG_SER2IP32_UART_TASK_CORE < 0 ? tskNO_AFFINITY : CONFIG_SER2IP32_UART_TASK_CORE,
+                                    mem::SUBSYSTEM_EGRESS, EGRESS_TASK_STORAGE);
+    }
+
+    void push(uart_port_t uart, const uint8_t *data, size_t length)
+    {
+        port_t &p = ports[uart];
+        TRACE(ENQUEUE, uart, length);
+        p.pending += length;
+        while (length > 0)
+        {
+            // The egress task reading the queue unblocks the send
+            size_t n = xStreamBufferSend(p.queue, data, length, portMAX_DELAY);
+            xTaskNotifyGive(task);
+            data += n;
+            length -= n;
+            p.stats.queued += n;
+        }
+        p.stats.queue_peak = std::max(p.stats.queue_peak, (uint32_t)xStreamBufferBytesAvailable(p.queue));
+    }
+
+    bool wait_idle(uart_port_t uart, TickType_t timeout)
+    {
+        port_t &p = ports[uart];
+        TickType_t start = xTaskGetTickCount();
+        while (p.pending > 0)
+        {
+            TickType_t waited = xTaskGetTickCount() - start;
+            // A give left over from an earlier idle only costs one more check
+            if (waited >= timeout || !xSemaphoreTake(p.idle, timeout - waited))
+                return p.pending == 0;
+        }
+        return true;
+    }
+
+    uint32_t drops(uart_port_t uart)
+    {
+        return ports[uart].drops;
+    }
+
+    bool registered(uart_port_t uart)
+    {
+        return uart < UART_NUM_MAX && ports[uart].queue != NULL;
+    }
+
+    const port_config_t &config(uart_port_t uart)
+    {
+        return ports[uart].config;
+    }
+
+    const stats_t &stats(uart_port_t uart)
+    {
+        return ports[uart].stats;
+    }
+}
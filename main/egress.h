@@ -0,0 +1,74 @@
+#ifndef _EGRESS_H_
+#define _EGRESS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include "freertos/FreeRTOS.h"
+#include "driver/uart.h"
+
+// Priority levels are 0 (served last) to EGRESS_PRIORITIES - 1
+#define EGRESS_PRIORITIES 8
+#define EGRESS_MAX_WEIGHT 16
+
+// Scheduler of the socket writes of all ports (CONFIG_SER2IP32_EGRESS).
+// UART tasks put their serial data in their port's queue and a single egress
+// task writes the queues to the sockets: strict priority between levels,
+// round robin in weighted byte quanta within a level, and an optional token
+// bucket rate cap per port. A saturated port then delays a higher priority
+// port by at most one of its turns, instead of filling the Wi-Fi TX queue
+// ahead of it. Ports whose socket is full are skipped until it drains, so a
+// stalled client only holds back its own port.
+namespace egress
+{
+    struct port_config_t
+    {
+        uint8_t priority;
+        // Quanta per turn within a level
+        uint8_t weight;
+        // Bytes per second, 0 for no cap
+        uint32_t rate;
+        // Bytes allowed at once above the rate, 0 for one chunk
+        uint32_t burst;
+    };
+
+    struct stats_t
+    {
+        uint64_t queued;
+        uint64_t sent;
+        // Reached the head of the queue while the port had no session, or
+        // the write failed
+        uint64_t dropped;
+        // Turns cut short by the rate cap
+        uint32_t throttled;
+        // Turns cut short by a full socket
+        uint32_t blocked;
+        uint32_t queue_peak;
+    };
+
+    // Writes to the port's current session, false if there is none or the
+    // write failed. Runs in the egress task, once writable returned true
+    typedef std::function<bool(const uint8_t *data, size_t length)> sink_t;
+    // True if the port's session takes a chunk without blocking, or if there
+    // is no session (the sink then drops it)
+    typedef std::function<bool()> writable_t;
+
+    bool enabled();
+    // Creates the port's queue, and the egress task with the first port
+    void register_port(uart_port_t uart, const port_config_t &config, sink_t sink, writable_t writable);
+    // Blocks while the port's queue is full. Only the port's UART task may call it
+    void push(uart_port_t uart, const uint8_t *data, size_t length);
+    // Waits up to timeout for everything pushed so far to be written or
+    // dropped, false if some is still on the way. Only the port's UART task
+    // may call it
+    bool wait_idle(uart_port_t uart, TickType_t timeout);
+    // Sink calls that dropped their data, to tell whether what was pushed
+    // since the port was last idle arrived
+    uint32_t drops(uart_port_t uart);
+
+    bool registered(uart_port_t uart);
+    const port_config_t &config(uart_port_t uart);
+    const stats_t &stats(uart_port_t uart);
+}
+
+#endif
@@ -8,6 +8,7 @@
 #include "esp_log.h"
 #include "driver/gpio.h"
 #include "sdkconfig.h"
+#include "network.h"
 
 namespace eth
 {
@@ -27,9 +28,11 @@ namespace eth
             ESP_LOGI(TAG, "Ethernet Link Up");
             ESP_LOGI(TAG, "Ethernet HW Addr %02x:%02x:%02x:%02x:%02x:%02x",
                     mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
+            network::start_ipv6(network::IFACE_ETHERNET);
             break;
         case ETHERNET_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "Ethernet Link Down");
+            network::set_link(network::IFACE_ETHERNET, false);
             break;
         case ETHERNET_EVENT_START:
             ESP_LOGI(TAG, "Ethernet Started");
@@ -55,21 +58,27 @@ namespace eth
         ESP_LOGI(TAG, "ETHMASK:" IPSTR, IP2STR(&ip_info->netmask));
         ESP_LOGI(TAG, "ETHGW:" IPSTR, IP2STR(&ip_info->gw));
         ESP_LOGI(TAG, "~~~~~~~~~~~");
+        network::set_link(network::IFACE_ETHERNET, true);
     }
 
     void init()
     {
-        // Initialize TCP/IP network interface (should be called only once in application)
-        ESP_ERROR_CHECK(esp_netif_init());
-        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_event_loop_create_default());
+        // TCP/IP stack and default event loop are shared with Wifi
+        network::init();
 
         //Enable RMII oscillator
         gpio_set_direction(GPIO_NUM_16, GPIO_MODE_OUTPUT);
         gpio_set_level(GPIO_NUM_16, 1);
 
         // Create new default instance of esp-netif for Ethernet
+        // Route priority above Wifi station (100), so the default route and
+        // therefore outgoing bulk traffic prefer Ethernet while it is up
+        esp_netif_inherent_config_t eth_base = ESP_NETIF_INHERENT_DEFAULT_ETH();
+        eth_base.route_prio = 200;
         esp_netif_config_t cfg = ESP_NETIF_DEFAULT_ETH();
+        cfg.base = &eth_base;
         esp_netif_t *eth_netif = esp_netif_new(&cfg);
+        network::register_netif(network::IFACE_ETHERNET, eth_netif);
         // Init MAC and PHY configs to default
         eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG();
         eth_phy_config_t phy_config = ETH_PHY_DEFAULT_CONFIG();
@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <string.h>
+#include "framing.h"
+#include "uart_timing.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "hal/cpu_hal.h"
+#include "trace.h"
+#include "mem.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "FRAMING";
+
+// Largest batch, headers included
+#define FRAMING_BUFFER_SIZE 1024
+// Payloads are read in place after room for the largest header, which is
+// then written right in front of them
+#define FRAMING_HEADER_ROOM (FRAMING_BATCH_HEADER_INTEGRITY + FRAMING_BATCH_MAX * FRAMING_FRAME_HEADER)
+#define FRAMING_ALLOCATION (FRAMING_HEADER_ROOM + FRAMING_BUFFER_SIZE)
+
+static inline uint8_t *put_be(uint8_t *p, uint64_t value, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--)
+        *p++ = value >> (8 * i);
+    return p;
+}
+
+frame_batcher::frame_batcher(uart_port_t uart, QueueHandle_t events, bool integrity)
+    : _uart(uart), _events(events), _integrity(integrity), _gaps(), _last_frames(0), _last_bytes(0), _last_gaps(),
+      _pending_flags(0), _carry(0), _carry_end(false), _carry_start(0), _stats()
+{
+    _gap_lock = portMUX_INITIALIZER_UNLOCKED;
+    _char_us = uart_char_time_us(uart);
+    _buffer = new uint8_t[FRAMING_ALLOCATION];
+    mem::count(mem::SUBSYSTEM_FRAMING, FRAMING_ALLOCATION);
+    ESP_LOGI(TAG, "Uart %d: timestamped framing%s, char %u us", uart, integrity ? " with integrity" : "", _char_us);
+}
+
+frame_batcher::~frame_batcher()
+{
+    delete[] _buffer;
+    mem::uncount(mem::SUBSYSTEM_FRAMING, FRAMING_ALLOCATION);
+}
+
+void frame_batcher::discarded(int location, uint32_t count, uint32_t bytes)
+{
+    if (!_integrity)
+        return;
+    portENTER_CRITICAL(&_gap_lock);
+    _gaps[location].count += count;
+    _gaps[location].bytes += bytes;
+    portEXIT_CRITICAL(&_gap_lock);
+}
+
+void frame_batcher::discard_last()
+{
+    _stats.discarded_frames += _last_frames;
+    _stats.discarded_bytes += _last_bytes;
+    discarded(FRAMING_GAP_NO_CLIENT, _last_frames, _last_bytes);
+    // The gaps it carried are still to be reported
+    for (int g = 0; g < FRAMING_GAP_COUNT; g++)
+        discarded(g, _last_gaps[g].count, _last_gaps[g].bytes);
+    _last_frames = 0;
+    _last_bytes = 0;
+    memset(_last_gaps, 0, sizeof(_last_gaps));
+}
+
+uint8_t *frame_batcher::read(size_t max_length, TickType_t timeout, size_t *length)
+{
+    int64_t starts[FRAMING_BATCH_MAX];
+    uint16_t lengths[FRAMING_BATCH_MAX];
+    uint8_t flags[FRAMING_BATCH_MAX];
+    uint8_t locations[FRAMING_BATCH_MAX];
+    uint8_t *payload = _buffer + FRAMING_HEADER_ROOM;
+    size_t batch_header = _integrity ? FRAMING_BATCH_HEADER_INTEGRITY : FRAMING_BATCH_HEADER;
+    size_t used = 0;
+    int count = 0;
+    // Data frames and their bytes, gap entries left out
+    int frames = 0;
+    size_t serial_bytes = 0;
+    int last_frame = -1;
+
+    *length = 0;
+    _last_frames = 0;
+    _last_bytes = 0;
+    memset(_last_gaps, 0, sizeof(_last_gaps));
+    max_length = std::min(max_length, (size_t)FRAMING_BUFFER_SIZE);
+    if (max_length < FRAMING_MIN_READ)
+        return _buffer;
+
+    // Events already queued arrived while the previous batch was being sent
+    UBaseType_t late = uxQueueMessagesWaiting(_events);
+    TickType_t wait = timeout;
+    while (count < FRAMING_BATCH_MAX)
+    {
+        size_t header = batch_header + (count + 1) * FRAMING_FRAME_HEADER;
+        if (header + used >= max_length)
+            break;
+
+        size_t event_bytes = 0;
+        bool end = false;
+        bool delayed = false;
+        int64_t start = -1;
+        if (_carry > 0)
+        {
+            event_bytes = _carry;
+            end = _carry_end;
+            start = _carry_start;
+            delayed = true;
+        }
+        else
+        {
+            uart_event_t event;
+            if (xQueueReceive(_events, &event, wait) != pdTRUE)
+            {
+                // Bytes moved to the ring without an event, after a full buffer
+                uart_get_buffered_data_len(_uart, &event_bytes);
+                if (event_bytes == 0)
+                    break;
+            }
+            else
+            {
+                TRACE(UART_EVENT, _uart, event.type << 16 | (event.size & 0xFFFF));
+                wait = 0;
+                delayed = late > 0;
+                if (late > 0)
+                    late--;
+                switch (event.type)
+                {
+                case UART_DATA:
+                    event_bytes = event.size;
+                    end = event.timeout_flag;
+                    break;
+                case UART_FIFO_OVF:
+                    _pending_flags |= FRAMING_FLAG_OVERFLOW;
+                    _stats.overflows++;
+                    discarded(FRAMING_GAP_FIFO, 1, 0);
+                    continue;
+                case UART_BUFFER_FULL:
+                    _pending_flags |= FRAMING_FLAG_BUFFER_FULL;
+                    _stats.buffer_full++;
+                    discarded(FRAMING_GAP_RING, 1, 0);
+                    continue;
+                case UART_BREAK:
+                    _pending_flags |= FRAMING_FLAG_BREAK;
+                    continue;
+                case UART_PARITY_ERR:
+                case UART_FRAME_ERR:
+                    _pending_flags |= FRAMING_FLAG_ERROR;
+                    _stats.errors++;
+                    continue;
+                default:
+                    continue;
+                }
+            }
+        }
+
+        // Pending gaps go in front of the frame when their entries fit along
+        // with a byte of it, otherwise they wait for the next frame
+        gap_t gaps[FRAMING_GAP_COUNT] = {};
+        int gap_entries = 0;
+        size_t gap_size = 0;
+        if (_integrity)
+        {
+            portENTER_CRITICAL(&_gap_lock);
+            for (int g = 0; g < FRAMING_GAP_COUNT; g++)
+                if (_gaps[g].count || _gaps[g].bytes)
+                    gap_entries++;
+            gap_size = gap_entries * (FRAMING_FRAME_HEADER + FRAMING_GAP_PAYLOAD);
+            if (gap_entries && count + gap_entries < FRAMING_BATCH_MAX && header + used + gap_size < max_length)
+            {
+                memcpy(gaps, _gaps, sizeof(gaps));
+                memset(_gaps, 0, sizeof(_gaps));
+            }
+            else
+            {
+                gap_entries = 0;
+                gap_size = 0;
+            }
+            portEXIT_CRITICAL(&_gap_lock);
+        }
+        size_t room = max_length - header - used - gap_size;
+        uint8_t *gap_payload = payload + used;
+        size_t data_offset = used + gap_entries * FRAMING_GAP_PAYLOAD;
+
+        int64_t now = esp_timer_get_time();
+        size_t n = std::min(event_bytes, room);
+        int got = uart_read_bytes(_uart, payload + data_offset, n, 0);
+        if (got <= 0)
+        {
+            // Already read along with an earlier event
+            _carry = 0;
+            if (end && last_frame >= 0)
+                flags[last_frame] |= FRAMING_FLAG_END;
+            for (int g = 0; g < FRAMING_GAP_COUNT; g++)
+                discarded(g, gaps[g].count, gaps[g].bytes);
+            continue;
+        }
+
+        // Split events keep their remainder for the next batch
+        _carry = (size_t)got == n ? event_bytes - n : 0;
+        bool frame_end = end && _carry == 0;
+        if (start < 0)
+            start = now - (int64_t)(got + (end ? CONFIG_SER2IP32_UART_RX_TIMEOUT_SYMBOLS : 0)) * _char_us;
+        if (last_frame >= 0)
+            start = std::max(start, starts[last_frame] + (int64_t)lengths[last_frame] * _char_us);
+        if (_carry > 0)
+        {
+            _carry_end = end;
+            _carry_start = start + (int64_t)got * _char_us;
+        }
+
+        for (int g = 0; g < FRAMING_GAP_COUNT; g++)
+        {
+            if (!gaps[g].count && !gaps[g].bytes)
+                continue;
+            gap_payload = put_be(gap_payload, gaps[g].count, 4);
+            gap_payload = put_be(gap_payload, gaps[g].bytes, 4);
+            starts[count] = start;
+            lengths[count] = FRAMING_GAP_PAYLOAD;
+            flags[count] = FRAMING_FLAG_GAP;
+            locations[count] = g;
+            _last_gaps[g].count += gaps[g].count;
+            _last_gaps[g].bytes += gaps[g].bytes;
+            _stats.gap_entries++;
+            count++;
+        }
+
+        starts[count] = start;
+        lengths[count] = got;
+        flags[count] = _pending_flags | (frame_end ? FRAMING_FLAG_END : 0) | (delayed ? FRAMING_FLAG_DELAYED : 0);
+        locations[count] = 0;
+        _pending_flags = 0;
+        used = data_offset + got;
+        serial_bytes += got;
+        last_frame = count;
+        frames++;
+        count++;
+    }
+
+    if (count == 0)
+        return _buffer;
+
+    // One header for the whole batch, in front of the payloads
+    size_t header = batch_header + count * FRAMING_FRAME_HEADER;
+    uint8_t *out = payload - header;
+    uint8_t *p = out;
+    *p++ = FRAMING_MAGIC0;
+    *p++ = FRAMING_MAGIC1;
+    *p++ = _integrity ? FRAMING_VERSION_INTEGRITY : FRAMING_VERSION;
+    *p++ = count;
+    p = put_be(p, _stats.seq, 4);
+    p = put_be(p, starts[0], 8);
+    uint8_t *crc_field = p;
+    if (_integrity)
+        p += 4;
+    for (int i = 0; i < count; i++)
+    {
+        p = put_be(p, starts[i] - starts[0], 4);
+        p = put_be(p, lengths[i], 2);
+        *p++ = flags[i];
+        *p++ = locations[i];
+    }
+    if (_integrity)
+    {
+        // ROM CRC, table driven. Cycles are counted on the core running the
+        // task, a preemption in between is counted too
+        uint32_t begin = cpu_hal_get_cycle_count();
+        uint32_t crc = esp_rom_crc32_le(0, out, FRAMING_BATCH_HEADER);
+        crc = esp_rom_crc32_le(crc, crc_field + 4, header - FRAMING_BATCH_HEADER_INTEGRITY + used);
+        _stats.crc_cycles += cpu_hal_get_cycle_count() - begin;
+        _stats.crc_bytes += header - 4 + used;
+        put_be(crc_field, crc, 4);
+    }
+    _stats.seq += frames;
+    _stats.batches++;
+    _last_frames = frames;
+    _last_bytes = serial_bytes;
+    *length = header + used;
+    return out;
+}
@@ -0,0 +1,131 @@
+#ifndef _FRAMING_H_
+#define _FRAMING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/uart.h"
+
+// Timestamped framing of the UART to TCP direction. Serial data is cut into
+// frames as the driver delivers it (UART_DATA events, ended by the RX idle
+// timeout or a full FIFO) and sent in batches, one header per batch:
+//
+//   batch header, 16 bytes, big endian:
+//     magic "ST" (2) | version (1) | frame count (1) | sequence of first frame (4) | base timestamp us (8)
+//   then per frame, 8 bytes:
+//     timestamp delta from base us (4) | length (2) | flags (1) | reserved (1)
+//   then the frame payloads, back to back
+//
+// Timestamps are esp_timer microseconds of the first byte of each frame on
+// the line. The sequence number counts frames per port.
+//
+// Integrity mode (version 2) adds a checksum and the data the device lost:
+//
+//   batch header, 20 bytes: as above, then CRC32 (4)
+//     CRC32 (IEEE, as zlib's crc32) of header bytes 0-15 then of every byte
+//     after the CRC field, entries and payloads
+//   gap entry, flags FRAMING_FLAG_GAP, reserved byte = location (FRAMING_GAP_*)
+//     payload, 8 bytes: count (4) | bytes (4), see the locations below
+//
+// A gap entry comes right before the first frame after the loss, with the
+// same timestamp, and takes no sequence number. Frames the device dropped
+// after framing them did take theirs, so the client sees a sequence gap of
+// exactly the count of a FRAMING_GAP_NO_CLIENT entry. A sequence gap that
+// no entry explains was lost between the device and the client.
+#define FRAMING_MAGIC0 'S'
+#define FRAMING_MAGIC1 'T'
+#define FRAMING_VERSION 1
+#define FRAMING_VERSION_INTEGRITY 2
+#define FRAMING_BATCH_HEADER 16
+#define FRAMING_BATCH_HEADER_INTEGRITY 20
+#define FRAMING_FRAME_HEADER 8
+#define FRAMING_GAP_PAYLOAD 8
+#define FRAMING_BATCH_MAX 16
+// Smallest read holding one header and a byte of payload, in either version.
+// Pending gap entries wait for a read with room for them
+#define FRAMING_MIN_READ (FRAMING_BATCH_HEADER_INTEGRITY + FRAMING_FRAME_HEADER + 1)
+
+// Frame flags
+#define FRAMING_FLAG_END 0x01         // Line went idle after this frame
+#define FRAMING_FLAG_OVERFLOW 0x02    // Driver lost bytes before this frame (FIFO overflow)
+#define FRAMING_FLAG_BUFFER_FULL 0x04 // Driver ring buffer filled up before this frame
+#define FRAMING_FLAG_BREAK 0x08       // Break condition before this frame
+#define FRAMING_FLAG_ERROR 0x10       // Parity or framing error before this frame
+#define FRAMING_FLAG_DELAYED 0x20     // Timestamped after the previous batch was sent, less precise
+#define FRAMING_FLAG_GAP 0x40         // Gap entry, integrity mode
+
+// Gap locations, integrity mode
+#define FRAMING_GAP_FIFO 0      // Hardware FIFO overflows, count of them, bytes unknown (0)
+#define FRAMING_GAP_RING 1      // Driver ring buffer full, count of times, bytes unknown (0)
+#define FRAMING_GAP_NO_CLIENT 2 // Batches read with no client to send them to, frames and serial bytes
+#define FRAMING_GAP_EGRESS 3    // Left in the egress queue when the client went, count 0, stream bytes
+#define FRAMING_GAP_COUNT 4
+
+class frame_batcher
+{
+public:
+  struct stats_t
+  {
+    uint32_t seq;
+    uint64_t batches;
+    uint32_t overflows;
+    uint32_t buffer_full;
+    uint32_t errors;
+    // Integrity mode
+    uint32_t gap_entries;
+    uint64_t discarded_frames;
+    uint64_t discarded_bytes;
+    // CPU cycles spent in the CRC, and the bytes it covered
+    uint64_t crc_cycles;
+    uint64_t crc_bytes;
+  };
+
+  // events: the driver event queue, from uart_driver_install.
+  // integrity: version 2 batches, with CRC32 and gap entries
+  frame_batcher(uart_port_t uart, QueueHandle_t events, bool integrity);
+  ~frame_batcher();
+
+  // Waits up to timeout for serial data and returns a batch of at most
+  // max_length bytes, headers included. The batch stays valid until the next call
+  uint8_t *read(size_t max_length, TickType_t timeout, size_t *length);
+  // UART task: the last batch read had no client, its frames are reported
+  // by a gap entry of a later batch
+  void discard_last();
+  // Any task: framed bytes dropped after read, see FRAMING_GAP_EGRESS
+  void discarded(int location, uint32_t count, uint32_t bytes);
+
+  bool integrity() const { return _integrity; }
+  const stats_t &stats() const { return _stats; }
+  // New queue after the driver was reinstalled
+  void set_events(QueueHandle_t events) { _events = events; }
+
+private:
+  struct gap_t
+  {
+    uint32_t count;
+    uint32_t bytes;
+  };
+
+  uart_port_t _uart;
+  QueueHandle_t _events;
+  bool _integrity;
+  uint32_t _char_us;
+  uint8_t *_buffer;
+  // Losses not reported yet, by location
+  gap_t _gaps[FRAMING_GAP_COUNT];
+  portMUX_TYPE _gap_lock;
+  // Last batch, taken back by discard_last
+  uint32_t _last_frames;
+  uint32_t _last_bytes;
+  gap_t _last_gaps[FRAMING_GAP_COUNT];
+  // Flags of events seen since the last frame, for the next one
+  uint8_t _pending_flags;
+  // Rest of a data event cut by the end of the previous batch
+  size_t _carry;
+  bool _carry_end;
+  int64_t _carry_start;
+  stats_t _stats;
+};
+
+#endif
@@ -0,0 +1,238 @@
+#include <string.h>
+#include "line_filter.h"
+#include "mem.h"
+
+// Trie edges not yet made, while compiling
+#define FILTER_NO_EDGE 0xFF
+#define FILTER_CLASS_OTHER 0
+#define FILTER_CLASS_LINE_START 1
+
+static_assert(FILTER_MAX_STATES < FILTER_NO_EDGE, "Matcher states do not fit uint8_t");
+
+line_filter::line_filter(size_t max_input, size_t headroom)
+    : _active(false), _sample(1), _sample_count(0), _classes(0), _states(0),
+      _line(LINE_KEEP), _state(0), _held(0), _headroom(headroom), _stats()
+{
+    _patterns[0] = 0;
+    // A kept line can come out with the whole held part in front of the read
+    _buffer_size = headroom + max_input + FILTER_LINE_MAX;
+    _buffer = new uint8_t[_buffer_size];
+    mem::count(mem::SUBSYSTEM_UART, _buffer_size);
+    compile("");
+}
+
+line_filter::~line_filter()
+{
+    delete[] _buffer;
+    mem::uncount(mem::SUBSYSTEM_UART, _buffer_size);
+}
+
+bool line_filter::valid(const char *patterns)
+{
+    if (strlen(patterns) > FILTER_PATTERNS_MAX)
+        return false;
+    int count = 0;
+    for (const char *p = patterns; *p;)
+    {
+        const char *end = strchr(p, '|');
+        size_t length = end ? end - p : strlen(p);
+        if (length > 0)
+            count++;
+        p += length + (end ? 1 : 0);
+    }
+    return count <= FILTER_MAX_PATTERNS;
+}
+
+// Aho-Corasick: the trie of the patterns, then the failure links folded in
+// breadth first, so that _next is a complete DFA
+void line_filter::compile(const char *patterns)
+{
+    memset(_class, FILTER_CLASS_OTHER, sizeof(_class));
+    memset(_next, FILTER_NO_EDGE, sizeof(_next));
+    memset(_accept, 0, sizeof(_accept));
+    _classes = 2;
+    _states = 1;
+
+    for (const char *p = patterns; *p;)
+    {
+        const char *end = strchr(p, '|');
+        size_t length = end ? end - p : strlen(p);
+        const char *next_pattern = p + length + (end ? 1 : 0);
+        if (length == 0)
+        {
+            p = next_pattern;
+            continue;
+        }
+        uint8_t state = 0;
+        for (size_t i = 0; i < length; i++)
+        {
+            uint8_t c;
+            if (i == 0 && p[0] == '^')
+                c = FILTER_CLASS_LINE_START;
+            else
+            {
+                uint8_t byte = p[i];
+                if (_class[byte] == FILTER_CLASS_OTHER)
+                    _class[byte] = _classes++;
+                c = _class[byte];
+            }
+            if (_next[state][c] == FILTER_NO_EDGE)
+                _next[state][c] = _states++;
+            state = _next[state][c];
+        }
+        _accept[state] = true;
+        p = next_pattern;
+    }
+
+    uint8_t fail[FILTER_MAX_STATES];
+    uint8_t queue[FILTER_MAX_STATES];
+    size_t head = 0, tail = 0;
+    fail[0] = 0;
+    for (int c = 0; c < _classes; c++)
+    {
+        uint8_t child = _next[0][c];
+        if (child == FILTER_NO_EDGE)
+            _next[0][c] = 0;
+        else
+        {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail)
+    {
+        uint8_t state = queue[head++];
+        // A pattern ending inside a longer one matches there too
+        _accept[state] |= _accept[fail[state]];
+        for (int c = 0; c < _classes; c++)
+        {
+            uint8_t child = _next[state][c];
+            if (child == FILTER_NO_EDGE)
+                _next[state][c] = _next[fail[state]][c];
+            else
+            {
+                fail[child] = _next[fail[state]][c];
+                queue[tail++] = child;
+            }
+        }
+    }
+}
+
+bool line_filter::configure(const char *patterns, uint32_t sample)
+{
+    if (!valid(patterns))
+        return false;
+    // patterns may be our own, from patterns()
+    char copy[FILTER_PATTERNS_MAX + 1];
+    strcpy(copy, patterns);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    strcpy(_patterns, copy);
+    compile(_patterns);
+    _sample = sample > 1 ? sample : 1;
+    _sample_count = 0;
+    _stats.bytes_dropped += _held;
+    _held = 0;
+    // The line in progress is not seen from its start, leave it out
+    _line = LINE_DROP;
+    _active = _states > 1 || _sample > 1;
+    return true;
+}
+
+bool line_filter::sampled()
+{
+    return _sample_count++ % _sample == 0;
+}
+
+// Next line, decided at once without patterns
+void line_filter::start_line()
+{
+    if (_states > 1)
+    {
+        _state = _next[0][FILTER_CLASS_LINE_START];
+        if (!_accept[_state])
+        {
+            _line = LINE_MATCHING;
+            return;
+        }
+    }
+    _line = sampled() ? LINE_KEEP : LINE_DROP;
+}
+
+uint8_t *line_filter::process(const uint8_t *in, size_t length, size_t *out_length)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    uint8_t *out = _buffer + _headroom;
+    size_t used = 0;
+    const uint8_t *end = in + length;
+    while (in < end)
+    {
+        if (_line != LINE_MATCHING)
+        {
+            const uint8_t *newline = (const uint8_t *)memchr(in, '\n', end - in);
+            size_t n = (newline ? newline + 1 : end) - in;
+            if (_line == LINE_KEEP)
+            {
+                memcpy(out + used, in, n);
+                used += n;
+                _stats.bytes_kept += n;
+            }
+            else
+                _stats.bytes_dropped += n;
+            in += n;
+            if (newline)
+            {
+                if (_line == LINE_KEEP)
+                    _stats.lines_kept++;
+                else
+                    _stats.lines_dropped++;
+                start_line();
+            }
+            continue;
+        }
+
+        uint8_t byte = *in++;
+        _held_line[_held++] = byte;
+        _state = _next[_state][_class[byte]];
+        if (_accept[_state])
+        {
+            if (sampled())
+            {
+                memcpy(out + used, _held_line, _held);
+                used += _held;
+                _stats.bytes_kept += _held;
+                _line = LINE_KEEP;
+            }
+            else
+            {
+                _stats.bytes_dropped += _held;
+                _line = LINE_DROP;
+            }
+            _held = 0;
+            if (byte == '\n')
+            {
+                if (_line == LINE_KEEP)
+                    _stats.lines_kept++;
+                else
+                    _stats.lines_dropped++;
+                start_line();
+            }
+        }
+        else if (byte == '\n')
+        {
+            _stats.bytes_dropped += _held;
+            _stats.lines_dropped++;
+            _held = 0;
+            start_line();
+        }
+        else if (_held == FILTER_LINE_MAX)
+        {
+            _stats.bytes_dropped += _held;
+            _stats.overlong++;
+            _held = 0;
+            _line = LINE_DROP;
+        }
+    }
+    *out_length = used;
+    return out;
+}
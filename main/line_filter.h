@@ -0,0 +1,96 @@
+#ifndef _LINE_FILTER_H_
+#define _LINE_FILTER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+
+// Patterns, '|' separated, as stored in NVS
+#define FILTER_PATTERNS_MAX 64
+#define FILTER_MAX_PATTERNS 8
+// A line undecided after this many bytes is dropped
+#define FILTER_LINE_MAX 256
+// Trie nodes and byte classes of the matcher: every pattern byte adds at
+// most one of each, plus the root, the line start and the other bytes
+#define FILTER_MAX_STATES (FILTER_PATTERNS_MAX + 1)
+#define FILTER_MAX_CLASSES (FILTER_PATTERNS_MAX + 2)
+
+// Line filter of the UART to network direction. Serial data is cut into
+// lines at '\n' and a line goes on only if it contains one of the patterns
+// (anywhere, or at its start for a pattern written ^prefix). Of the lines
+// that match, or of all lines without patterns, 1 in sample is kept.
+//
+// The patterns are compiled into one DFA (Aho-Corasick over byte classes),
+// so a byte costs a table lookup whatever the number of patterns. A line
+// is held until its first match or its end; once decided, the rest of it
+// is copied or skipped up to the next '\n' with memchr.
+class line_filter
+{
+public:
+  struct stats_t
+  {
+    uint64_t lines_kept;
+    uint64_t lines_dropped;
+    uint64_t bytes_kept;
+    uint64_t bytes_dropped;
+    // Lines dropped for reaching FILTER_LINE_MAX undecided
+    uint32_t overlong;
+  };
+
+  // headroom: bytes left free in front of the output, see send_in_place
+  line_filter(size_t max_input, size_t headroom);
+  ~line_filter();
+
+  // False if the patterns do not fit the limits above. A line in progress
+  // is dropped, the next one is filtered with the new settings
+  bool configure(const char *patterns, uint32_t sample);
+  static bool valid(const char *patterns);
+  // No patterns and no sampling: the port does not call process
+  bool active() const { return _active; }
+  const char *patterns() const { return _patterns; }
+  uint32_t sample() const { return _sample; }
+
+  // Returns the bytes of in to send, *length of them, valid until the next
+  // call. At most pending() + length bytes
+  uint8_t *process(const uint8_t *in, size_t length, size_t *out_length);
+  // Bytes of the held line
+  size_t pending() const { return _held; }
+
+  const stats_t &stats() const { return _stats; }
+
+private:
+  enum line_state_t
+  {
+    LINE_MATCHING, // Held until a pattern matches or the line ends
+    LINE_KEEP,     // Copied to the end of the line
+    LINE_DROP,     // Skipped to the end of the line
+  };
+
+  void compile(const char *patterns);
+  bool sampled();
+  void start_line();
+
+  std::mutex _mutex;
+  volatile bool _active;
+  char _patterns[FILTER_PATTERNS_MAX + 1];
+  uint32_t _sample;
+  uint32_t _sample_count;
+  // Matcher: byte to class, class 0 for bytes no pattern has and class 1
+  // fed at the start of each line
+  uint8_t _class[256];
+  uint8_t _classes;
+  uint8_t _states;
+  uint8_t _next[FILTER_MAX_STATES][FILTER_MAX_CLASSES];
+  bool _accept[FILTER_MAX_STATES];
+  // Line in progress
+  line_state_t _line;
+  uint8_t _state;
+  uint8_t _held_line[FILTER_LINE_MAX];
+  size_t _held;
+  uint8_t *_buffer;
+  size_t _buffer_size;
+  size_t _headroom;
+  stats_t _stats;
+};
+
+#endif
@@ -8,7 +8,19 @@
 #include "constants.h"
 #include "storage_keys.h"
 #include "ethernet.h"
+#include "network.h"
 #include "uart_server.h"
+#include "trace.h"
+#include "bench.h"
+#include "uart_buffers.h"
+#include "mem.h"
+#include "control.h"
+#include "ota.h"
+#include "web.h"
+#include "cpu.h"
+#if CONFIG_SER2IP32_TLS
+#include "tls_session.h"
+#endif
 
 const char *TAG = "SER2IP32";
 
@@ -23,7 +35,9 @@ void configure_uart(uart_port_t uartNum,
                     uart_word_length_t data_bits = UART_DEFAULT_DATA_BITS,
                     uart_parity_t parity = (uart_parity_t)UART_DEFAULT_PARITY,
                     uart_stop_bits_t stop_bits = UART_DEFAULT_STOP_BITS,
-                    uart_hw_flowcontrol_t flow_control = UART_HW_FLOWCTRL_DISABLE)
+                    uart_hw_flowcontrol_t flow_control = UART_HW_FLOWCTRL_DISABLE,
+                    bool rs485 = false,
+                    QueueHandle_t *events = NULL)
 {
   const uart_config_t uart_config = {
       .baud_rate = bauds,
@@ -32,8 +46,13 @@ void configure_uart(uart_port_t uartNum,
       .stop_bits = stop_bits,
       .flow_ctrl = flow_control};
   uart_param_config(uartNum, &uart_config);
-  uart_set_pin(uartNum, tx_pin, rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-  uart_driver_install(uartNum, buff_size_rx, buff_size_tx, 0, NULL, 0);
+  // RTS drives the transceiver's driver enable in RS-485 mode
+  uart_set_pin(uartNum, tx_pin, rx_pin, rs485 ? rts_pin : UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+  // The event queue is only needed by the timestamped framing
+  uart_driver_install(uartNum, buff_size_rx, buff_size_tx, events ? UART_EVENT_QUEUE_SIZE : 0, events, 0);
+  if (rs485)
+    uart_set_mode(uartNum, UART_MODE_RS485_HALF_DUPLEX);
+  uart_set_rx_timeout(uartNum, CONFIG_SER2IP32_UART_RX_TIMEOUT_SYMBOLS);
 }
 
 void start_wifi()
@@ -72,6 +91,26 @@ void start_uarts()
   asio::io_context io_context;
   uart_server *servers[3];
 
+  // Driver rings of all enabled ports are planned together, within the budget
+  int planned_bauds[UART_NUM_MAX] = {0};
+  uart_buffers::sizes_t fixed_sizes[UART_NUM_MAX] = {};
+  uart_buffers::sizes_t planned_sizes[UART_NUM_MAX];
+  for (int i = 0; i < 3; i++)
+  {
+    char STORAGE_KEY[50];
+    int32_t value = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_ENABLE, i);
+    if ((storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &value) == ESP_OK ? value : UART_DEFAULT_ENABLE[i]) == 0)
+      continue;
+    sprintf(STORAGE_KEY, STORAGE_UART_BAUDS, i);
+    planned_bauds[i] = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &value) == ESP_OK ? value : UART_DEFAULT_BAUDS;
+    sprintf(STORAGE_KEY, STORAGE_UART_TX_BUFFER, i);
+    fixed_sizes[i].tx = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &value) == ESP_OK && value > 0 ? value : UART_AUTO_BUFFER;
+    sprintf(STORAGE_KEY, STORAGE_UART_RX_BUFFER, i);
+    fixed_sizes[i].rx = storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &value) == ESP_OK && value > 0 ? value : UART_AUTO_BUFFER;
+  }
+  uart_buffers::plan(planned_bauds, fixed_sizes, planned_sizes);
+
   for (int i = 0; i < 3; i++)
   {
     // Aux vars
@@ -113,14 +152,14 @@ void start_uarts()
     // TX Buffer
     int32_t tx_buffer;
     sprintf(STORAGE_KEY, STORAGE_UART_TX_BUFFER, i);
-    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &tx_buffer) != ESP_OK)
-      tx_buffer = UART_DEFAULT_BUFFER;
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &tx_buffer) != ESP_OK || tx_buffer <= 0)
+      tx_buffer = planned_sizes[i].tx;
 
     // RX Buffer
     int32_t rx_buffer = 0;
     sprintf(STORAGE_KEY, STORAGE_UART_RX_BUFFER, i);
-    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &rx_buffer) != ESP_OK)
-      rx_buffer = UART_DEFAULT_BUFFER;
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &rx_buffer) != ESP_OK || rx_buffer <= 0)
+      rx_buffer = planned_sizes[i].rx;
 
     // Data bits
     int32_t data_bits;
@@ -140,19 +179,278 @@ void start_uarts()
     if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &stop_bits) != ESP_OK)
       stop_bits = UART_DEFAULT_STOP_BITS;
 
-    gpio_num_t rts = UART_DEFAULT_RTS_PIN[i];
+    // TLS
+    int32_t tls = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_TLS, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &tls) != ESP_OK)
+      tls = UART_DEFAULT_TLS;
+
+    // WebSocket
+    int32_t ws = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_WS, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &ws) != ESP_OK)
+      ws = UART_DEFAULT_WS;
+
+    // PPP over serial
+    int32_t ppp = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_PPP, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &ppp) != ESP_OK)
+      ppp = UART_DEFAULT_PPP;
+
+    // MQTT
+    int32_t mqtt = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_MQTT, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &mqtt) != ESP_OK)
+      mqtt = UART_DEFAULT_MQTT;
+
+    int32_t mqtt_qos = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_MQTT_QOS, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &mqtt_qos) != ESP_OK || mqtt_qos < 0 || mqtt_qos > 1)
+      mqtt_qos = UART_DEFAULT_MQTT_QOS;
+
+    // Dual-stack listener
+    int32_t ipv6 = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_IPV6, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &ipv6) != ESP_OK)
+      ipv6 = UART_DEFAULT_IPV6;
+
+    // Interface binding
+    int32_t iface = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_IFACE, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &iface) != ESP_OK || iface < 0 || iface >= network::IFACE_COUNT)
+      iface = UART_DEFAULT_IFACE;
+
+    // Store and forward
+    int32_t sf_size = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_SF_SIZE, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &sf_size) != ESP_OK || sf_size < 0)
+      sf_size = UART_DEFAULT_SF_SIZE;
+
+    int32_t sf_spill = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_SF_SPILL, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &sf_spill) != ESP_OK)
+      sf_spill = UART_DEFAULT_SF_SPILL;
+
+    int32_t sf_markers = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_SF_MARKERS, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &sf_markers) != ESP_OK)
+      sf_markers = UART_DEFAULT_SF_MARKERS;
+
+    // RTS Pin
+    int32_t rts_pin;
+    sprintf(STORAGE_KEY, STORAGE_UART_RTS_PIN, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &rts_pin) != ESP_OK)
+      rts_pin = UART_DEFAULT_RTS_PIN[i];
+
+    // RS-485 half duplex
+    int32_t rs485 = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_RS485, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &rs485) != ESP_OK)
+      rs485 = UART_DEFAULT_RS485;
+
+    int32_t pre_guard = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_PRE_GUARD, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &pre_guard) != ESP_OK || pre_guard < 0)
+      pre_guard = UART_DEFAULT_PRE_GUARD_US;
+
+    int32_t post_guard = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_POST_GUARD, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &post_guard) != ESP_OK || post_guard < 0)
+      post_guard = UART_DEFAULT_POST_GUARD_US;
+
+    int32_t echo = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_ECHO, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &echo) != ESP_OK)
+      echo = UART_DEFAULT_ECHO_SUPPRESS;
+
+    // Timestamped framing
+    int32_t framing = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_FRAMING, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &framing) != ESP_OK)
+      framing = UART_DEFAULT_FRAMING;
+    // Routing to other uarts
+    int32_t routes = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_ROUTE, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &routes) != ESP_OK)
+      routes = UART_DEFAULT_ROUTE;
+
+    int32_t route_tee = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_ROUTE_TEE, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &route_tee) != ESP_OK)
+      route_tee = UART_DEFAULT_ROUTE_TEE;
+
+    // Egress scheduling
+    int32_t priority = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_PRIORITY, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &priority) != ESP_OK || priority < 0 || priority >= EGRESS_PRIORITIES)
+      priority = UART_DEFAULT_PRIORITY;
+
+    int32_t weight = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_WEIGHT, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &weight) != ESP_OK || weight < 1 || weight > EGRESS_MAX_WEIGHT)
+      weight = UART_DEFAULT_WEIGHT;
+
+    int32_t rate = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_RATE, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &rate) != ESP_OK || rate < 0)
+      rate = UART_DEFAULT_RATE;
+
+    int32_t burst = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_BURST, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &burst) != ESP_OK || burst < 0)
+      burst = UART_DEFAULT_BURST;
+
+    // Automatic baud rate
+    int32_t auto_baud = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_AUTOBAUD, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &auto_baud) != ESP_OK)
+      auto_baud = UART_DEFAULT_AUTOBAUD;
+
+    // Line filter
+    char filter[FILTER_PATTERNS_MAX + 1] = UART_DEFAULT_FILTER;
+    size_t filter_length = sizeof(filter);
+    sprintf(STORAGE_KEY, STORAGE_UART_FILTER, i);
+    if (storage::read_string(STORAGE_NAMESPACE, STORAGE_KEY, filter, &filter_length) != ESP_OK || !line_filter::valid(filter))
+      strcpy(filter, UART_DEFAULT_FILTER);
+
+    int32_t sample = 0;
+    sprintf(STORAGE_KEY, STORAGE_UART_SAMPLE, i);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_KEY, &sample) != ESP_OK || sample < 1)
+      sample = UART_DEFAULT_SAMPLE;
+
+    if (framing && rs485)
+    {
+      ESP_LOGE("START_UART", "Uart N: %i timestamped framing is not available in RS-485 mode, disabled", i);
+      framing = 0;
+    }
+    if (framing && auto_baud)
+    {
+      ESP_LOGE("START_UART", "Uart N: %i automatic baud rate is not available with timestamped framing, disabled", i);
+      auto_baud = 0;
+    }
+
+#if CONFIG_SER2IP32_PPP
+    if (ppp && (rs485 || framing))
+    {
+      ESP_LOGE("START_UART", "Uart N: %i PPP mode is not available with RS-485 or timestamped framing, port not started", i);
+      continue;
+    }
+#else
+    if (ppp)
+    {
+      ESP_LOGE("START_UART", "Uart N: %i requires PPP but firmware was built without it, port not started", i);
+      continue;
+    }
+#endif
+#if !CONFIG_SER2IP32_MQTT
+    if (mqtt)
+    {
+      ESP_LOGE("START_UART", "Uart N: %i requires MQTT but firmware was built without it, port not started", i);
+      continue;
+    }
+#endif
+#if !CONFIG_SER2IP32_IPV6
+    if (ipv6)
+    {
+      ESP_LOGE("START_UART", "Uart N: %i requires IPv6 but firmware was built without it, port not started", i);
+      continue;
+    }
+#endif
+    if (mqtt && ppp)
+    {
+      ESP_LOGE("START_UART", "Uart N: %i MQTT and PPP modes are exclusive, port not started", i);
+      continue;
+    }
+    if (tls && ws)
+    {
+      ESP_LOGE("START_UART", "Uart N: %i WebSocket over TLS is not supported, port not started", i);
+      continue;
+    }
+#if CONFIG_SER2IP32_TLS
+    if (tls && !tls_session::init())
+    {
+      ESP_LOGE("START_UART", "Uart N: %i requires TLS but the TLS context failed, port not started", i);
+      continue;
+    }
+#else
+    if (tls)
+    {
+      ESP_LOGE("START_UART", "Uart N: %i requires TLS but firmware was built without it, port not started", i);
+      continue;
+    }
+#endif
+
+    gpio_num_t rts = static_cast<gpio_num_t>(rts_pin);
+    QueueHandle_t events = NULL;
     gpio_num_t cts = UART_DEFAULT_CTS_PIN[i];
 
-    ESP_LOGI("START_UART", "Uart N: %i, Enabled: %i, Bauds: %i, TCP: %d, "
-      "TXPin: %i, RXPin: %i, TXBuff: %d, RXBuff: %d, DataBits: %i, Parity: %i, StopBits: %i", 
-      i, enabled, bauds, tcp_port, tx_pin, rx_pin, tx_buffer, rx_buffer, data_bits, parity, stop_bits);
+    ESP_LOGI("START_UART", "Uart N: %i, Enabled: %i, Bauds: %i%s, TCP: %d, "
+      "TXPin: %i, RXPin: %i, TXBuff: %d, RXBuff: %d, DataBits: %i, Parity: %i, StopBits: %i, TLS: %i, WS: %i, PPP: %i, MQTT: %i/%i, IPv6: %i, Iface: %s, SF: %d/%i/%i, RS485: %i (RTS %i, guards %d/%d us, echo %i), Framing: %i, Routes: 0x%02x%s, Filter: \"%s\" 1/%d, Egress: %d/%d/%d/%d", 
+      i, enabled, bauds, auto_baud ? " (auto)" : "", tcp_port, tx_pin, rx_pin, tx_buffer, rx_buffer, data_bits, parity, stop_bits, tls, ws, ppp, mqtt, mqtt_qos, ipv6,
+      network::iface_name((network::iface_t)iface), sf_size, sf_spill, sf_markers, rs485, rts_pin, pre_guard, post_guard, echo, framing, routes, route_tee ? " tee" : "", filter, sample, priority, weight, rate, burst);
     configure_uart(static_cast<uart_port_t>(i), bauds, static_cast<gpio_num_t>(tx_pin), static_cast<gpio_num_t>(rx_pin), rts, cts, 
       tx_buffer, rx_buffer, 
-      static_cast<uart_word_length_t>(data_bits), static_cast<uart_parity_t>(parity), static_cast<uart_stop_bits_t>(stop_bits));
+      static_cast<uart_word_length_t>(data_bits), static_cast<uart_parity_t>(parity), static_cast<uart_stop_bits_t>(stop_bits),
+      UART_HW_FLOWCTRL_DISABLE, rs485 != 0, framing || auto_baud ? &events : NULL);
+    uart_buffers::set_installed(static_cast<uart_port_t>(i), {(size_t)rx_buffer, (size_t)tx_buffer});
     ESP_LOGI("START_UART", "Server Uart N: %i", i);
-    servers[i] = new uart_server(&io_context, tcp_port, (uart_port_t)i);
+    port_options options = {};
+    options.tls = tls != 0;
+    options.ws = ws != 0;
+    options.ppp = ppp != 0;
+    options.mqtt = mqtt != 0;
+    options.mqtt_qos = mqtt_qos;
+    options.ipv6 = ipv6 != 0;
+    options.iface = (network::iface_t)iface;
+    options.sf_size = sf_size;
+    options.sf_spill = sf_spill != 0;
+    options.sf_markers = sf_markers != 0;
+    options.rs485 = rs485 != 0;
+    options.rs485_pre_guard_us = pre_guard;
+    options.rs485_post_guard_us = post_guard;
+    options.rs485_echo_suppress = echo != 0;
+    options.framing = framing != 0;
+    options.integrity = framing == 2;
+    options.autobaud = auto_baud != 0;
+    options.routes = routes;
+    options.route_tee = route_tee != 0;
+    strcpy(options.filter, filter);
+    options.sample = sample;
+    options.egress.priority = priority;
+    options.egress.weight = weight;
+    options.egress.rate = rate;
+    options.egress.burst = burst;
+    options.uart_events = events;
+    servers[i] = new uart_server(&io_context, tcp_port, (uart_port_t)i, options);
   }
 
+  // Mux listener, after the servers so it knows the enabled ports
+  int32_t mux_port = 0;
+  if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_MUX_TCP_PORT, &mux_port) != ESP_OK)
+    mux_port = MUX_DEFAULT_TCP_PORT;
+  if (mux_port > 0)
+    new mux_server(&io_context, mux_port);
+
+#if CONFIG_SER2IP32_TRACE
+  trace::start_server(&io_context, CONFIG_SER2IP32_TRACE_PORT);
+#endif
+  if (CONFIG_SER2IP32_BENCH_PORT > 0)
+    bench::start_server(&io_context, CONFIG_SER2IP32_BENCH_PORT);
+  if (CONFIG_SER2IP32_CONTROL_PORT > 0)
+    control::start_server(&io_context, CONFIG_SER2IP32_CONTROL_PORT);
+#if CONFIG_SER2IP32_MQTT
+  mqtt_bridge::start();
+#endif
+#if CONFIG_SER2IP32_WEB
+  web::start(CONFIG_SER2IP32_WEB_PORT);
+#endif
+  // A freshly updated image is kept once the network is back
+  ota::check_boot();
+#if CONFIG_SER2IP32_CPU_STATS
+  // This task runs the io_context from here on
+  cpu::start(xTaskGetCurrentTaskHandle());
+#endif
+
   // Block here forever
   io_context.run();
 
@@ -161,6 +459,9 @@ void start_uarts()
 
 extern "C" void app_main()
 {
+  // Runs the io_context once the ports are started, its stack is reported too
+  mem::register_task(xTaskGetCurrentTaskHandle(), "main", CONFIG_ESP_MAIN_TASK_STACK_SIZE, mem::SUBSYSTEM_MAIN);
+
   // Initialize NVS
   storage::init_nvs();
 
@@ -181,6 +482,8 @@ extern "C" void app_main()
 
   // Start diaplay
   vTaskDelay(pdMS_TO_TICKS(100));
+  // Network stack, shared by Wifi and Ethernet
+  network::init();
   // Start Wifi
   start_wifi();
   // Start ethernet
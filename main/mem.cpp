@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+#include "mem.h"
+#include "esp_log.h"
+
+static const char *TAG = "MEM";
+
+namespace mem
+{
+    static task_info_t tasks[MEM_MAX_TASKS];
+    static std::atomic<int> tasks_used(0);
+    static std::atomic<size_t> static_bytes[SUBSYSTEM_COUNT];
+    static std::atomic<size_t> heap_bytes[SUBSYSTEM_COUNT];
+
+    static void add_task(TaskHandle_t handle, const char *name, uint32_t stack_size, subsystem_t subsystem, bool is_static)
+    {
+        int index = tasks_used++;
+        if (index >= MEM_MAX_TASKS)
+        {
+            tasks_used = MEM_MAX_TASKS;
+            ESP_LOGW(TAG, "Task %s not accounted, raise MEM_MAX_TASKS", name);
+            return;
+        }
+        task_info_t &task = tasks[index];
+        strlcpy(task.name, name, sizeof(task.name));
+        task.subsystem = subsystem;
+        task.stack_size = stack_size;
+        task.high_water = stack_size;
+        task.is_static = is_static;
+        // Set last, readers skip slots without a handle
+        task.handle = handle;
+    }
+
+    TaskHandle_t create_task(TaskFunction_t function, const char *name, uint32_t stack_size, void *arg,
+                             UBaseType_t priority, BaseType_t core, subsystem_t subsystem, task_storage_t storage)
+    {
+        TaskHandle_t handle = NULL;
+        if (storage.stack && storage.tcb)
+        {
+            handle = xTaskCreateStaticPinnedToCore(function, name, stack_size, arg, priority, storage.stack, storage.tcb, core);
+            count(subsystem, stack_size + sizeof(StaticTask_t), true);
+        }
+        else if (xTaskCreatePinnedToCore(function, name, stack_size, arg, priority, &handle, core) == pdPASS)
+            count(subsystem, stack_size + sizeof(StaticTask_t));
+        if (!handle)
+        {
+            ESP_LOGE(TAG, "Task %s not created, %u bytes of stack", name, stack_size);
+            return NULL;
+        }
+        add_task(handle, name, stack_size, subsystem, storage.stack != NULL);
+        return handle;
+    }
+
+    void register_task(TaskHandle_t handle, const char *name, uint32_t stack_size, subsystem_t subsystem)
+    {
+        add_task(handle, name, stack_size, subsystem, false);
+    }
+
+    void count(subsystem_t subsystem, size_t bytes, bool is_static)
+    {
+        (is_static ? static_bytes : heap_bytes)[subsystem] += bytes;
+    }
+
+    void uncount(subsystem_t subsystem, size_t bytes, bool is_static)
+    {
+        (is_static ? static_bytes : heap_bytes)[subsystem] -= bytes;
+    }
+
+    int task_count()
+    {
+        return std::min(tasks_used.load(), MEM_MAX_TASKS);
+    }
+
+    bool get_task(int index, task_info_t *info)
+    {
+        if (index < 0 || index >= task_count())
+            return false;
+        task_info_t &task = tasks[index];
+        if (!task.handle)
+            return false;
+        // Stack depth is in bytes on this port, StackType_t is a byte
+        task.high_water = uxTaskGetStackHighWaterMark(task.handle);
+        *info = task;
+        return true;
+    }
+
+    void get_usage(subsystem_t subsystem, usage_t *usage)
+    {
+        usage->static_bytes = static_bytes[subsystem];
+        usage->heap_bytes = heap_bytes[subsystem];
+    }
+
+    const char *subsystem_name(subsystem_t subsystem)
+    {
+        static const char *names[SUBSYSTEM_COUNT] = {
+            "uart", "egress", "rs485", "framing", "store_fwd", "mux", "console", "bench", "control", "main", "tls"};
+        return subsystem < SUBSYSTEM_COUNT ? names[subsystem] : "?";
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef _MEM_H_
+#define _MEM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+// RAM accounting. Tasks are created through create_task so that their stack
+// high-water marks can be reported, and long lived buffers are counted per
+// subsystem. With CONFIG_SER2IP32_STATIC_ALLOC, task stacks and control
+// blocks, and the fixed per port queues, are static arrays in internal DRAM:
+// they show up in the link map instead of failing at runtime.
+#if CONFIG_SER2IP32_STATIC_ALLOC
+#define MEM_STATIC_TASKS(name, count, stack_size) \
+    static StackType_t name##_stacks[count][stack_size]; \
+    static StaticTask_t name##_tcbs[count];
+#define MEM_TASK_STORAGE(name, i) (mem::task_storage_t{name##_stacks[i], &name##_tcbs[i]})
+#else
+#define MEM_STATIC_TASKS(name, count, stack_size)
+#define MEM_TASK_STORAGE(name, i) (mem::task_storage_t{NULL, NULL})
+#endif
+
+#define MEM_MAX_TASKS 12
+
+namespace mem
+{
+    enum subsystem_t
+    {
+        SUBSYSTEM_UART,
+        SUBSYSTEM_EGRESS,
+        SUBSYSTEM_RS485,
+        SUBSYSTEM_FRAMING,
+        SUBSYSTEM_STORE_FORWARD,
+        SUBSYSTEM_MUX,
+        SUBSYSTEM_CONSOLE,
+        SUBSYSTEM_BENCH,
+        SUBSYSTEM_CONTROL,
+        SUBSYSTEM_MAIN,
+        SUBSYSTEM_TLS,
+        SUBSYSTEM_COUNT
+    };
+
+    struct task_storage_t
+    {
+        StackType_t *stack;
+        StaticTask_t *tcb;
+    };
+
+    struct task_info_t
+    {
+        char name[configMAX_TASK_NAME_LEN];
+        TaskHandle_t handle;
+        subsystem_t subsystem;
+        uint32_t stack_size;
+        // Least free stack ever, bytes
+        uint32_t high_water;
+        bool is_static;
+    };
+
+    struct usage_t
+    {
+        size_t static_bytes;
+        size_t heap_bytes;
+    };
+
+    // Task on the given static storage, on the heap if there is none
+    TaskHandle_t create_task(TaskFunction_t function, const char *name, uint32_t stack_size, void *arg,
+                             UBaseType_t priority, BaseType_t core, subsystem_t subsystem, task_storage_t storage);
+    // Tasks created elsewhere, like the main task
+    void register_task(TaskHandle_t handle, const char *name, uint32_t stack_size, subsystem_t subsystem);
+
+    void count(subsystem_t subsystem, size_t bytes, bool is_static = false);
+    void uncount(subsystem_t subsystem, size_t bytes, bool is_static = false);
+
+    int task_count();
+    // Refreshes the high-water mark
+    bool get_task(int index, task_info_t *info);
+    void get_usage(subsystem_t subsystem, usage_t *usage);
+    const char *subsystem_name(subsystem_t subsystem);
+}
+
+#endif
@@ -0,0 +1,289 @@
+#include "mqtt_bridge.h"
+#include "sdkconfig.h"
+
+#if CONFIG_SER2IP32_MQTT
+
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include "freertos/semphr.h"
+#include "mqtt_client.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "network.h"
+#include "trace.h"
+
+#define MQTT_TOPIC_MAX 64
+// One UART read or framing batch and the publish header fit in one write
+#define MQTT_BUFFER_SIZE 1280
+
+static_assert(CONFIG_SER2IP32_MQTT_WINDOW <= MQTT_WINDOW_MAX, "MQTT window too large");
+
+namespace mqtt_bridge
+{
+    static const char *TAG = "MQTT";
+
+    struct port_t
+    {
+        bool registered;
+        int qos;
+        sink_t sink;
+        char rx_topic[MQTT_TOPIC_MAX];
+        char tx_topic[MQTT_TOPIC_MAX];
+        // QoS 1: free slots of the window, one taken ahead of each publish
+        SemaphoreHandle_t window;
+        StaticSemaphore_t window_buffer;
+        bool reserved;
+        // Message ids waiting for their PUBACK, 0 for a free slot
+        int in_flight[CONFIG_SER2IP32_MQTT_WINDOW];
+        stats_t stats;
+    };
+
+    static port_t ports[UART_NUM_MAX];
+    static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    static esp_mqtt_client_handle_t client = NULL;
+    static volatile bool is_connected = false;
+    static std::atomic<bool> started(false);
+    static uint32_t connect_count = 0;
+    static char client_id[24];
+    // Port of the DATA event being continued, the topic only comes with the first fragment
+    static int data_port = -1;
+    // Acknowledgements that overtook the recording of their message id, 0
+    // for a free entry. They can only belong to a QoS 1 publish not yet
+    // recorded, so they are cleared whenever none is pending
+    static int early_acks[MQTT_WINDOW_MAX];
+    static int publishing = 0;
+
+    // Frees the slot of an acknowledged or deleted message. An unknown id is
+    // kept while a publish is pending, it may not have returned yet. The
+    // lookup and the insertion are one critical section, so a publish
+    // recording its id cannot slip in between
+    static void release(int msg_id, bool expired)
+    {
+        port_t *owner = NULL;
+        portENTER_CRITICAL(&lock);
+        for (int i = 0; i < UART_NUM_MAX && !owner; i++)
+        {
+            port_t &port = ports[i];
+            if (!port.registered || port.qos == 0)
+                continue;
+            for (int k = 0; k < CONFIG_SER2IP32_MQTT_WINDOW; k++)
+                if (port.in_flight[k] == msg_id)
+                {
+                    port.in_flight[k] = 0;
+                    port.stats.in_flight--;
+                    if (expired)
+                        port.stats.expired++;
+                    owner = &port;
+                    break;
+                }
+        }
+        if (!owner && publishing > 0)
+            for (int k = 0; k < MQTT_WINDOW_MAX; k++)
+                if (early_acks[k] == 0)
+                {
+                    early_acks[k] = msg_id;
+                    break;
+                }
+        portEXIT_CRITICAL(&lock);
+        if (owner)
+            xSemaphoreGive(owner->window);
+    }
+
+    static void on_data(esp_mqtt_event_handle_t event)
+    {
+        if (event->topic_len > 0)
+        {
+            data_port = -1;
+            for (int i = 0; i < UART_NUM_MAX; i++)
+                if (ports[i].registered && (int)strlen(ports[i].tx_topic) == event->topic_len &&
+                    !memcmp(ports[i].tx_topic, event->topic, event->topic_len))
+                    data_port = i;
+        }
+        if (data_port < 0 || event->data_len <= 0)
+            return;
+        port_t &port = ports[data_port];
+        // Fragments of a large message are written as they come
+        port.sink((const uint8_t *)event->data, event->data_len);
+        if (event->current_data_offset == 0)
+            port.stats.received++;
+        port.stats.received_bytes += event->data_len;
+    }
+
+    // MQTT task, dispatched by the client's own loop
+    static void event_handler(void *arg, esp_event_base_t base, int32_t event_id, void *event_data)
+    {
+        esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t)event_data;
+        switch ((esp_mqtt_event_id_t)event_id)
+        {
+        case MQTT_EVENT_CONNECTED:
+            is_connected = true;
+            connect_count++;
+            for (int i = 0; i < UART_NUM_MAX; i++)
+                if (ports[i].registered)
+                    esp_mqtt_client_subscribe(client, ports[i].tx_topic, ports[i].qos);
+            ESP_LOGI(TAG, "Connected to %s as %s", CONFIG_SER2IP32_MQTT_URI, client_id);
+            break;
+        case MQTT_EVENT_DISCONNECTED:
+            is_connected = false;
+            ESP_LOGI(TAG, "Disconnected");
+            break;
+        case MQTT_EVENT_PUBLISHED:
+            release(event->msg_id, false);
+            break;
+        case MQTT_EVENT_DELETED:
+            release(event->msg_id, true);
+            break;
+        case MQTT_EVENT_DATA:
+            on_data(event);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void register_port(uart_port_t uart, int qos, sink_t sink)
+    {
+        port_t &port = ports[uart];
+        port.qos = qos ? 1 : 0;
+        port.sink = sink;
+        uint8_t mac[6];
+        esp_read_mac(mac, ESP_MAC_WIFI_STA);
+        snprintf(port.rx_topic, sizeof(port.rx_topic), "%s/%02x%02x%02x/%d/rx", CONFIG_SER2IP32_MQTT_TOPIC, mac[3], mac[4], mac[5], uart);
+        snprintf(port.tx_topic, sizeof(port.tx_topic), "%s/%02x%02x%02x/%d/tx", CONFIG_SER2IP32_MQTT_TOPIC, mac[3], mac[4], mac[5], uart);
+        port.window = xSemaphoreCreateCountingStatic(CONFIG_SER2IP32_MQTT_WINDOW, CONFIG_SER2IP32_MQTT_WINDOW, &port.window_buffer);
+        port.registered = true;
+        ESP_LOGI(TAG, "Port %d: %s and %s, QoS %d", uart, port.rx_topic, port.tx_topic, port.qos);
+    }
+
+    void start()
+    {
+        bool any = false;
+        for (int i = 0; i < UART_NUM_MAX; i++)
+            any |= ports[i].registered;
+        if (!any)
+            return;
+
+        uint8_t mac[6];
+        esp_read_mac(mac, ESP_MAC_WIFI_STA);
+        snprintf(client_id, sizeof(client_id), "ser2ip32-%02x%02x%02x", mac[3], mac[4], mac[5]);
+        esp_mqtt_client_config_t config = {};
+        config.uri = CONFIG_SER2IP32_MQTT_URI;
+        config.client_id = client_id;
+        config.buffer_size = MQTT_BUFFER_SIZE;
+        config.out_buffer_size = MQTT_BUFFER_SIZE;
+        client = esp_mqtt_client_init(&config);
+        if (!client)
+        {
+            ESP_LOGE(TAG, "Cannot create the client");
+            return;
+        }
+        esp_mqtt_client_register_event(client, (esp_mqtt_event_id_t)ESP_EVENT_ANY_ID, &event_handler, NULL);
+
+        // Started from the default event loop when a link comes up, the
+        // client then reconnects by itself
+        network::on_link_change([](network::iface_t iface, bool up) {
+            if (up && !started.exchange(true))
+                esp_mqtt_client_start(client);
+        });
+        if (network::online() && !started.exchange(true))
+            esp_mqtt_client_start(client);
+    }
+
+    bool wait_ready(uart_port_t uart, TickType_t timeout)
+    {
+        port_t &port = ports[uart];
+        if (!is_connected)
+        {
+            vTaskDelay(timeout);
+            return false;
+        }
+        if (port.qos == 0 || port.reserved)
+            return true;
+        if (xSemaphoreTake(port.window, timeout) != pdTRUE)
+        {
+            port.stats.window_full++;
+            return false;
+        }
+        port.reserved = true;
+        return true;
+    }
+
+    void publish(uart_port_t uart, const uint8_t *data, size_t length)
+    {
+        port_t &port = ports[uart];
+        if (port.qos)
+        {
+            portENTER_CRITICAL(&lock);
+            publishing++;
+            portEXIT_CRITICAL(&lock);
+        }
+        TRACE(SOCKET_WRITE, uart, length);
+        int msg_id = esp_mqtt_client_publish(client, port.rx_topic, (const char *)data, length, port.qos, 0);
+        TRACE(SOCKET_WRITE_DONE, uart, length);
+
+        bool acked = false;
+        if (port.qos)
+        {
+            portENTER_CRITICAL(&lock);
+            for (int k = 0; k < MQTT_WINDOW_MAX && !acked && msg_id > 0; k++)
+                if (early_acks[k] == msg_id)
+                {
+                    early_acks[k] = 0;
+                    acked = true;
+                }
+            for (int k = 0; k < CONFIG_SER2IP32_MQTT_WINDOW && !acked && msg_id > 0; k++)
+                if (port.in_flight[k] == 0)
+                {
+                    port.in_flight[k] = msg_id;
+                    port.stats.in_flight++;
+                    break;
+                }
+            // No publish pending: what is left can never be matched, and
+            // would match a reused id after the 16 bit ids wrap around
+            if (--publishing == 0)
+                memset(early_acks, 0, sizeof(early_acks));
+            portEXIT_CRITICAL(&lock);
+        }
+        if (msg_id < 0)
+        {
+            // The reserved slot stays with the port for the next read
+            port.stats.dropped++;
+            return;
+        }
+        port.stats.published++;
+        port.stats.published_bytes += length;
+        if (port.qos == 0)
+            return;
+        port.reserved = false;
+        if (acked)
+            xSemaphoreGive(port.window);
+    }
+
+    bool registered(uart_port_t uart)
+    {
+        return uart < UART_NUM_MAX && ports[uart].registered;
+    }
+
+    int qos(uart_port_t uart)
+    {
+        return ports[uart].qos;
+    }
+
+    bool connected()
+    {
+        return is_connected;
+    }
+
+    uint32_t connects()
+    {
+        return connect_count;
+    }
+
+    const stats_t &stats(uart_port_t uart)
+    {
+        return ports[uart].stats;
+    }
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _MQTT_BRIDGE_H_
+#define _MQTT_BRIDGE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include "freertos/FreeRTOS.h"
+#include "driver/uart.h"
+
+// Largest CONFIG_SER2IP32_MQTT_WINDOW
+#define MQTT_WINDOW_MAX 16
+
+// MQTT mode of the ports (CONFIG_SER2IP32_MQTT). One client for the device;
+// a port in MQTT mode publishes what it reads from the UART to
+// <prefix>/<device>/<uart>/rx, one message per UART read (or framing batch),
+// and writes what is published to <prefix>/<device>/<uart>/tx to the UART.
+//
+// With QoS 1 a port has at most CONFIG_SER2IP32_MQTT_WINDOW messages waiting
+// for their PUBACK. While the window is full or the broker is unreachable,
+// serial data stays in the UART driver, so the client's outbox never holds
+// more than the windows of the ports, across any number of reconnects.
+namespace mqtt_bridge
+{
+    struct stats_t
+    {
+        uint64_t published;
+        uint64_t published_bytes;
+        uint64_t received;
+        uint64_t received_bytes;
+        // Refused by the client, the data is lost
+        uint32_t dropped;
+        // QoS 1 messages given up by the client's outbox without a PUBACK
+        uint32_t expired;
+        // Reads held back by a full window
+        uint32_t window_full;
+        uint32_t in_flight;
+    };
+
+    // Writes to the port's UART, runs in the MQTT task
+    typedef std::function<void(const uint8_t *data, size_t length)> sink_t;
+
+    void register_port(uart_port_t uart, int qos, sink_t sink);
+    // Starts the client once the network is up, after the ports are registered
+    void start();
+
+    // UART task side: true once the port may publish, waits up to timeout for
+    // the broker or a window slot otherwise
+    bool wait_ready(uart_port_t uart, TickType_t timeout);
+    void publish(uart_port_t uart, const uint8_t *data, size_t length);
+
+    bool registered(uart_port_t uart);
+    int qos(uart_port_t uart);
+    bool connected();
+    uint32_t connects();
+    const stats_t &stats(uart_port_t uart);
+}
+
+#endif
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <array>
+#include <string.h>
+#include "mux_server.h"
+#include "uart_server.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "trace.h"
+#include "mem.h"
+
+static const char *TAG = "MUX";
+
+static std::shared_ptr<mux_session> current_session;
+static mux_server::stats_t mux_stats = {};
+
+mux_session::mux_session(asio::ip::tcp::socket socket, std::function<void()> _onSocketError)
+    : tcp_session(std::move(socket), _onSocketError, nullptr),
+      header_len_(0), remaining_(0), control_len_(0)
+{
+    DataAvailable = [this](uint8_t *data, std::size_t length) {
+        this->parse(data, length);
+    };
+    std::error_code ec;
+    iface_ = network::iface_of(socket_.local_endpoint(ec).address());
+    credit_event_ = xEventGroupCreate();
+    for (int i = 0; i < UART_NUM_MAX; i++)
+    {
+        tx_credit_[i] = MUX_WINDOW;
+        rx_returned_[i] = 0;
+        // Only enabled ports take host data
+        rx_ring_[i] = uart_server::get((uart_port_t)i) ? xRingbufferCreate(MUX_WINDOW, RINGBUF_TYPE_BYTEBUF) : NULL;
+        if (rx_ring_[i])
+            mem::count(mem::SUBSYSTEM_MUX, MUX_WINDOW);
+    }
+}
+
+mux_session::~mux_session()
+{
+    for (int i = 0; i < UART_NUM_MAX; i++)
+        if (rx_ring_[i])
+        {
+            vRingbufferDelete(rx_ring_[i]);
+            mem::uncount(mem::SUBSYSTEM_MUX, MUX_WINDOW);
+        }
+    vEventGroupDelete(credit_event_);
+}
+
+void mux_session::start()
+{
+    uint8_t hello[6];
+    uint8_t ports = 0;
+    for (int i = 0; i < UART_NUM_MAX; i++)
+        if (rx_ring_[i])
+            ports |= 1 << i;
+    hello[0] = MUX_VERSION;
+    hello[1] = ports;
+    hello[2] = MUX_WINDOW >> 24;
+    hello[3] = MUX_WINDOW >> 16;
+    hello[4] = MUX_WINDOW >> 8;
+    hello[5] = MUX_WINDOW & 0xFF;
+    send_frame(MUX_PORT_CONTROL, MUX_FLAG_HELLO, hello, sizeof(hello));
+    ESP_LOGI(TAG, "Client on %s, ports 0x%02x", network::iface_name(iface_), ports);
+    tcp_session::start();
+}
+
+// Header and payload go out in a single gather write, the payload is not copied
+void mux_session::send_frame(uint8_t port, uint8_t flags, const uint8_t *payload, size_t length)
+{
+    uint8_t header[MUX_HEADER_SIZE] = {port, flags, (uint8_t)(length >> 8), (uint8_t)(length & 0xFF)};
+    std::array<asio::const_buffer, 2> buffers = {asio::buffer(header), asio::buffer(payload, length)};
+    std::error_code ec;
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    TRACE(SOCKET_WRITE, port, length);
+    // Errors surface in the read loop, which ends the session
+    asio::write(socket_, buffers, ec);
+    TRACE(SOCKET_WRITE_DONE, port, length);
+    mux_stats.frames_tx++;
+}
+
+void mux_session::send_credit(uart_port_t port, uint32_t credit)
+{
+    uint8_t payload[4] = {(uint8_t)(credit >> 24), (uint8_t)(credit >> 16), (uint8_t)(credit >> 8), (uint8_t)(credit & 0xFF)};
+    send_frame(port, MUX_FLAG_CREDIT, payload, sizeof(payload));
+}
+
+bool mux_session::wait_credit(uart_port_t port, size_t needed, TickType_t timeout)
+{
+    if (tx_credit_[port] >= needed)
+        return true;
+    mux_stats.credit_stalls[port]++;
+    xEventGroupWaitBits(credit_event_, BIT(port), pdTRUE, pdFALSE, timeout);
+    return tx_credit_[port] >= needed;
+}
+
+void mux_session::send_data(uart_port_t port, const uint8_t *data, size_t length)
+{
+    tx_credit_[port] -= length;
+    send_frame(port, 0, data, length);
+    network::count_tx(iface_, length);
+}
+
+const uint8_t *mux_session::rx_front(uart_port_t port, size_t *length)
+{
+    if (!rx_ring_[port])
+        return NULL;
+    const uint8_t *item = (const uint8_t *)xRingbufferReceive(rx_ring_[port], length, 0);
+    if (!item && rx_returned_[port] > 0)
+    {
+        // Drained: grant back whatever is left
+        send_credit(port, rx_returned_[port]);
+        rx_returned_[port] = 0;
+    }
+    return item;
+}
+
+void mux_session::rx_release(uart_port_t port, const uint8_t *item, size_t length)
+{
+    vRingbufferReturnItem(rx_ring_[port], (void *)item);
+    rx_returned_[port] += length;
+    // Batched, one credit frame per quarter window
+    if (rx_returned_[port] >= MUX_WINDOW / 4)
+    {
+        send_credit(port, rx_returned_[port]);
+        rx_returned_[port] = 0;
+    }
+}
+
+// Runs in the io_context. Frames may span reads, payloads are copied once,
+// from the socket buffer to the port ring
+void mux_session::parse(const uint8_t *data, size_t length)
+{
+    TRACE(TCP_READ, MUX_PORT_CONTROL, length);
+    while (length > 0)
+    {
+        if (header_len_ < MUX_HEADER_SIZE)
+        {
+            size_t n = std::min(length, MUX_HEADER_SIZE - header_len_);
+            memcpy(header_ + header_len_, data, n);
+            header_len_ += n;
+            data += n;
+            length -= n;
+            if (header_len_ == MUX_HEADER_SIZE)
+            {
+                remaining_ = (header_[2] << 8) | header_[3];
+                control_len_ = 0;
+                if (remaining_ == 0)
+                    frame_done();
+            }
+            continue;
+        }
+
+        uint8_t port = header_[0];
+        size_t n = std::min(length, remaining_);
+        if (header_[1] & MUX_FLAG_CREDIT)
+        {
+            size_t copy = std::min(n, sizeof(control_) - control_len_);
+            memcpy(control_ + control_len_, data, copy);
+            control_len_ += copy;
+        }
+        else if (port < UART_NUM_MAX && rx_ring_[port])
+        {
+            // The host never has more than the ring size in flight, unless it ignores credits
+            if (xRingbufferSend(rx_ring_[port], data, n, 0) == pdTRUE)
+            {
+                network::count_rx(iface_, n);
+                TRACE(ENQUEUE, port, n);
+            }
+            else
+                mux_stats.overruns += n;
+        }
+        data += n;
+        length -= n;
+        remaining_ -= n;
+        if (remaining_ == 0)
+            frame_done();
+    }
+}
+
+void mux_session::frame_done()
+{
+    uint8_t port = header_[0];
+    if ((header_[1] & MUX_FLAG_CREDIT) && port < UART_NUM_MAX && control_len_ == sizeof(control_))
+    {
+        uint32_t credit = (control_[0] << 24) | (control_[1] << 16) | (control_[2] << 8) | control_[3];
+        tx_credit_[port] += credit;
+        xEventGroupSetBits(credit_event_, BIT(port));
+    }
+    mux_stats.frames_rx++;
+    header_len_ = 0;
+}
+
+mux_server::mux_server(asio::io_context *io_context, short port)
+{
+    _io_context = io_context;
+    _port = port;
+    ESP_LOGI(TAG, "Listening on %d", port);
+    do_accept();
+}
+
+std::shared_ptr<mux_session> mux_server::session()
+{
+    return std::atomic_load(&current_session);
+}
+
+mux_server::stats_t &mux_server::stats()
+{
+    return mux_stats;
+}
+
+void mux_server::do_accept()
+{
+    auto acceptor = std::make_shared<asio::ip::tcp::acceptor>(*_io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), _port));
+    acceptor->async_accept(
+        [this, acceptor](std::error_code ec, asio::ip::tcp::socket socket) {
+            if (!ec)
+            {
+#if CONFIG_SER2IP32_TCP_NODELAY
+                std::error_code lec;
+                socket.set_option(asio::ip::tcp::no_delay(true), lec);
+#endif
+                mux_stats.sessions++;
+                auto on_error = [=]() {
+                    this->onsocket_disconection();
+                };
+                auto session = std::make_shared<mux_session>(std::move(socket), on_error);
+                std::atomic_store(&current_session, session);
+                session->start();
+            }
+            else
+                ESP_LOGI(TAG, "Accept error");
+        });
+}
+
+void mux_server::onsocket_disconection()
+{
+    ESP_LOGI(TAG, "Client disconnected");
+    std::atomic_store(&current_session, std::shared_ptr<mux_session>());
+    do_accept();
+}
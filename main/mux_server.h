@@ -0,0 +1,100 @@
+#ifndef _MUX_SERVER_H_
+#define _MUX_SERVER_H_
+
+#include <atomic>
+#include <mutex>
+#include "tcp_session.h"
+#include "network.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/ringbuf.h"
+#include "driver/uart.h"
+
+// Multiplexed channel carrying every enabled UART over one TCP connection.
+// Both directions use the same frame:
+//
+//   | port (1) | flags (1) | length (2, big endian) | payload (length) |
+//
+// A frame without flags carries serial data of the port. MUX_FLAG_CREDIT
+// frames carry a 4 byte big endian number of bytes the receiver may now send
+// on that port. Each side starts with MUX_WINDOW bytes of credit per port, so
+// a port whose reader falls behind stops at its own window and cannot starve
+// the others. On connect the device sends a MUX_FLAG_HELLO frame on
+// MUX_PORT_CONTROL: version (1), enabled ports mask (1), window (4, big endian).
+#define MUX_HEADER_SIZE 4
+#define MUX_FLAG_CREDIT 0x01
+#define MUX_FLAG_HELLO 0x02
+#define MUX_PORT_CONTROL 0xFF
+#define MUX_VERSION 1
+#define MUX_WINDOW 4096
+
+class mux_session : public tcp_session
+{
+public:
+  mux_session(asio::ip::tcp::socket socket, std::function<void()> _onSocketError);
+  ~mux_session();
+
+  void start() override;
+
+  // UART task side, towards the host. send_data consumes credit, callers
+  // never send more than credit() returns
+  size_t credit(uart_port_t port) const { return tx_credit_[port]; }
+  // Waits until the port has at least needed bytes of credit
+  bool wait_credit(uart_port_t port, size_t needed, TickType_t timeout);
+  void send_data(uart_port_t port, const uint8_t *data, size_t length);
+
+  // UART task side, from the host. Returned items give their credit back to the host
+  const uint8_t *rx_front(uart_port_t port, size_t *length);
+  void rx_release(uart_port_t port, const uint8_t *item, size_t length);
+
+private:
+  void parse(const uint8_t *data, size_t length);
+  void frame_done();
+  void send_frame(uint8_t port, uint8_t flags, const uint8_t *payload, size_t length);
+  void send_credit(uart_port_t port, uint32_t credit);
+
+  network::iface_t iface_;
+  std::mutex write_mutex_;
+  std::atomic<uint32_t> tx_credit_[UART_NUM_MAX];
+  EventGroupHandle_t credit_event_;
+  RingbufHandle_t rx_ring_[UART_NUM_MAX];
+  // Credit consumed by the UART, not yet granted back
+  uint32_t rx_returned_[UART_NUM_MAX];
+
+  // Incoming frame being parsed, payloads go straight to the port rings
+  uint8_t header_[MUX_HEADER_SIZE];
+  size_t header_len_;
+  size_t remaining_;
+  uint8_t control_[4];
+  size_t control_len_;
+};
+
+class mux_server
+{
+public:
+  struct stats_t
+  {
+    uint32_t sessions;
+    uint64_t frames_rx;
+    uint64_t frames_tx;
+    // Host data beyond the granted credit, dropped
+    uint64_t overruns;
+    // Times a port had serial data waiting for host credit
+    uint32_t credit_stalls[UART_NUM_MAX];
+  };
+
+  mux_server(asio::io_context *io_context, short port);
+
+  // Connected mux client, empty when there is none
+  static std::shared_ptr<mux_session> session();
+  static stats_t &stats();
+
+private:
+  void do_accept();
+  void onsocket_disconection();
+
+  asio::io_context *_io_context;
+  int _port;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include <vector>
+#include <mutex>
+#include <string.h>
+#include "network.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+#if CONFIG_SER2IP32_IPV6
+#include "esp_netif_net_stack.h"
+#include "lwip/tcpip.h"
+#include "lwip/dhcp6.h"
+#endif
+
+namespace network
+{
+    static const char *TAG = "NETWORK";
+
+    static esp_netif_t *netifs[IFACE_COUNT] = {NULL};
+    static iface_stats stats[IFACE_COUNT] = {};
+    static std::vector<link_callback> callbacks;
+    // Callbacks are added from other tasks while links are already running
+    static std::mutex callbacks_mutex;
+    static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+#if CONFIG_SER2IP32_IPV6
+    static void got_ip6_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+    {
+        ip_event_got_ip6_t *event = (ip_event_got_ip6_t *)event_data;
+        for (int i = IFACE_ETHERNET; i < IFACE_COUNT; i++)
+        {
+            if (netifs[i] != event->esp_netif)
+                continue;
+            ESP_LOGI(TAG, "%s IPv6 address " IPV6STR, iface_name((iface_t)i), IPV62STR(event->ip6_info.ip));
+            // On an IPv6 only network no IPv4 address ever comes, a global
+            // address is enough to serve clients
+            if (esp_netif_ip6_get_addr_type(&event->ip6_info.ip) != ESP_IP6_ADDR_IS_LINK_LOCAL)
+                set_link((iface_t)i, true);
+        }
+    }
+
+#if LWIP_IPV6_DHCP6
+    // lwIP thread
+    static void start_dhcp6(void *ctx)
+    {
+        dhcp6_enable_stateless((struct netif *)ctx);
+    }
+#endif
+#endif
+
+    void init()
+    {
+        static bool initialized = false;
+        if (initialized)
+            return;
+        ESP_ERROR_CHECK(esp_netif_init());
+        ESP_ERROR_CHECK(esp_event_loop_create_default());
+#if CONFIG_SER2IP32_IPV6
+        ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_GOT_IP6, &got_ip6_handler, NULL));
+#endif
+        initialized = true;
+    }
+
+    void register_netif(iface_t iface, esp_netif_t *netif)
+    {
+        netifs[iface] = netif;
+    }
+
+    void set_link(iface_t iface, bool up)
+    {
+        portENTER_CRITICAL(&stats_mux);
+        bool changed = stats[iface].up != up;
+        stats[iface].up = up;
+        portEXIT_CRITICAL(&stats_mux);
+        if (!changed)
+            return;
+
+        ESP_LOGI(TAG, "%s link %s", iface_name(iface), up ? "up" : "down");
+        // Run on a copy, a callback may register another one
+        std::vector<link_callback> current;
+        {
+            std::lock_guard<std::mutex> lock(callbacks_mutex);
+            current = callbacks;
+        }
+        for (auto &callback : current)
+            callback(iface, up);
+    }
+
+    void start_ipv6(iface_t iface)
+    {
+#if CONFIG_SER2IP32_IPV6
+        esp_netif_t *netif = netifs[iface];
+        if (!netif)
+            return;
+        // Router advertisements then give the global addresses (SLAAC)
+        esp_netif_create_ip6_linklocal(netif);
+#if LWIP_IPV6_DHCP6
+        // DNS servers from DHCPv6 when the router sets the other configuration flag
+        tcpip_callback(start_dhcp6, esp_netif_get_netif_impl(netif));
+#endif
+#endif
+    }
+
+    int get_ip6(iface_t iface, esp_ip6_addr_t *addresses)
+    {
+#if CONFIG_SER2IP32_IPV6
+        if (netifs[iface])
+            return esp_netif_get_all_ip6(netifs[iface], addresses);
+#endif
+        return 0;
+    }
+
+    bool link_up(iface_t iface)
+    {
+        if (iface == IFACE_ANY)
+            return online();
+        return stats[iface].up;
+    }
+
+    bool online()
+    {
+        return stats[IFACE_ETHERNET].up || stats[IFACE_WIFI].up;
+    }
+
+    void on_link_change(link_callback callback)
+    {
+        std::lock_guard<std::mutex> lock(callbacks_mutex);
+        callbacks.push_back(callback);
+    }
+
+    iface_t iface_of(const asio::ip::address &address)
+    {
+        if (address.is_v6() && address.to_v6().is_v4_mapped())
+            return iface_of(asio::ip::make_address_v4(asio::ip::v4_mapped, address.to_v6()));
+        if (address.is_v6())
+        {
+            // esp_ip6_addr_t holds the 16 bytes in network order too
+            asio::ip::address_v6::bytes_type bytes = address.to_v6().to_bytes();
+            for (int i = IFACE_ETHERNET; i < IFACE_COUNT; i++)
+            {
+                esp_ip6_addr_t addresses[LWIP_IPV6_NUM_ADDRESSES];
+                int count = get_ip6((iface_t)i, addresses);
+                for (int k = 0; k < count; k++)
+                    if (!memcmp(addresses[k].addr, bytes.data(), bytes.size()))
+                        return (iface_t)i;
+            }
+            return IFACE_ANY;
+        }
+        // esp_ip4_addr_t holds the address in network byte order
+        uint32_t addr = htonl(address.to_v4().to_uint());
+        for (int i = IFACE_ETHERNET; i < IFACE_COUNT; i++)
+        {
+            esp_netif_ip_info_t ip_info;
+            if (netifs[i] && esp_netif_get_ip_info(netifs[i], &ip_info) == ESP_OK && ip_info.ip.addr == addr)
+                return (iface_t)i;
+        }
+        return IFACE_ANY;
+    }
+
+    const char *iface_name(iface_t iface)
+    {
+        switch (iface)
+        {
+        case IFACE_ETHERNET:
+            return "Ethernet";
+        case IFACE_WIFI:
+            return "Wifi";
+        default:
+            return "Any";
+        }
+    }
+
+    void count_rx(iface_t iface, std::size_t bytes)
+    {
+        portENTER_CRITICAL(&stats_mux);
+        stats[iface].rx_bytes += bytes;
+        portEXIT_CRITICAL(&stats_mux);
+    }
+
+    void count_tx(iface_t iface, std::size_t bytes)
+    {
+        portENTER_CRITICAL(&stats_mux);
+        stats[iface].tx_bytes += bytes;
+        portEXIT_CRITICAL(&stats_mux);
+    }
+
+    void count_session(iface_t iface)
+    {
+        portENTER_CRITICAL(&stats_mux);
+        stats[iface].sessions++;
+        portEXIT_CRITICAL(&stats_mux);
+    }
+
+    void count_failover(iface_t iface)
+    {
+        portENTER_CRITICAL(&stats_mux);
+        stats[iface].failovers++;
+        portEXIT_CRITICAL(&stats_mux);
+    }
+
+    void get_stats(iface_t iface, iface_stats *out)
+    {
+        portENTER_CRITICAL(&stats_mux);
+        *out = stats[iface];
+        portEXIT_CRITICAL(&stats_mux);
+    }
+} // namespace network
@@ -0,0 +1,59 @@
+#ifndef _NETWORK_H_
+#define _NETWORK_H_
+
+#include <functional>
+#include "esp_netif.h"
+#include "lwip/opt.h"
+#include "asio.hpp"
+
+namespace network
+{
+    // Interface binding policy of a port, also used to tag sessions
+    enum iface_t
+    {
+        IFACE_ANY = 0,
+        IFACE_ETHERNET = 1,
+        IFACE_WIFI = 2,
+        IFACE_COUNT
+    };
+
+    struct iface_stats
+    {
+        bool up;
+        uint64_t rx_bytes;
+        uint64_t tx_bytes;
+        uint32_t sessions;
+        uint32_t failovers;
+    };
+
+    typedef std::function<void(iface_t iface, bool up)> link_callback;
+
+    // Initialize TCP/IP stack and default event loop. Called once, before any netif is created
+    void init();
+
+    void register_netif(iface_t iface, esp_netif_t *netif);
+    void set_link(iface_t iface, bool up);
+    // Link-local address, then SLAAC and stateless DHCPv6 from the router's
+    // advertisements (CONFIG_SER2IP32_IPV6). Called when the link connects
+    void start_ipv6(iface_t iface);
+    // IPv6 addresses of an interface, at most LWIP_IPV6_NUM_ADDRESSES
+    int get_ip6(iface_t iface, esp_ip6_addr_t *addresses);
+    bool link_up(iface_t iface);
+    // True while at least one interface is up
+    bool online();
+    // Callbacks run in the event loop task, keep them short
+    void on_link_change(link_callback callback);
+
+    // Interface owning a local address, IFACE_ANY if unknown. IPv4 clients
+    // of a dual-stack listener are seen on a v4-mapped IPv6 address
+    iface_t iface_of(const asio::ip::address &address);
+    const char *iface_name(iface_t iface);
+
+    void count_rx(iface_t iface, std::size_t bytes);
+    void count_tx(iface_t iface, std::size_t bytes);
+    void count_session(iface_t iface);
+    void count_failover(iface_t iface);
+    void get_stats(iface_t iface, iface_stats *stats);
+}
+
+#endif
@@ -0,0 +1,177 @@
+#include <algorithm>
+#include "ota.h"
+#include "network.h"
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+// Largest esp_ota_write, one flash page program at a time
+#define OTA_CHUNK 1024
+// Confirmation poll of a new image
+#define OTA_CHECK_PERIOD_US 1000000
+
+namespace ota
+{
+    static const char *TAG = "OTA";
+
+    static state_t current = STATE_IDLE;
+    static stats_t counters = {};
+    static esp_ota_handle_t handle = 0;
+    static const esp_partition_t *target = NULL;
+    static int64_t started = 0;
+    static esp_timer_handle_t check_timer = NULL;
+    static int64_t boot_time = 0;
+
+    static esp_err_t fail(esp_err_t err, const char *what)
+    {
+        ESP_LOGE(TAG, "%s: %s", what, esp_err_to_name(err));
+        if (handle)
+            esp_ota_abort(handle);
+        handle = 0;
+        current = STATE_FAILED;
+        return err;
+    }
+
+    esp_err_t begin(size_t size)
+    {
+        if (current == STATE_RECEIVING)
+            abort();
+        counters = {};
+        target = esp_ota_get_next_update_partition(NULL);
+        if (!target)
+            return fail(ESP_ERR_NOT_FOUND, "No update partition");
+        if (size == 0 || size > target->size)
+            return fail(ESP_ERR_INVALID_SIZE, "Image size");
+        // Sectors are erased as the writes reach them, never the whole slot at once
+        esp_err_t err = esp_ota_begin(target, OTA_WITH_SEQUENTIAL_WRITES, &handle);
+        if (err != ESP_OK)
+            return fail(err, "Begin");
+        counters.size = size;
+        started = esp_timer_get_time();
+        current = STATE_RECEIVING;
+        ESP_LOGI(TAG, "Writing %u bytes to %s", size, target->label);
+        return ESP_OK;
+    }
+
+    // Waits until the bytes written so far are due at the configured rate
+    static void throttle()
+    {
+        if (CONFIG_SER2IP32_OTA_RATE_KB <= 0)
+            return;
+        int64_t due = started + (int64_t)counters.written * 1000000 / (CONFIG_SER2IP32_OTA_RATE_KB * 1024);
+        int64_t ahead = due - esp_timer_get_time();
+        if (ahead <= 0)
+            return;
+        vTaskDelay(std::max((TickType_t)1, pdMS_TO_TICKS(ahead / 1000)));
+        counters.throttled_ms += ahead / 1000;
+    }
+
+    esp_err_t write(const uint8_t *data, size_t length)
+    {
+        if (current != STATE_RECEIVING)
+            return ESP_ERR_INVALID_STATE;
+        if (counters.written + length > counters.size)
+            return fail(ESP_ERR_INVALID_SIZE, "More data than announced");
+        while (length > 0)
+        {
+            size_t n = std::min(length, (size_t)OTA_CHUNK);
+            esp_err_t err = esp_ota_write(handle, data, n);
+            if (err != ESP_OK)
+                return fail(err, "Write");
+            data += n;
+            length -= n;
+            counters.written += n;
+            throttle();
+        }
+        return ESP_OK;
+    }
+
+    esp_err_t end()
+    {
+        if (current != STATE_RECEIVING)
+            return ESP_ERR_INVALID_STATE;
+        if (counters.written != counters.size)
+            return fail(ESP_ERR_INVALID_SIZE, "Image incomplete");
+        esp_err_t err = esp_ota_end(handle);
+        handle = 0;
+        if (err != ESP_OK)
+            return fail(err, "Image check");
+        err = esp_ota_set_boot_partition(target);
+        if (err != ESP_OK)
+            return fail(err, "Boot partition");
+        counters.duration_ms = (esp_timer_get_time() - started) / 1000;
+        current = STATE_READY;
+        ESP_LOGI(TAG, "%u bytes in %u ms (%u ms throttled), %s boots next", counters.written, counters.duration_ms,
+                 counters.throttled_ms, target->label);
+        return ESP_OK;
+    }
+
+    void abort()
+    {
+        if (current != STATE_RECEIVING)
+            return;
+        ESP_LOGW(TAG, "Aborted after %u of %u bytes", counters.written, counters.size);
+        esp_ota_abort(handle);
+        handle = 0;
+        current = STATE_IDLE;
+    }
+
+    state_t state()
+    {
+        return current;
+    }
+
+    const char *state_name(state_t state)
+    {
+        switch (state)
+        {
+        case STATE_IDLE:
+            return "idle";
+        case STATE_RECEIVING:
+            return "receiving";
+        case STATE_READY:
+            return "ready";
+        default:
+            return "failed";
+        }
+    }
+
+    const stats_t &stats()
+    {
+        return counters;
+    }
+
+    static void check_callback(void *arg)
+    {
+        if (network::online())
+        {
+            ESP_LOGI(TAG, "New image confirmed");
+            esp_ota_mark_app_valid_cancel_rollback();
+            esp_timer_stop(check_timer);
+            return;
+        }
+        if (esp_timer_get_time() - boot_time > (int64_t)CONFIG_SER2IP32_OTA_CONFIRM_S * 1000000)
+        {
+            ESP_LOGE(TAG, "No network %d s after the update, rolling back", CONFIG_SER2IP32_OTA_CONFIRM_S);
+            esp_ota_mark_app_invalid_rollback_and_reboot();
+        }
+    }
+
+    void check_boot()
+    {
+        esp_ota_img_states_t image_state;
+        const esp_partition_t *running = esp_ota_get_running_partition();
+        if (esp_ota_get_state_partition(running, &image_state) != ESP_OK || image_state != ESP_OTA_IMG_PENDING_VERIFY)
+            return;
+        ESP_LOGI(TAG, "First boot of %s, waiting for the network to confirm it", running->label);
+        boot_time = esp_timer_get_time();
+        esp_timer_create_args_t timer_args = {};
+        timer_args.callback = &check_callback;
+        timer_args.name = "ota_check";
+        if (esp_timer_create(&timer_args, &check_timer) == ESP_OK)
+            esp_timer_start_periodic(check_timer, OTA_CHECK_PERIOD_US);
+    }
+}
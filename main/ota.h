@@ -0,0 +1,50 @@
+#ifndef _OTA_H_
+#define _OTA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Firmware update into the app slot that is not running. The image is
+// written as it arrives, erasing one sector ahead at a time, and the writer
+// is held to CONFIG_SER2IP32_OTA_RATE_KB so flash operations, which stall
+// both cores' caches, stay short and spread out. An updated image boots once
+// in test mode: it is confirmed when its ports are up and the network is
+// back, otherwise the bootloader returns to the previous one.
+// One update at a time, driven by a single task.
+namespace ota
+{
+    enum state_t
+    {
+        STATE_IDLE,
+        STATE_RECEIVING,
+        STATE_READY,  // Next boot runs the new image
+        STATE_FAILED,
+    };
+
+    struct stats_t
+    {
+        uint32_t size;
+        uint32_t written;
+        // Time the writer waited for the rate limit
+        uint32_t throttled_ms;
+        uint32_t duration_ms;
+    };
+
+    esp_err_t begin(size_t size);
+    // Blocks as long as the rate limit requires
+    esp_err_t write(const uint8_t *data, size_t length);
+    // Checks the image and selects it for the next boot
+    esp_err_t end();
+    void abort();
+
+    state_t state();
+    const char *state_name(state_t state);
+    const stats_t &stats();
+
+    // Called once the ports are started: confirms an image on its first
+    // boot once the network is up, rolls back if it does not come up
+    void check_boot();
+}
+
+#endif
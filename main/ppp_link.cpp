@@ -0,0 +1,106 @@
+#include "ppp_link.h"
+#include "sdkconfig.h"
+
+#if CONFIG_SER2IP32_PPP
+
+#include "esp_log.h"
+#include "lwip/netif.h"
+#include "lwip/dns.h"
+#include "lwip/lwip_napt.h"
+#include "netif/ppp/pppapi.h"
+#include "netif/ppp/pppos.h"
+#include "mem.h"
+
+#if !PPP_SERVER
+#error "PPP mode needs lwIP built with PPP server support (CONFIG_LWIP_PPP_SERVER_SUPPORT)"
+#endif
+
+static const char *TAG = "PPP";
+
+// Whatever DNS server the uplink currently has is offered to the device
+static void offer_dns(ppp_pcb *pcb)
+{
+    const ip_addr_t *dns = dns_getserver(0);
+    if (dns && IP_IS_V4(dns))
+        ppp_set_ipcp_dnsaddr(pcb, 0, ip_2_ip4(dns));
+}
+
+ppp_link::ppp_link(uart_port_t uart, writer_t write)
+{
+    _uart = uart;
+    _write = write;
+    _state = STATE_LISTENING;
+    _stats = {};
+
+    ip4_addr_t net;
+    if (!ip4addr_aton(CONFIG_SER2IP32_PPP_NET, &net))
+        ip4_addr_set_zero(&net);
+    _local = lwip_htonl(lwip_ntohl(ip4_addr_get_u32(&net)) + (uart << 8) + 1);
+    _peer = lwip_htonl(lwip_ntohl(ip4_addr_get_u32(&net)) + (uart << 8) + 2);
+
+    _netif = new netif();
+    mem::count(mem::SUBSYSTEM_UART, sizeof(netif));
+    // Not made the default interface, our own traffic keeps using the uplink
+    _pcb = pppapi_pppos_create(_netif, &ppp_link::output, &ppp_link::status, this);
+    if (!_pcb)
+    {
+        ESP_LOGE(TAG, "Port %d: cannot create the PPP interface", uart);
+        return;
+    }
+    ip4_addr_t local, peer;
+    ip4_addr_set_u32(&local, _local);
+    ip4_addr_set_u32(&peer, _peer);
+    ppp_set_ipcp_ouraddr(_pcb, &local);
+    ppp_set_ipcp_hisaddr(_pcb, &peer);
+#if PPP_AUTH_SUPPORT
+    // The device is on our side of the line, it does not authenticate
+    ppp_set_auth(_pcb, PPPAUTHTYPE_NONE, NULL, NULL);
+    ppp_set_auth_required(_pcb, 0);
+#endif
+    offer_dns(_pcb);
+    ESP_LOGI(TAG, "Port %d: PPP server, %s for the device", uart, ip4addr_ntoa(&peer));
+    pppapi_listen(_pcb);
+}
+
+const char *ppp_link::state_name(state_t state)
+{
+    return state == STATE_UP ? "up" : "listening";
+}
+
+void ppp_link::input(uint8_t *data, size_t length)
+{
+    // Copied to a pbuf and framed in the lwIP thread
+    if (_pcb)
+        pppos_input_tcpip(_pcb, data, length);
+}
+
+uint32_t ppp_link::output(ppp_pcb_s *pcb, uint8_t *data, uint32_t length, void *ctx)
+{
+    ((ppp_link *)ctx)->_write(data, length);
+    return length;
+}
+
+// lwIP thread
+void ppp_link::status(ppp_pcb_s *pcb, int err, void *ctx)
+{
+    ppp_link *link = (ppp_link *)ctx;
+    if (err == PPPERR_NONE)
+    {
+        link->_state = STATE_UP;
+        link->_stats.connects++;
+        // Packets from the device leave through the uplink with our address
+        ip_napt_enable_no(link->_netif->num, 1);
+        ESP_LOGI(TAG, "Port %d: link up", link->_uart);
+        return;
+    }
+    if (link->_state == STATE_UP)
+        link->_stats.disconnects++;
+    link->_state = STATE_LISTENING;
+    link->_stats.last_error = err;
+    ESP_LOGI(TAG, "Port %d: link down (%d)", link->_uart, err);
+    // The link is dead, wait for the device again
+    offer_dns(pcb);
+    ppp_listen(pcb);
+}
+
+#endif
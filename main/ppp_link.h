@@ -0,0 +1,66 @@
+#ifndef _PPP_LINK_H_
+#define _PPP_LINK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include "driver/uart.h"
+
+struct netif;
+struct ppp_pcb_s;
+
+// PPP over serial server on a port (CONFIG_SER2IP32_PPP). lwIP's PPPoS runs
+// on the UART instead of a TCP client being served: the device on the line
+// dials in, is given the peer address of the port's link and reaches the
+// Wi-Fi/Ethernet network through NAPT. Port n uses x.y.n.1 on our side and
+// x.y.n.2 for the device, in CONFIG_SER2IP32_PPP_NET.
+//
+// The UART task hands whole reads to lwIP in one message each. HDLC framing
+// and the FCS are lwIP's, with its 256 entry FCS table.
+class ppp_link
+{
+public:
+  enum state_t
+  {
+    STATE_LISTENING, // Waiting for the device to start LCP
+    STATE_UP,        // IPCP done, the device has its address
+  };
+
+  struct stats_t
+  {
+    uint32_t connects;
+    uint32_t disconnects;
+    // lwIP PPPERR_ code of the last disconnection
+    int last_error;
+  };
+
+  // write: sends to the UART, called from the lwIP thread
+  typedef std::function<void(const uint8_t *data, size_t length)> writer_t;
+
+  ppp_link(uart_port_t uart, writer_t write);
+
+  // UART task side: bytes read from the line
+  void input(uint8_t *data, size_t length);
+
+  state_t state() const { return _state; }
+  static const char *state_name(state_t state);
+  const stats_t &stats() const { return _stats; }
+  // Network order, as in ip4_addr_t
+  uint32_t local_addr() const { return _local; }
+  uint32_t peer_addr() const { return _peer; }
+
+private:
+  static uint32_t output(ppp_pcb_s *pcb, uint8_t *data, uint32_t length, void *ctx);
+  static void status(ppp_pcb_s *pcb, int err, void *ctx);
+
+  uart_port_t _uart;
+  writer_t _write;
+  ppp_pcb_s *_pcb;
+  struct netif *_netif;
+  uint32_t _local;
+  uint32_t _peer;
+  volatile state_t _state;
+  stats_t _stats;
+};
+
+#endif
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <string.h>
+#include "rs485.h"
+#include "uart_timing.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "sdkconfig.h"
+#include "mem.h"
+
+static const char *TAG = "RS485";
+
+// Room for two full client reads, writes that do not fit are dropped whole
+#define RS485_TX_RING_SIZE 2048
+// Largest block handed to the driver at once
+#define RS485_TX_CHUNK 256
+// Longest guard time busy waited, longer ones sleep
+#define RS485_SPIN_MAX_US 500
+
+#if CONFIG_SER2IP32_STATIC_ALLOC
+static uint8_t tx_ring_storage[UART_NUM_MAX][RS485_TX_RING_SIZE];
+static StaticRingbuffer_t tx_ring_buffers[UART_NUM_MAX];
+#endif
+
+rs485_port::rs485_port(uart_port_t uart, uint32_t pre_guard_us, uint32_t post_guard_us, bool echo_suppress)
+    : _uart(uart), _pre_guard_us(pre_guard_us), _post_guard_us(post_guard_us), _echo_suppress(echo_suppress),
+      _tx_queued(0), _tx_dropped(0), _last_rx_us(0), _tx_done_us(0), _echo_pending(0), _awaiting_response(false), _stats()
+{
+#if CONFIG_SER2IP32_STATIC_ALLOC
+    _tx_ring = xRingbufferCreateStatic(RS485_TX_RING_SIZE, RINGBUF_TYPE_BYTEBUF, tx_ring_storage[uart], &tx_ring_buffers[uart]);
+    mem::count(mem::SUBSYSTEM_RS485, RS485_TX_RING_SIZE + sizeof(StaticRingbuffer_t), true);
+#else
+    _tx_ring = xRingbufferCreate(RS485_TX_RING_SIZE, RINGBUF_TYPE_BYTEBUF);
+    mem::count(mem::SUBSYSTEM_RS485, RS485_TX_RING_SIZE + sizeof(StaticRingbuffer_t));
+#endif
+    _stats.turnaround_min_us = UINT32_MAX;
+
+    // Character time, to place received bytes in time
+    _char_us = uart_char_time_us(uart);
+
+    ESP_LOGI(TAG, "Uart %d: half duplex, char %u us, guards %u/%u us, echo suppression %s", uart, _char_us,
+             pre_guard_us, post_guard_us, echo_suppress ? "on" : "off");
+}
+
+rs485_port::~rs485_port()
+{
+    vRingbufferDelete(_tx_ring);
+}
+
+bool rs485_port::queue_tx(const uint8_t *data, size_t length)
+{
+    // The io_context and the UART tasks routing data call this, none may
+    // wait for a stuck bus. A byte buffer send is all or nothing, so a
+    // message that does not fit is dropped whole and never truncated
+    if (xRingbufferSend(_tx_ring, data, length, 0) != pdTRUE)
+    {
+        _tx_dropped += length;
+        ESP_LOGW(TAG, "Uart %d: TX queue full, %u bytes dropped", _uart, length);
+        return false;
+    }
+    _tx_queued += length;
+    return true;
+}
+
+rs485_port::stats_t rs485_port::stats() const
+{
+    stats_t stats = _stats;
+    stats.tx_dropped = _tx_dropped;
+    return stats;
+}
+
+void rs485_port::wait_us(int64_t us)
+{
+    if (us <= 0)
+        return;
+    int64_t deadline = esp_timer_get_time() + us;
+    // The UART task runs at the highest priority, so long guards sleep. A
+    // tick more than needed covers vTaskDelay returning up to a tick early:
+    // a guard may run long but is never shorter than set
+    if (us > RS485_SPIN_MAX_US)
+        vTaskDelay(us / (portTICK_PERIOD_MS * 1000) + 1);
+    int64_t left = deadline - esp_timer_get_time();
+    if (left > 0)
+        esp_rom_delay_us(left);
+}
+
+void rs485_port::service_tx()
+{
+    size_t size = 0;
+    uint8_t *chunk;
+    while ((chunk = (uint8_t *)xRingbufferReceiveUpTo(_tx_ring, &size, 0, RS485_TX_CHUNK)) != NULL)
+    {
+        _tx_queued -= size;
+        transmit(chunk, size);
+        vRingbufferReturnItem(_tx_ring, chunk);
+    }
+}
+
+void rs485_port::transmit(const uint8_t *data, size_t length)
+{
+    // Pre-transmit guard: give the last talker time to release the bus.
+    // Our own consecutive chunks are not delayed
+    wait_us(_last_rx_us + _pre_guard_us - esp_timer_get_time());
+
+    uart_write_bytes(_uart, (const char *)data, length);
+    // The driver releases RTS (driver enable) once the last stop bit is out
+    uart_wait_tx_done(_uart, portMAX_DELAY);
+    _tx_done_us = esp_timer_get_time();
+
+    bool collision = false;
+    uart_get_collision_flag(_uart, &collision);
+    if (collision)
+        _stats.collisions++;
+    _stats.frames_tx++;
+    _stats.bytes_tx += length;
+    if (_echo_suppress)
+        _echo_pending += length;
+    _awaiting_response = true;
+}
+
+int rs485_port::read(uint8_t *data, size_t max_length, TickType_t timeout)
+{
+    // First byte alone, so the time the data reached the driver is known.
+    // Waited for a tick at a time: queued TX data ends the wait, and the
+    // UART task sends it at once instead of after the read timeout
+    int length = 0;
+    for (TickType_t waited = 0;; waited++)
+    {
+        length = uart_read_bytes(_uart, data, 1, waited < timeout ? 1 : 0);
+        if (length != 0 || waited >= timeout || _tx_queued > 0)
+            break;
+    }
+    if (length <= 0)
+        return length;
+    int64_t now = esp_timer_get_time();
+    int rest = uart_read_bytes(_uart, data + 1, max_length - 1, 0);
+    if (rest > 0)
+        length += rest;
+    _last_rx_us = now;
+
+    // The chunk left the RX FIFO after its last byte plus the RX idle timeout
+    int64_t first_byte_us = now - (int64_t)(length + CONFIG_SER2IP32_UART_RX_TIMEOUT_SYMBOLS) * _char_us;
+
+    // Echo of our own transmission, all of it is already in the driver
+    int skip = 0;
+    if (_echo_pending > 0)
+    {
+        skip = std::min((size_t)length, _echo_pending);
+        _stats.echo_suppressed += skip;
+        _stats.echo_missing += _echo_pending - skip;
+        _echo_pending = 0;
+    }
+
+    // Post-transmit guard: bytes landing right after the bus was released are line noise
+    while (skip < length && first_byte_us + (int64_t)skip * _char_us < _tx_done_us + _post_guard_us)
+    {
+        skip++;
+        _stats.guard_discarded++;
+    }
+
+    if (_awaiting_response && skip < length)
+    {
+        int64_t turnaround = first_byte_us + (int64_t)skip * _char_us - _tx_done_us;
+        uint32_t turnaround_us = turnaround > 0 ? turnaround : 0;
+        _stats.turnarounds++;
+        _stats.turnaround_sum_us += turnaround_us;
+        _stats.turnaround_min_us = std::min(_stats.turnaround_min_us, turnaround_us);
+        _stats.turnaround_max_us = std::max(_stats.turnaround_max_us, turnaround_us);
+        _awaiting_response = false;
+    }
+
+    if (skip > 0)
+        memmove(data, data + skip, length - skip);
+    return length - skip;
+}
@@ -0,0 +1,74 @@
+#ifndef _RS485_H_
+#define _RS485_H_
+
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/ringbuf.h"
+#include "driver/uart.h"
+
+// RS-485 half duplex bus master. The UART runs in UART_MODE_RS485_HALF_DUPLEX
+// with RTS driving the transceiver's driver enable. Transmission and reception
+// both happen in the port's UART task, which owns the bus: network data is
+// queued by the io_context and sent between reads, so guard times and the
+// bus turnaround can be enforced and measured.
+class rs485_port
+{
+public:
+  struct stats_t
+  {
+    uint32_t frames_tx;
+    uint64_t bytes_tx;
+    uint32_t collisions;
+    uint64_t echo_suppressed;
+    uint64_t echo_missing;
+    uint64_t guard_discarded;
+    // Network bytes dropped because the TX queue was full
+    uint64_t tx_dropped;
+    // Time from the end of our transmission to the first response byte
+    uint32_t turnarounds;
+    uint32_t turnaround_min_us;
+    uint32_t turnaround_max_us;
+    uint64_t turnaround_sum_us;
+  };
+
+  // pre_guard_us: bus idle time required after the last received byte before transmitting
+  // post_guard_us: time after our transmission during which received bytes are discarded
+  // echo_suppress: drop our own bytes read back by a transceiver with receiver always enabled
+  rs485_port(uart_port_t uart, uint32_t pre_guard_us, uint32_t post_guard_us, bool echo_suppress);
+  ~rs485_port();
+
+  // io_context side: queue bytes for the bus without waiting. A message that
+  // does not fit is dropped whole and counted, returns false then
+  bool queue_tx(const uint8_t *data, size_t length);
+  // UART task side: transmit everything queued
+  void service_tx();
+  // UART task side: transmit now, for data the task itself produces
+  void transmit(const uint8_t *data, size_t length);
+  // UART task side: uart_read_bytes replacement with echo suppression and
+  // turnaround measurement. Returns early, with 0, when TX data is queued
+  int read(uint8_t *data, size_t max_length, TickType_t timeout);
+
+  stats_t stats() const;
+
+private:
+  void wait_us(int64_t us);
+
+  uart_port_t _uart;
+  RingbufHandle_t _tx_ring;
+  uint32_t _pre_guard_us;
+  uint32_t _post_guard_us;
+  bool _echo_suppress;
+  uint32_t _char_us;
+  // Bytes in the TX ring
+  std::atomic<size_t> _tx_queued;
+  // Written by queue_tx callers, the rest of the stats by the UART task
+  std::atomic<uint64_t> _tx_dropped;
+
+  int64_t _last_rx_us;
+  int64_t _tx_done_us;
+  size_t _echo_pending;
+  bool _awaiting_response;
+  stats_t _stats;
+};
+
+#endif
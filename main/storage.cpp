@@ -30,7 +30,7 @@ esp_err_t storage::write_int32 (const char* storage_name, const char *variable_n
 
     // Write
     err = nvs_set_i32(my_handle, variable_name, value);
-    if (err != ESP_OK)
+    if (err == ESP_OK)
         err = nvs_commit(my_handle);
 
     // Commit written value.
@@ -75,7 +75,7 @@ esp_err_t storage::write_string(const char* storage_name, const char *variable_n
 
     // Write
     err = nvs_set_str(my_handle, variable_name, value);
-    if (err != ESP_OK) 
+    if (err == ESP_OK)
         err = nvs_commit(my_handle);
 
     // Commit written value.
@@ -88,6 +88,61 @@ esp_err_t storage::write_string(const char* storage_name, const char *variable_n
     return err;
 }
 
+esp_err_t storage::read_blob(const char* storage_name, const char *variable_name, void* out_value, size_t *length)
+{
+    nvs_handle_t my_handle;
+    esp_err_t err;
+
+    // Open
+    err = nvs_open(storage_name, NVS_READONLY, &my_handle);
+    if (err != ESP_OK) return err;
+
+    // Read, fails with ESP_ERR_NVS_INVALID_LENGTH if the stored blob does not fit
+    err = nvs_get_blob(my_handle, variable_name, out_value, length);
+
+    // Close
+    nvs_close(my_handle);
+    return err;
+}
+
+esp_err_t storage::write_blob(const char* storage_name, const char *variable_name, const void* value, size_t length)
+{
+    nvs_handle_t my_handle;
+    esp_err_t err;
+
+    // Open
+    err = nvs_open(storage_name, NVS_READWRITE, &my_handle);
+    if (err != ESP_OK) return err;
+
+    // Write
+    err = nvs_set_blob(my_handle, variable_name, value, length);
+    if (err == ESP_OK)
+        err = nvs_commit(my_handle);
+
+    // Close
+    nvs_close(my_handle);
+    return err;
+}
+
+esp_err_t storage::erase_key(const char* storage_name, const char *variable_name)
+{
+    nvs_handle_t my_handle;
+    esp_err_t err;
+
+    // Open
+    err = nvs_open(storage_name, NVS_READWRITE, &my_handle);
+    if (err != ESP_OK) return err;
+
+    // Erase
+    err = nvs_erase_key(my_handle, variable_name);
+    if (err == ESP_OK)
+        err = nvs_commit(my_handle);
+
+    // Close
+    nvs_close(my_handle);
+    return err;
+}
+
 void storage::format_nvs()
 {
     // Clear NVS
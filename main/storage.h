@@ -9,6 +9,10 @@ namespace storage
     esp_err_t write_int32(const char* storage_name, const char *variable_name, int32_t value);
     esp_err_t read_string(const char* storage_name, const char *variable_name, char* out_string, size_t *max_length);
     esp_err_t write_string(const char* storage_name, const char *variable_name, const char* value);
+    esp_err_t read_blob(const char* storage_name, const char *variable_name, void* out_value, size_t *length);
+    esp_err_t write_blob(const char* storage_name, const char *variable_name, const void* value, size_t length);
+    // Back to the firmware default, ESP_ERR_NVS_NOT_FOUND if it was not set
+    esp_err_t erase_key(const char* storage_name, const char *variable_name);
 
     void format_nvs();
     void init_nvs();
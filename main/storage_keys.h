@@ -11,10 +11,39 @@
 #define STORAGE_UART_DATA_BITS "UART_DATA_BITS_%d"
 #define STORAGE_UART_PARITY "UART_PARITY_%d"
 #define STORAGE_UART_STOP_BITS "UART_STOP_BITS_%d"
+#define STORAGE_UART_TLS "UART_TLS_%d"
+#define STORAGE_UART_IFACE "UART_IFACE_%d"
+#define STORAGE_UART_SF_SIZE "UART_SF_SIZE_%d"
+#define STORAGE_UART_SF_SPILL "UART_SF_SPILL%d"
+#define STORAGE_UART_SF_MARKERS "UART_SF_MARK_%d"
+#define STORAGE_UART_RTS_PIN "UART_RTS_PIN_%d"
+#define STORAGE_UART_RS485 "UART_RS485_%d"
+#define STORAGE_UART_PRE_GUARD "UART_PRE_GRD_%d"
+#define STORAGE_UART_POST_GUARD "UART_POST_GRD%d"
+#define STORAGE_UART_ECHO "UART_ECHO_%d"
+#define STORAGE_UART_FRAMING "UART_FRAMING_%d"
+#define STORAGE_UART_ROUTE "UART_ROUTE_%d"
+#define STORAGE_UART_ROUTE_TEE "UART_TEE_%d"
+#define STORAGE_UART_PRIORITY "UART_PRIO_%d"
+#define STORAGE_UART_WEIGHT "UART_WEIGHT_%d"
+#define STORAGE_UART_RATE "UART_RATE_%d"
+#define STORAGE_UART_BURST "UART_BURST_%d"
+#define STORAGE_UART_AUTOBAUD "UART_AUTOBAUD_%d"
+#define STORAGE_UART_WS "UART_WS_%d"
+#define STORAGE_UART_PPP "UART_PPP_%d"
+#define STORAGE_UART_MQTT "UART_MQTT_%d"
+#define STORAGE_UART_MQTT_QOS "UART_MQTT_QOS%d"
+#define STORAGE_UART_FILTER "UART_FILTER_%d"
+#define STORAGE_UART_SAMPLE "UART_SAMPLE_%d"
+#define STORAGE_UART_IPV6 "UART_IPV6_%d"
+
+#define STORAGE_MUX_TCP_PORT "MUX_TCP_PORT"
 
 #define STORAGE_WIFI_MODE "WIFI_MODE"
 #define STORAGE_WIFI_SSID "WIFI_SSID"
 #define STORAGE_WIFI_PASSWD "WIFI_PASSWD"
 #define STORAGE_WIFI_CHANNEL "WIFI_CHANNEL"
+#define STORAGE_WIFI_BSSID "WIFI_BSSID"
+#define STORAGE_WIFI_STA_CHANNEL "WIFI_STA_CHAN"
 
 #endif
\ No newline at end of file
@@ -0,0 +1,250 @@
+#include <string.h>
+#include <algorithm>
+#include "store_forward.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_spi_flash.h"
+#include "esp_timer.h"
+#include "freertos/queue.h"
+#include "driver/uart.h"
+#include "constants.h"
+#include "mem.h"
+
+static const char *TAG = "STORE_FORWARD";
+
+// RAM is spilled to flash one erase sector at a time
+#define SF_SPILL_BLOCK SPI_FLASH_SEC_SIZE
+// Bounce buffer between RAM ring and flash, on the UART task stack
+#define SF_SPILL_CHUNK 512
+#define SF_NO_SECTOR SIZE_MAX
+#define SF_ERASE_TASK_STACK 3072
+
+MEM_STATIC_TASKS(sf_erase_task, 1, SF_ERASE_TASK_STACK)
+// Ports with a sector to erase ahead, at most one request per port
+static QueueHandle_t erase_requests = NULL;
+
+store_forward::store_forward(int port, size_t ram_size, bool spill)
+    : port_(port), ram_(NULL), ram_size_(0), ram_head_(0), ram_count_(0),
+      partition_(NULL), region_start_(0), region_size_(0), flash_read_(0), flash_write_(0), flash_count_(0),
+      erasing_(SF_NO_SECTOR), erased_(SF_NO_SECTOR), erase_done_(NULL), stats_()
+{
+    // PSRAM when the board has it, internal RAM otherwise
+    ram_ = (uint8_t *)heap_caps_malloc(ram_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!ram_)
+        ram_ = (uint8_t *)heap_caps_malloc(ram_size, MALLOC_CAP_8BIT);
+    if (ram_)
+    {
+        ram_size_ = ram_size;
+        mem::count(mem::SUBSYSTEM_STORE_FORWARD, ram_size);
+    }
+    else
+        ESP_LOGE(TAG, "Port %d: cannot allocate %u bytes", port, ram_size);
+
+    if (!spill)
+        return;
+    partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)SF_PARTITION_SUBTYPE, SF_PARTITION_LABEL);
+    if (!partition_)
+    {
+        ESP_LOGE(TAG, "Port %d: no '%s' partition, spill disabled", port, SF_PARTITION_LABEL);
+        return;
+    }
+    // One region per UART, each a ring of whole erase sectors
+    region_size_ = (partition_->size / UART_NUM_MAX) & ~(SPI_FLASH_SEC_SIZE - 1);
+    region_start_ = port * region_size_;
+    // Nothing is recovered across reboots, so start on a random sector to
+    // spread erase cycles over the region instead of always wearing the first
+    size_t sectors = region_size_ / SPI_FLASH_SEC_SIZE;
+    flash_read_ = flash_write_ = (esp_random() % sectors) * SPI_FLASH_SEC_SIZE;
+    ESP_LOGI(TAG, "Port %d: %u bytes RAM, %u bytes flash spill", port, ram_size_, region_size_);
+
+    erase_done_ = xSemaphoreCreateBinary();
+    if (!erase_requests)
+    {
+        erase_requests = xQueueCreate(UART_NUM_MAX, sizeof(store_forward *));
+        // Lowest priority: a 4 KB erase takes tens of ms, the UART tasks
+        // preempt it between erase slices and keep reading
+        mem::create_task(erase_task, "sf_erase", SF_ERASE_TASK_STACK, NULL, tskIDLE_PRIORITY + 1, tskNO_AFFINITY,
+                         mem::SUBSYSTEM_STORE_FORWARD, MEM_TASK_STORAGE(sf_erase_task, 0));
+    }
+    request_erase(flash_write_);
+}
+
+store_forward::~store_forward()
+{
+    // The erase task must be done with this instance, erasing_ is its last access
+    while (erasing_ != SF_NO_SECTOR)
+        vTaskDelay(1);
+    if (erase_done_)
+        vSemaphoreDelete(erase_done_);
+    free(ram_);
+    mem::uncount(mem::SUBSYSTEM_STORE_FORWARD, ram_size_);
+}
+
+void store_forward::push(const uint8_t *data, size_t length)
+{
+    if (ram_size_ == 0)
+    {
+        stats_.dropped += length;
+        return;
+    }
+    while (length > 0)
+    {
+        size_t space = ram_size_ - ram_count_;
+        if (space == 0)
+        {
+            if (!partition_ || !spill(std::min((size_t)SF_SPILL_BLOCK, ram_count_)))
+            {
+                stats_.dropped += length;
+                return;
+            }
+            continue;
+        }
+
+        size_t n = std::min(length, space);
+        size_t tail = (ram_head_ + ram_count_) % ram_size_;
+        size_t first = std::min(n, ram_size_ - tail);
+        memcpy(ram_ + tail, data, first);
+        memcpy(ram_, data + first, n - first);
+        ram_count_ += n;
+        stats_.stored += n;
+        data += n;
+        length -= n;
+    }
+}
+
+bool store_forward::push_whole(const uint8_t *data, size_t length)
+{
+    // Room is made before anything is copied
+    while (ram_size_ - ram_count_ < length)
+    {
+        if (length > ram_size_ || !partition_ || !spill(std::min((size_t)SF_SPILL_BLOCK, ram_count_)))
+        {
+            stats_.dropped += length;
+            return false;
+        }
+    }
+    push(data, length);
+    return true;
+}
+
+size_t store_forward::front(uint8_t *out, size_t max_length)
+{
+    if (flash_count_ > 0)
+    {
+        size_t n = std::min(std::min(max_length, flash_count_), region_size_ - flash_read_);
+        if (esp_partition_read(partition_, region_start_ + flash_read_, out, n) != ESP_OK)
+            return 0;
+        return n;
+    }
+    size_t n = std::min(max_length, ram_count_);
+    ram_read(out, n);
+    return n;
+}
+
+void store_forward::consume(size_t length)
+{
+    stats_.forwarded += length;
+    if (flash_count_ > 0)
+    {
+        flash_read_ = (flash_read_ + length) % region_size_;
+        flash_count_ -= length;
+        // A full region could not erase ahead, retry now that reading moved on
+        request_erase(((flash_write_ + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE) % region_size_);
+    }
+    else
+        ram_drop(length);
+}
+
+void store_forward::ram_read(uint8_t *out, size_t length)
+{
+    size_t first = std::min(length, ram_size_ - ram_head_);
+    memcpy(out, ram_ + ram_head_, first);
+    memcpy(out + first, ram_, length - first);
+}
+
+void store_forward::ram_drop(size_t length)
+{
+    ram_head_ = (ram_head_ + length) % ram_size_;
+    ram_count_ -= length;
+}
+
+void store_forward::erase_task(void *arg)
+{
+    store_forward *sf;
+    while (1)
+    {
+        if (xQueueReceive(erase_requests, &sf, portMAX_DELAY) != pdTRUE)
+            continue;
+        size_t offset = sf->erasing_;
+        bool ok = esp_partition_erase_range(sf->partition_, sf->region_start_ + offset, SPI_FLASH_SEC_SIZE) == ESP_OK;
+        sf->erased_ = ok ? offset : SF_NO_SECTOR;
+        xSemaphoreGive(sf->erase_done_);
+        sf->erasing_ = SF_NO_SECTOR;
+    }
+}
+
+// Has the sector at offset erased ahead. Unread data is contiguous up to the
+// write position, so only the sector holding the read position can be unread
+void store_forward::request_erase(size_t offset)
+{
+    if (!erase_requests || erasing_ != SF_NO_SECTOR || erased_ == offset)
+        return;
+    if (flash_count_ > 0 && flash_read_ / SPI_FLASH_SEC_SIZE == offset / SPI_FLASH_SEC_SIZE)
+        return;
+    // Clear the signal of an erase nobody waited for
+    xSemaphoreTake(erase_done_, 0);
+    erasing_ = offset;
+    store_forward *self = this;
+    if (xQueueSend(erase_requests, &self, 0) != pdTRUE)
+        erasing_ = SF_NO_SECTOR;
+}
+
+bool store_forward::spill(size_t length)
+{
+    int64_t start = esp_timer_get_time();
+    bool ok = spill_sectors(length);
+    uint32_t us = esp_timer_get_time() - start;
+    stats_.spill_us += us;
+    stats_.spill_max_us = std::max(stats_.spill_max_us, us);
+    return ok;
+}
+
+// Moves the oldest length bytes of RAM to the flash ring. Returns false when the region is full
+bool store_forward::spill_sectors(size_t length)
+{
+    uint8_t chunk[SF_SPILL_CHUNK];
+
+    while (length > 0)
+    {
+        size_t sector_offset = flash_write_ % SPI_FLASH_SEC_SIZE;
+        if (sector_offset == 0)
+        {
+            // Entering a sector: it can only be reused once fully read
+            if (flash_count_ > 0 && flash_read_ / SPI_FLASH_SEC_SIZE == flash_write_ / SPI_FLASH_SEC_SIZE)
+                return false;
+            // An erase of this very sector still running must end before the writes
+            if (erasing_ == flash_write_)
+                xSemaphoreTake(erase_done_, portMAX_DELAY);
+            if (erased_ != flash_write_)
+            {
+                stats_.inline_erases++;
+                if (esp_partition_erase_range(partition_, region_start_ + flash_write_, SPI_FLASH_SEC_SIZE) != ESP_OK)
+                    return false;
+            }
+            erased_ = SF_NO_SECTOR;
+            request_erase((flash_write_ + SPI_FLASH_SEC_SIZE) % region_size_);
+        }
+
+        size_t n = std::min(std::min(length, sizeof(chunk)), SPI_FLASH_SEC_SIZE - sector_offset);
+        ram_read(chunk, n);
+        if (esp_partition_write(partition_, region_start_ + flash_write_, chunk, n) != ESP_OK)
+            return false;
+        ram_drop(n);
+        flash_write_ = (flash_write_ + n) % region_size_;
+        flash_count_ += n;
+        stats_.spilled += n;
+        length -= n;
+    }
+    return true;
+}
@@ -0,0 +1,83 @@
+#ifndef _STORE_FORWARD_H_
+#define _STORE_FORWARD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// Per port FIFO keeping serial data while no client is connected.
+// Data goes to a RAM ring first. When the ring is full and spill is enabled,
+// its oldest bytes move to this port's region of the flash spill partition,
+// an append-only ring of erase sectors. Flash always holds older data than
+// RAM, so reads drain flash first and FIFO order is preserved. The sector
+// after the one being written is erased ahead by a low priority task, so the
+// UART task only writes.
+// Only the owning UART task may call it.
+class store_forward
+{
+public:
+  struct stats_t
+  {
+    uint64_t stored;
+    uint64_t forwarded;
+    uint64_t dropped;
+    uint64_t spilled;
+    uint32_t backlogs;
+    // Time the UART task spent spilling, and its longest single spill
+    uint64_t spill_us;
+    uint32_t spill_max_us;
+    // Sectors the UART task had to erase itself, the erase task was behind
+    uint32_t inline_erases;
+  };
+
+  store_forward(int port, size_t ram_size, bool spill);
+  ~store_forward();
+
+  // Appends bytes, drops what fits neither in RAM nor in flash
+  void push(const uint8_t *data, size_t length);
+  // Appends all of it or drops all of it, for data only valid whole
+  bool push_whole(const uint8_t *data, size_t length);
+  // Copies up to max_length of the oldest bytes, without removing them
+  size_t front(uint8_t *out, size_t max_length);
+  void consume(size_t length);
+
+  size_t size() const { return ram_count_ + flash_count_; }
+  bool empty() const { return size() == 0; }
+  void count_backlog() { stats_.backlogs++; }
+  const stats_t &stats() const { return stats_; }
+
+private:
+  void ram_read(uint8_t *out, size_t length);
+  void ram_drop(size_t length);
+  bool spill(size_t length);
+  bool spill_sectors(size_t length);
+  void request_erase(size_t offset);
+  static void erase_task(void *arg);
+
+  int port_;
+  uint8_t *ram_;
+  size_t ram_size_;
+  size_t ram_head_;
+  size_t ram_count_;
+
+  // Flash region of this port, offsets relative to region_start_
+  const esp_partition_t *partition_;
+  size_t region_start_;
+  size_t region_size_;
+  size_t flash_read_;
+  size_t flash_write_;
+  size_t flash_count_;
+
+  // Sector being erased ahead by the erase task, and the one it has erased,
+  // SF_NO_SECTOR for none. erase_done_ is given when an erase ends
+  std::atomic<size_t> erasing_;
+  std::atomic<size_t> erased_;
+  SemaphoreHandle_t erase_done_;
+
+  stats_t stats_;
+};
+
+#endif
@@ -1,7 +1,11 @@
+#include <atomic>
+#include <sys/select.h>
 #include "tcp_session.h"
 
+static std::atomic<uint32_t> next_id(1);
+
 tcp_session::tcp_session(asio::ip::tcp::socket socket, std::function<void()> _onSocketError, std::function<void(uint8_t *, std::size_t)> _dataAvailable)
-    : socket_(std::move(socket))
+    : socket_(std::move(socket)), id_(next_id++)
 {
     OnSocketError = _onSocketError;
     DataAvailable = _dataAvailable;
@@ -17,10 +21,19 @@ void tcp_session::start()
     do_read();
 }
 
-void tcp_session::send(uint8_t *data, int length)
+void tcp_session::close()
+{
+    std::error_code ec;
+    socket_.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+    socket_.close(ec);
+}
+
+bool tcp_session::send(uint8_t *data, int length)
 {
     //auto self(shared_from_this());
-    asio::write(socket_, asio::buffer(data, length));
+    std::error_code ec;
+    asio::write(socket_, asio::buffer(data, length), ec);
+    return !ec;
     /*asio::async_write(socket_, asio::buffer(data, length),
         [this, self](std::error_code ec, std::size_t length_)
         {
@@ -33,6 +46,27 @@ void tcp_session::send(uint8_t *data, int length)
         });*/
 }
 
+bool tcp_session::send_in_place(uint8_t *data, int length)
+{
+    return send(data, length);
+}
+
+// lwIP only reports a socket writable with more than TCP_SNDLOWAT bytes
+// free in its send buffer, errors make it readable and writable at once
+bool tcp_session::writable()
+{
+    int fd = socket_.native_handle();
+    if (fd < 0)
+        return true;
+    fd_set write_fds, error_fds;
+    FD_ZERO(&write_fds);
+    FD_ZERO(&error_fds);
+    FD_SET(fd, &write_fds);
+    FD_SET(fd, &error_fds);
+    struct timeval now = {0, 0};
+    return select(fd + 1, NULL, &write_fds, &error_fds, &now) != 0;
+}
+
 void tcp_session::do_read()
 {
     auto self(shared_from_this());
@@ -40,7 +74,6 @@ void tcp_session::do_read()
                             [this, self](std::error_code ec, std::size_t length) {
                                 if (!ec)
                                 {
-                                    data_[length] = 0;
                                     DataAvailable(data_, length);
 
                                     do_read();
@@ -4,25 +4,43 @@
 #include <functional>
 #include "asio.hpp"
 
+// Writable bytes a caller leaves in front of the data given to send_in_place
+#define SESSION_HEADROOM 10
+
 class tcp_session : public std::enable_shared_from_this<tcp_session>
 {
 public:
   tcp_session(asio::ip::tcp::socket socket, std::function<void()> _onSocketError, std::function<void(uint8_t *, std::size_t)> _dataAvailable);
-  ~tcp_session();
+  virtual ~tcp_session();
 
-  void start();
-  void send(uint8_t* data, int length);
+  virtual void start();
+  // False if the data could not be written
+  virtual bool send(uint8_t* data, int length);
+  // Same as send, for data preceded by SESSION_HEADROOM bytes that the
+  // session may overwrite to put its header in front without a copy
+  virtual bool send_in_place(uint8_t* data, int length);
+  // True if the socket has room for a write without blocking, or failed
+  // (the write then fails at once)
+  bool writable();
+  // False while a protocol handshake is running, nothing can be sent yet
+  // and callers treat the session as absent
+  virtual bool ready() { return true; }
+  // Abort the socket, the pending read fails and OnSocketError is raised
+  void close();
+  // Never reused, unlike the address of a freed session
+  uint32_t id() const { return id_; }
 
-private:
-  void do_read();
+protected:
+  virtual void do_read();
   std::function<void()> OnSocketError;
   std::function<void(uint8_t *, std::size_t)> DataAvailable;
 
   asio::ip::tcp::socket socket_;
+  const uint32_t id_;
 
   enum { max_length = 1024 };
   uint8_t data_[max_length];
-  
+
 };
 
-#endif
\ No newline at end of file
+#endif
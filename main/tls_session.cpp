@@ -0,0 +1,283 @@
+#include "sdkconfig.h"
+
+#if CONFIG_SER2IP32_TLS
+
+#include <string.h>
+#include "tls_session.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/ssl_ticket.h"
+#include "mbedtls/net_sockets.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/uart.h"
+#include "mem.h"
+
+#define TLS_HANDSHAKE_STACK 8192
+
+static const char *TAG = "TLS SESSION";
+
+extern const uint8_t server_cert_pem_start[] asm("_binary_server_cert_pem_start");
+extern const uint8_t server_cert_pem_end[] asm("_binary_server_cert_pem_end");
+extern const uint8_t server_key_pem_start[] asm("_binary_server_key_pem_start");
+extern const uint8_t server_key_pem_end[] asm("_binary_server_key_pem_end");
+
+// Shared by every TLS port: one config, one certificate and one ticket key set,
+// so that a session stays small (ssl context + record buffers only)
+static mbedtls_entropy_context entropy;
+static mbedtls_ctr_drbg_context ctr_drbg;
+static mbedtls_x509_crt server_cert;
+static mbedtls_pk_context server_key;
+static mbedtls_ssl_ticket_context ticket_ctx;
+static mbedtls_ssl_config conf;
+static bool initialized = false;
+
+MEM_STATIC_TASKS(handshake_task, 1, TLS_HANDSHAKE_STACK)
+// Sessions with a handshake flight to process. A session has at most one
+// entry, and a port at most two sessions while one replaces the other
+static QueueHandle_t handshakes;
+
+// AES and SHA based suites first, both run on the ESP32 crypto accelerators.
+// ECDHE only, a leaked server key does not decrypt recorded sessions
+static const int ciphersuites[] = {
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
+    0};
+
+bool tls_session::init()
+{
+    if (initialized)
+        return true;
+
+    const char *pers = "ser2ip32_tls";
+    int ret;
+
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+    mbedtls_x509_crt_init(&server_cert);
+    mbedtls_pk_init(&server_key);
+    mbedtls_ssl_ticket_init(&ticket_ctx);
+    mbedtls_ssl_config_init(&conf);
+
+    if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char *)pers, strlen(pers))) != 0)
+    {
+        ESP_LOGE(TAG, "ctr_drbg_seed failed: -0x%x", -ret);
+        return false;
+    }
+    if ((ret = mbedtls_x509_crt_parse(&server_cert, server_cert_pem_start, server_cert_pem_end - server_cert_pem_start)) != 0)
+    {
+        ESP_LOGE(TAG, "Certificate parse failed: -0x%x", -ret);
+        return false;
+    }
+    if ((ret = mbedtls_pk_parse_key(&server_key, server_key_pem_start, server_key_pem_end - server_key_pem_start, NULL, 0)) != 0)
+    {
+        ESP_LOGE(TAG, "Private key parse failed: -0x%x", -ret);
+        return false;
+    }
+    if ((ret = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0)
+    {
+        ESP_LOGE(TAG, "ssl_config_defaults failed: -0x%x", -ret);
+        return false;
+    }
+    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
+    mbedtls_ssl_conf_ciphersuites(&conf, ciphersuites);
+    if ((ret = mbedtls_ssl_conf_own_cert(&conf, &server_cert, &server_key)) != 0)
+    {
+        ESP_LOGE(TAG, "ssl_conf_own_cert failed: -0x%x", -ret);
+        return false;
+    }
+
+    // Session tickets: a reconnecting client skips the key exchange entirely
+    if ((ret = mbedtls_ssl_ticket_setup(&ticket_ctx, mbedtls_ctr_drbg_random, &ctr_drbg,
+                                        MBEDTLS_CIPHER_AES_128_GCM, CONFIG_SER2IP32_TLS_TICKET_LIFETIME)) != 0)
+    {
+        ESP_LOGE(TAG, "ssl_ticket_setup failed: -0x%x", -ret);
+        return false;
+    }
+    mbedtls_ssl_conf_session_tickets_cb(&conf, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse, &ticket_ctx);
+
+    handshakes = xQueueCreate(2 * UART_NUM_MAX, sizeof(std::shared_ptr<tcp_session> *));
+    // Lowest priority: a key exchange must not delay the ports
+    if (!handshakes || !mem::create_task(handshake_task, "tls", TLS_HANDSHAKE_STACK, NULL, tskIDLE_PRIORITY + 1,
+                                         tskNO_AFFINITY, mem::SUBSYSTEM_TLS, MEM_TASK_STORAGE(handshake_task, 0)))
+    {
+        ESP_LOGE(TAG, "Cannot start the handshake task");
+        return false;
+    }
+
+    initialized = true;
+    ESP_LOGI(TAG, "TLS context ready");
+    return true;
+}
+
+tls_session::tls_session(asio::ip::tcp::socket socket, std::function<void()> _onSocketError, std::function<void(uint8_t *, std::size_t)> _dataAvailable)
+    : tcp_session(std::move(socket), _onSocketError, _dataAvailable),
+      handshake_done_(false), handshake_start_(esp_timer_get_time()), in_pos_(0), in_len_(0)
+{
+    mbedtls_ssl_init(&ssl_);
+    int ret = mbedtls_ssl_setup(&ssl_, &conf);
+    if (ret != 0)
+    {
+        // Out of memory for the record buffers. The first read then fails on
+        // the closed socket and the session is torn down as usual
+        ESP_LOGE(TAG, "ssl_setup failed: -0x%x", -ret);
+        close();
+    }
+    mbedtls_ssl_set_bio(&ssl_, this, &tls_session::bio_send, &tls_session::bio_recv, NULL);
+}
+
+tls_session::~tls_session()
+{
+    mbedtls_ssl_free(&ssl_);
+}
+
+bool tls_session::send(uint8_t *data, int length)
+{
+    std::lock_guard<std::mutex> lock(ssl_mutex_);
+    // Nothing can be sent until the peer is authenticated, drop like a missing session
+    if (!handshake_done_)
+        return false;
+
+    while (length > 0)
+    {
+        int ret = mbedtls_ssl_write(&ssl_, data, length);
+        if (ret > 0)
+        {
+            data += ret;
+            length -= ret;
+        }
+        else if (ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+        {
+            ESP_LOGI(TAG, "Write error: -0x%x", -ret);
+            return false;
+        }
+    }
+    return true;
+}
+
+void tls_session::do_read()
+{
+    auto self(shared_from_this());
+    socket_.async_read_some(asio::buffer(data_, max_length),
+                            [this, self](std::error_code ec, std::size_t length) {
+                                if (!ec)
+                                {
+                                    in_pos_ = 0;
+                                    in_len_ = length;
+                                    if (!handshake_done_)
+                                    {
+                                        // The handshake task posts the next read
+                                        auto item = new std::shared_ptr<tcp_session>(self);
+                                        if (xQueueSend(handshakes, &item, 0) == pdTRUE)
+                                            return;
+                                        delete item;
+                                        ESP_LOGI(TAG, "Handshake queue full");
+                                    }
+                                    else if (process_input())
+                                    {
+                                        do_read();
+                                        return;
+                                    }
+                                }
+                                else
+                                    ESP_LOGI(TAG, "Read error");
+                                OnSocketError();
+                            });
+}
+
+void tls_session::handshake_task(void *arg)
+{
+    std::shared_ptr<tcp_session> *item;
+    while (1)
+    {
+        if (xQueueReceive(handshakes, &item, portMAX_DELAY) != pdTRUE)
+            continue;
+        static_cast<tls_session *>(item->get())->handshake_step();
+        delete item;
+    }
+}
+
+// Handshake task: processes the flight in data_, then hands the session back
+// to the io_context to read the next one, or the first records
+void tls_session::handshake_step()
+{
+    int ret;
+    {
+        std::lock_guard<std::mutex> lock(ssl_mutex_);
+        ret = mbedtls_ssl_handshake(&ssl_);
+    }
+    bool ok = ret == 0 || ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE;
+    if (ret == 0)
+    {
+        handshake_done_ = true;
+        ESP_LOGI(TAG, "Handshake done in %lld ms, %s", (esp_timer_get_time() - handshake_start_) / 1000,
+                 mbedtls_ssl_get_ciphersuite(&ssl_));
+    }
+    else if (!ok)
+        ESP_LOGI(TAG, "Handshake failed: -0x%x", -ret);
+
+    auto self(shared_from_this());
+    asio::post(socket_.get_executor(), [this, self, ok]() {
+        if (ok && process_input())
+            do_read();
+        else
+            OnSocketError();
+    });
+}
+
+// Drains decrypted records until mbedTLS needs more ciphertext, nothing to
+// do before the handshake is done. Returns false when the session must be
+// closed.
+bool tls_session::process_input()
+{
+    if (!handshake_done_)
+        return true;
+    std::lock_guard<std::mutex> lock(ssl_mutex_);
+    int ret;
+
+    while (true)
+    {
+        ret = mbedtls_ssl_read(&ssl_, plain_, max_length);
+        if (ret > 0)
+            DataAvailable(plain_, ret);
+        else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+            return true;
+        else
+        {
+            if (ret != 0 && ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+                ESP_LOGI(TAG, "Read error: -0x%x", -ret);
+            return false;
+        }
+    }
+}
+
+int tls_session::bio_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    tls_session *session = (tls_session *)ctx;
+    std::error_code ec;
+    asio::write(session->socket_, asio::buffer(buf, len), ec);
+    if (ec)
+        return MBEDTLS_ERR_NET_SEND_FAILED;
+    return len;
+}
+
+int tls_session::bio_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    tls_session *session = (tls_session *)ctx;
+    std::size_t available = session->in_len_ - session->in_pos_;
+    if (available == 0)
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    if (len > available)
+        len = available;
+    memcpy(buf, session->data_ + session->in_pos_, len);
+    session->in_pos_ += len;
+    return len;
+}
+
+#endif
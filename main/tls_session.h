@@ -0,0 +1,52 @@
+#ifndef _TLS_SESSION_H_
+#define _TLS_SESSION_H_
+
+#include <atomic>
+#include <mutex>
+#include "tcp_session.h"
+#include "mbedtls/ssl.h"
+
+// TLS server session layered over tcp_session. Ciphertext is read with the
+// same async_read_some loop as the plain session and fed to mbedTLS through a
+// memory BIO. The handshake (key exchange and signature, hundreds of ms) runs
+// in a low priority task of its own: while it does, the session has no read
+// pending and the io_context keeps serving the other ports. Records are
+// written with blocking socket writes from the task calling into mbedTLS,
+// the handshake task or the sender, and only alerts from the io_context.
+class tls_session : public tcp_session
+{
+public:
+  tls_session(asio::ip::tcp::socket socket, std::function<void()> _onSocketError, std::function<void(uint8_t *, std::size_t)> _dataAvailable);
+  ~tls_session();
+
+  // Loads the embedded certificate/key and sets up the shared server config
+  // and session ticket keys. Must succeed before any tls_session is created.
+  static bool init();
+
+  bool send(uint8_t* data, int length) override;
+  bool ready() override { return handshake_done_; }
+
+protected:
+  void do_read() override;
+
+private:
+  bool process_input();
+  void handshake_step();
+  static void handshake_task(void *arg);
+  static int bio_send(void *ctx, const unsigned char *buf, size_t len);
+  static int bio_recv(void *ctx, unsigned char *buf, size_t len);
+
+  mbedtls_ssl_context ssl_;
+  std::mutex ssl_mutex_;
+  // Read by the UART and egress tasks without the lock
+  std::atomic<bool> handshake_done_;
+  int64_t handshake_start_;
+
+  // Unconsumed ciphertext in data_
+  std::size_t in_pos_;
+  std::size_t in_len_;
+
+  uint8_t plain_[max_length];
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include "trace.h"
+
+#if CONFIG_SER2IP32_TRACE
+
+#include <array>
+#include <atomic>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "TRACE";
+
+#define TRACE_RECORDS CONFIG_SER2IP32_TRACE_RECORDS
+static_assert((TRACE_RECORDS & (TRACE_RECORDS - 1)) == 0, "trace records must be a power of two");
+static_assert(sizeof(trace::record_t) == 16, "trace record layout");
+
+static trace::record_t rings[portNUM_PROCESSORS][TRACE_RECORDS];
+// Records ever written per core, the slot is the index modulo the ring size
+static std::atomic<uint32_t> heads[portNUM_PROCESSORS];
+
+namespace trace
+{
+    void IRAM_ATTR record(event_t event, uint8_t port, uint32_t arg)
+    {
+        int core = xPortGetCoreID();
+        uint32_t index = heads[core].fetch_add(1, std::memory_order_relaxed);
+        record_t *r = &rings[core][index & (TRACE_RECORDS - 1)];
+        r->timestamp_us = esp_timer_get_time();
+        r->event = event;
+        r->port = port;
+        r->core = core;
+        r->arg = arg;
+    }
+
+    // Records being written during the dump may come out torn, the rings are not stopped
+    static void dump(asio::ip::tcp::socket &socket)
+    {
+        std::error_code ec;
+        uint8_t header[8] = {'S', '2', 'T', 'R', 1, portNUM_PROCESSORS, sizeof(record_t), 0};
+        asio::write(socket, asio::buffer(header), ec);
+        for (int core = 0; core < portNUM_PROCESSORS && !ec; core++)
+        {
+            uint32_t head = heads[core].load();
+            uint32_t count = head < TRACE_RECORDS ? head : TRACE_RECORDS;
+            uint32_t first = (head - count) & (TRACE_RECORDS - 1);
+            // Oldest first, the ring may wrap
+            uint32_t tail = first + count > TRACE_RECORDS ? TRACE_RECORDS - first : count;
+            std::array<asio::const_buffer, 3> buffers = {
+                asio::buffer(&count, sizeof(count)),
+                asio::buffer(&rings[core][first], tail * sizeof(record_t)),
+                asio::buffer(&rings[core][0], (count - tail) * sizeof(record_t))};
+            asio::write(socket, buffers, ec);
+        }
+    }
+
+    static void do_accept(asio::io_context *io_context, short port)
+    {
+        auto acceptor = std::make_shared<asio::ip::tcp::acceptor>(*io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port));
+        acceptor->async_accept(
+            [io_context, port, acceptor](std::error_code ec, asio::ip::tcp::socket socket) {
+                if (!ec)
+                {
+                    dump(socket);
+                    socket.close(ec);
+                }
+                acceptor->close(ec);
+                do_accept(io_context, port);
+            });
+    }
+
+    void start_server(asio::io_context *io_context, short port)
+    {
+        ESP_LOGI(TAG, "%d records per core, dump on port %d", TRACE_RECORDS, port);
+        do_accept(io_context, port);
+    }
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+// Hot path tracing. TRACE() appends a 16 byte record to the ring of the
+// calling core; writers only contend on an atomic index, so it can be used
+// from any task. With CONFIG_SER2IP32_TRACE disabled it compiles to nothing.
+// The rings are dumped to every client of CONFIG_SER2IP32_TRACE_PORT.
+namespace trace
+{
+  enum event_t : uint16_t
+  {
+    UART_EVENT = 1,     // Driver event received, arg: type << 16 | size
+    UART_READ,          // Bytes read from the driver, arg: bytes
+    ENQUEUE,            // Bytes queued (store and forward, mux ring), arg: bytes
+    DEQUEUE,            // Bytes taken from a queue, arg: bytes
+    SOCKET_WRITE,       // Socket write started, arg: bytes
+    SOCKET_WRITE_DONE,  // Socket write returned, arg: bytes
+    TCP_READ,           // Bytes read from the socket, arg: bytes
+    UART_WRITE,         // Bytes handed to the driver, arg: bytes
+  };
+
+  // Dump layout, little endian: magic "S2TR" (4) | version (1) | cores (1) | record size (2)
+  // then per core: record count (4) | records, oldest first
+  struct record_t
+  {
+    uint64_t timestamp_us;
+    uint16_t event;
+    uint8_t port;
+    uint8_t core;
+    uint32_t arg;
+  };
+
+  void record(event_t event, uint8_t port, uint32_t arg);
+}
+
+#if CONFIG_SER2IP32_TRACE
+#include "asio.hpp"
+namespace trace
+{
+  void start_server(asio::io_context *io_context, short port);
+}
+#define TRACE(event, port, arg) trace::record(trace::event, port, arg)
+#else
+#define TRACE(event, port, arg) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <mutex>
+#include "uart_buffers.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "UART BUFFERS";
+
+namespace uart_buffers
+{
+    static sizes_t installed_sizes[UART_NUM_MAX] = {};
+    // Ports grow from their own UART task
+    static std::mutex budget_mutex;
+
+    static size_t round_size(size_t size)
+    {
+        size = (size + UART_BUFFER_STEP - 1) / UART_BUFFER_STEP * UART_BUFFER_STEP;
+        return std::max((size_t)UART_BUFFER_MIN, std::min(size, (size_t)UART_BUFFER_MAX));
+    }
+
+    sizes_t for_rate(int bauds)
+    {
+        // 10 bits per byte on the line, 8N1
+        size_t bytes = (size_t)((uint64_t)bauds / 10 * CONFIG_SER2IP32_UART_STALL_MS / 1000);
+        sizes_t sizes;
+        sizes.rx = round_size(bytes);
+        // TCP data arrives in bursts of a read, the TX ring only has to smooth them
+        sizes.tx = round_size(bytes / 2);
+        return sizes;
+    }
+
+    void plan(const int bauds[UART_NUM_MAX], const sizes_t fixed[UART_NUM_MAX], sizes_t out[UART_NUM_MAX])
+    {
+        size_t fixed_total = 0;
+        size_t wanted = 0;
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            out[i] = {};
+            if (bauds[i] <= 0)
+                continue;
+            sizes_t automatic = for_rate(bauds[i]);
+            out[i].rx = fixed[i].rx ? fixed[i].rx : automatic.rx;
+            out[i].tx = fixed[i].tx ? fixed[i].tx : automatic.tx;
+            fixed_total += (fixed[i].rx ? out[i].rx : 0) + (fixed[i].tx ? out[i].tx : 0);
+            wanted += (fixed[i].rx ? 0 : out[i].rx) + (fixed[i].tx ? 0 : out[i].tx);
+        }
+
+        size_t available = CONFIG_SER2IP32_UART_BUFFER_BUDGET > fixed_total ? CONFIG_SER2IP32_UART_BUFFER_BUDGET - fixed_total : 0;
+        if (wanted <= available)
+            return;
+        ESP_LOGW(TAG, "%u bytes wanted, %u left in the budget, scaling down", wanted, available);
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            if (bauds[i] <= 0)
+                continue;
+            if (!fixed[i].rx)
+                out[i].rx = round_size((uint64_t)out[i].rx * available / wanted / UART_BUFFER_STEP * UART_BUFFER_STEP);
+            if (!fixed[i].tx)
+                out[i].tx = round_size((uint64_t)out[i].tx * available / wanted / UART_BUFFER_STEP * UART_BUFFER_STEP);
+        }
+    }
+
+    void set_installed(uart_port_t uart, const sizes_t &sizes)
+    {
+        std::lock_guard<std::mutex> lock(budget_mutex);
+        installed_sizes[uart] = sizes;
+    }
+
+    const sizes_t &installed(uart_port_t uart)
+    {
+        return installed_sizes[uart];
+    }
+
+    static size_t allocated_locked()
+    {
+        size_t total = 0;
+        for (int i = 0; i < UART_NUM_MAX; i++)
+            total += installed_sizes[i].rx + installed_sizes[i].tx;
+        return total;
+    }
+
+    bool grow(uart_port_t uart, sizes_t *sizes)
+    {
+        std::lock_guard<std::mutex> lock(budget_mutex);
+        sizes_t current = installed_sizes[uart];
+        size_t rx = std::min(current.rx * 2, (size_t)UART_BUFFER_MAX);
+        if (rx <= current.rx)
+            return false;
+        size_t used = allocated_locked();
+        if (used - current.rx + rx > CONFIG_SER2IP32_UART_BUFFER_BUDGET)
+            return false;
+        sizes->rx = rx;
+        sizes->tx = current.tx;
+        return true;
+    }
+
+    size_t allocated()
+    {
+        std::lock_guard<std::mutex> lock(budget_mutex);
+        return allocated_locked();
+    }
+
+    size_t budget()
+    {
+        return CONFIG_SER2IP32_UART_BUFFER_BUDGET;
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef _UART_BUFFERS_H_
+#define _UART_BUFFERS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "driver/uart.h"
+
+// Ring sizes are multiples of this, within the driver's limits
+#define UART_BUFFER_STEP 256
+#define UART_BUFFER_MIN 512
+#define UART_BUFFER_MAX 32768
+
+// Driver ring sizing of the ports. A port's rings hold what the line
+// delivers during CONFIG_SER2IP32_UART_STALL_MS, the longest the UART task or
+// the network may stall, and all ports share CONFIG_SER2IP32_UART_BUFFER_BUDGET.
+// Ports with sizes set in NVS keep them and only the rest of the budget is
+// planned. A port under sustained overflow pressure can grow into what is
+// left of the budget, its driver is then reinstalled (see uart_server).
+namespace uart_buffers
+{
+    struct sizes_t
+    {
+        size_t rx;
+        size_t tx;
+    };
+
+    // Rings for a baud rate, before the budget is applied
+    sizes_t for_rate(int bauds);
+    // bauds[i] is 0 for disabled ports, fixed[i] holds the NVS sizes, 0 for automatic.
+    // Automatic ports are scaled down together when the budget is short
+    void plan(const int bauds[UART_NUM_MAX], const sizes_t fixed[UART_NUM_MAX], sizes_t out[UART_NUM_MAX]);
+
+    // Sizes of the installed driver, counted against the budget
+    void set_installed(uart_port_t uart, const sizes_t &sizes);
+    const sizes_t &installed(uart_port_t uart);
+    // Doubled RX ring, false at the limit or if the budget has no room left
+    bool grow(uart_port_t uart, sizes_t *sizes);
+    size_t allocated();
+    size_t budget();
+}
+
+#endif
@@ -1,8 +1,58 @@
+#include <algorithm>
 #include <sstream>
+#include <string.h>
 #include <string>
 #include "uart_server.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "trace.h"
+#include "constants.h"
+#include "esp_timer.h"
+#include "mem.h"
+#include "ws_session.h"
+#if CONFIG_SER2IP32_TLS
+#include "tls_session.h"
+#endif
 
-uart_server::uart_server(asio::io_context *io_context, short port, uart_port_t uart)
+// Backlog bytes forwarded per loop iteration, so the UART keeps being read while draining
+#define SF_DRAIN_BUDGET 4096
+// Longest wait for the egress task to write a backlog chunk before the
+// UART task goes back to reading
+#define SF_EGRESS_WAIT_MS 10
+// A read leaving the RX ring this full is a sign of pressure. Pressure in
+// UART_PRESSURE_WINDOWS consecutive windows grows the ring
+#define UART_PRESSURE_PERCENT 75
+#define UART_PRESSURE_WINDOW_US 1000000
+#define UART_PRESSURE_WINDOWS 3
+// Largest user is the 1 KB read buffer, check with the mem command
+#define UART_TASK_STACK 4096
+// Reads of a routed port in flight to the route task. The ring holds
+// whole items, each with the ring's own 8 byte header
+#define ROUTE_RING_ITEMS 4
+#define ROUTE_RING_ITEM_OVERHEAD 8
+#define ROUTE_TASK_STACK 3072
+
+MEM_STATIC_TASKS(uart_task, UART_NUM_MAX, UART_TASK_STACK)
+MEM_STATIC_TASKS(route_task, 1, ROUTE_TASK_STACK)
+
+// Header of a routed read in the source port's route ring, the data follows
+struct route_item
+{
+    uint16_t length;
+    uint8_t routes;
+};
+
+static TaskHandle_t route_task_handle = NULL;
+static std::mutex route_setup_mutex;
+
+static uart_server *servers[UART_NUM_MAX] = {NULL};
+
+uart_server *uart_server::get(uart_port_t uart)
+{
+    return uart < UART_NUM_MAX ? servers[uart] : NULL;
+}
+
+uart_server::uart_server(asio::io_context *io_context, short port, uart_port_t uart, const port_options &options)
     //: acceptor_(io_context/*, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)*/)
 {
     // asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
@@ -12,13 +62,90 @@ uart_server::uart_server(asio::io_context *io_context, short port, uart_port_t u
 
     _io_context = io_context;
     _port = port;
-    // Start listening socket
-    do_accept();
+    _tls = options.tls;
+    _ws = options.ws;
+    _ipv6 = options.ipv6;
+    _iface = options.iface;
+    _session_iface = network::IFACE_ANY;
+    _hold = false;
+    _sf = NULL;
+    _sf_chunk = NULL;
+    _sf_markers = options.sf_markers;
+    _backlog_session = 0;
+    _backlog_seq = 0;
+    _backlog_start_size = 0;
+    _sf_in_flight = 0;
+    _sf_in_flight_drops = 0;
+    _rs485 = NULL;
+    if (options.rs485)
+        _rs485 = new rs485_port(uart, options.rs485_pre_guard_us, options.rs485_post_guard_us, options.rs485_echo_suppress);
+    _framer = NULL;
+    _tap = NULL;
+    _routed = 0;
+    _route_ring = NULL;
+    _route_drops = 0;
+    _route_tee = options.route_tee;
+    _routes = options.routes & ~BIT(uart);
+    if (_routes)
+        enable_routing();
+    _filter = NULL;
+    _egress = egress::enabled();
+    if (_egress)
+        egress::register_port(
+            uart, options.egress, [this](const uint8_t *data, size_t length) { return this->write_session(data, length); },
+            [this]() { return this->session_writable(); });
+    _autobaud = NULL;
+    _uart_events_wanted = options.uart_events != NULL;
+    _pressure_hits = 0;
+    _pressure_windows = 0;
+    _pressure_window_start = 0;
+    _regrow_pending = false;
+    _regrows = 0;
+    _serial_rx = 0;
+    _serial_tx = 0;
+    if (options.framing && options.uart_events)
+        _framer = new frame_batcher(uart, options.uart_events, options.integrity);
+    else if (options.autobaud && options.uart_events)
+        _autobaud = new autobaud(uart, options.uart_events);
+    _ppp = NULL;
+#if CONFIG_SER2IP32_PPP
+    if (options.ppp)
+        _ppp = new ppp_link(uart, [this](const uint8_t *data, size_t length) {
+            this->inject(data, length);
+        });
+#endif
+    _mqtt = false;
+#if CONFIG_SER2IP32_MQTT
+    if (options.mqtt)
+    {
+        _mqtt = true;
+        mqtt_bridge::register_port(uart, options.mqtt_qos, [this](const uint8_t *data, size_t length) {
+            this->inject(data, length);
+        });
+    }
+#endif
+    if (options.sf_size > 0)
+    {
+        _sf = new store_forward(uart, options.sf_size, options.sf_spill);
+        _sf_chunk = new uint8_t[RX_BUF_SIZE];
+        mem::count(mem::SUBSYSTEM_STORE_FORWARD, RX_BUF_SIZE);
+    }
+    servers[uart] = this;
+    network::on_link_change([this](network::iface_t iface, bool up) {
+        this->link_changed(iface, up);
+    });
+    // Start listening socket, PPP and MQTT ports have no TCP client
+    if (!_ppp && !_mqtt)
+        do_accept();
     // Uart
     _uart = uart;
+    if (options.filter[0] || options.sample > 1)
+        set_filter(options.filter, options.sample);
     std::stringstream ss;
     ss << "uart_rx_task" << port;
-    xTaskCreate(this->start_uart_impl, ss.str().c_str(), 1024 * 4, this, configMAX_PRIORITIES, NULL);
+    _task = mem::create_task(this->start_uart_impl, ss.str().c_str(), UART_TASK_STACK, this, configMAX_PRIORITIES,
+                     CONFIG_SER2IP32_UART_TASK_CORE < 0 ? tskNO_AFFINITY : CONFIG_SER2IP32_UART_TASK_CORE,
+                     mem::SUBSYSTEM_UART, MEM_TASK_STORAGE(uart_task, uart));
     //ss << "io_service";
     //xTaskCreate(this->start_asio, ss.str().c_str(), 1024 * 4, this, configMAX_PRIORITIES, NULL);
 }
@@ -29,18 +156,55 @@ uart_server::~uart_server()
 
 void uart_server::do_accept()
 {
-    auto acceptor = std::make_shared<asio::ip::tcp::acceptor>(*_io_context, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), _port));
+    asio::ip::tcp::endpoint endpoint(_ipv6 ? asio::ip::tcp::v6() : asio::ip::tcp::v4(), _port);
+    auto acceptor = std::make_shared<asio::ip::tcp::acceptor>(*_io_context);
+    acceptor->open(endpoint.protocol());
+    acceptor->set_option(asio::ip::tcp::acceptor::reuse_address(true));
+    // Dual-stack: lwIP binds the unspecified v6 address as any type, IPv4
+    // clients show up as ::ffff:a.b.c.d
+    if (_ipv6)
+        acceptor->set_option(asio::ip::v6_only(false));
+    acceptor->bind(endpoint);
+    acceptor->listen();
     acceptor->async_accept(
         [this, acceptor](std::error_code ec, asio::ip::tcp::socket socket) {
             if (!ec)
             {
-                p_session = std::make_shared<tcp_session>(std::move(socket),
-                    [=]() {
-                        this->onsocket_disconection();
-                    },
-                    [=](uint8_t * data, std::size_t length) {
-                        this->data_available(data, length);
-                    });
+                // Sessions are tagged with the interface they arrived on, and
+                // refused if the port is bound to another one
+                std::error_code lec;
+                network::iface_t iface = network::iface_of(socket.local_endpoint(lec).address());
+                if (_iface != network::IFACE_ANY && iface != _iface)
+                {
+                    ESP_LOGI("Acceptor", "Port %d bound to %s, refused connection on %s", _port,
+                             network::iface_name(_iface), network::iface_name(iface));
+                    socket.close(lec);
+                    acceptor->close(lec);
+                    do_accept();
+                    return;
+                }
+                _session_iface = iface;
+                network::count_session(iface);
+                _hold = false;
+#if CONFIG_SER2IP32_TCP_NODELAY
+                socket.set_option(asio::ip::tcp::no_delay(true), lec);
+#endif
+
+                auto on_error = [=]() {
+                    this->onsocket_disconection();
+                };
+                auto on_data = [=](uint8_t * data, std::size_t length) {
+                    this->data_available(data, length);
+                };
+#if CONFIG_SER2IP32_TLS
+                if (_tls)
+                    std::atomic_store(&p_session, std::shared_ptr<tcp_session>(std::make_shared<tls_session>(std::move(socket), on_error, on_data)));
+                else
+#endif
+                if (_ws)
+                    std::atomic_store(&p_session, std::shared_ptr<tcp_session>(std::make_shared<ws_session>(std::move(socket), on_error, on_data)));
+                else
+                    std::atomic_store(&p_session, std::make_shared<tcp_session>(std::move(socket), on_error, on_data));
                 p_session->start();
 
                 //acceptor_.cancel();
@@ -55,13 +219,53 @@ void uart_server::do_accept()
 void uart_server::onsocket_disconection()
 {
     ESP_LOGI("UART Server", "On Socket Disconnection");
-    p_session = nullptr;
+    std::atomic_store(&p_session, std::shared_ptr<tcp_session>());
     do_accept();
 }
 
 void uart_server::data_available(uint8_t * data, std::size_t length)
 {
-    uart_write_bytes(_uart, (const char *)data, length);
+    network::count_rx(_session_iface, length);
+    TRACE(TCP_READ, _uart, length);
+    inject(data, length);
+}
+
+bool uart_server::inject(const uint8_t *data, size_t length)
+{
+    // The RS-485 bus is driven by the UART task, between reads
+    if (_rs485)
+    {
+        if (!_rs485->queue_tx(data, length))
+            return false;
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(_driver_mutex);
+        uart_write_bytes(_uart, (const char *)data, length);
+    }
+    _serial_tx += length;
+    TRACE(UART_WRITE, _uart, length);
+    return true;
+}
+
+void uart_server::link_changed(network::iface_t iface, bool up)
+{
+    if (up)
+        return;
+    if (!network::link_up(_iface))
+        _hold = true;
+    // Runs in the event loop task, the session belongs to the io_context
+    asio::post(*_io_context, [this, iface]() {
+        // A session on a dead link would only notice after TCP timeouts.
+        // Close it now so the client reconnects through the remaining interface
+        if (p_session && _session_iface == iface)
+        {
+            ESP_LOGI("UART Server", "Port %d: %s down, closing session", _port, network::iface_name(iface));
+            network::count_failover(iface);
+            _hold = true;
+            p_session->close();
+        }
+    });
 }
 
 void uart_server::start_asio(void *_this)
@@ -82,18 +286,519 @@ void uart_server::start_uart_impl(void *_this)
 void uart_server::start_uart()
 {
     ESP_LOGI("START UART", "START");
-    uint8_t data[RX_BUF_SIZE];// = (uint8_t *)malloc(RX_BUF_SIZE);
+    // Room in front of the read data for a session header, see send_in_place
+    uint8_t buffer[SESSION_HEADROOM + RX_BUF_SIZE];
+    uint8_t *data = buffer + SESSION_HEADROOM;// = (uint8_t *)malloc(RX_BUF_SIZE);
     //uint8_t data[RX_BUF_SIZE + 1];
+    TickType_t read_timeout = pdMS_TO_TICKS(CONFIG_SER2IP32_UART_READ_TIMEOUT_MS);
+    if (read_timeout == 0)
+        read_timeout = 1;
     while (1)
     {
+        if (_autobaud)
+        {
+            _autobaud->poll();
+            if (_autobaud->detecting())
+            {
+                // Bytes at an unknown rate are garbage, keep them from the client
+                uart_flush_input(_uart);
+                vTaskDelay(read_timeout);
+                continue;
+            }
+        }
+#if CONFIG_SER2IP32_PPP
+        if (_ppp)
+        {
+            // The whole read goes to lwIP at once, not byte by byte
+            int rxBytes = uart_read_bytes(_uart, data, RX_BUF_SIZE, read_timeout);
+            if (rxBytes > 0)
+            {
+                TRACE(UART_READ, _uart, rxBytes);
+                _serial_rx += rxBytes;
+                _ppp->input(data, rxBytes);
+            }
+            check_pressure();
+            continue;
+        }
+#endif
+        auto session = std::atomic_load(&p_session);
+        // Until its handshake is done a session takes nothing, serial data
+        // goes where it would without a client
+        if (session && !session->ready())
+            session.reset();
+        auto mux = mux_server::session();
+        if (mux)
+            forward_mux_rx(mux.get());
+        // Routed ports hand their data to the other UARTs, and to the network only in tee mode.
+        // Framed output is not serial data, so it is never routed
+        uint8_t routes = _framer ? 0 : _routes.load();
+        bool routed_only = routes && !_route_tee;
+        // Framed output is not lines either
+        line_filter *filter = _framer ? NULL : _filter.load();
+        if (filter && !filter->active())
+            filter = NULL;
+        if (_hold && !session && !mux && !_sf && !routes && !_mqtt)
+        {
+            // Client lost to an outage: keep bytes in the driver until it comes back
+            vTaskDelay(read_timeout);
+            continue;
+        }
+        if (_rs485)
+            _rs485->service_tx();
 
-        const int rxBytes = uart_read_bytes(_uart, data, RX_BUF_SIZE, 10 / portTICK_RATE_MS);
+        // Serial data goes to the port's own client, to the mux client otherwise
+        bool via_mux = !session && mux && !routed_only && !_mqtt;
+        size_t max_read = RX_BUF_SIZE;
+        if (via_mux)
+        {
+            // Out of credit: leave the data in the driver until the host reads.
+            // A held line comes out in front of the read
+            size_t held = filter ? filter->pending() : 0;
+            if (!mux->wait_credit(_uart, _framer ? FRAMING_MIN_READ : held + 1, read_timeout))
+                continue;
+            max_read = std::min(max_read, mux->credit(_uart) - held);
+        }
+#if CONFIG_SER2IP32_MQTT
+        // Broker unreachable or QoS 1 window full: leave the data in the driver
+        if (_mqtt && !routed_only && !mqtt_bridge::wait_ready(_uart, read_timeout))
+            continue;
+#endif
+
+        // Do not wait for more serial data while a backlog is pending
+        bool backlog = _sf && !_sf->empty();
+        TickType_t timeout = backlog && session ? 0 : read_timeout;
+        // A routed read goes straight into a route ring item. Without a free
+        // item it is read as usual and its routed copy dropped, this task
+        // never waits for the targets
+        void *item = NULL;
+        RingbufHandle_t route_ring = routes ? _route_ring.load() : NULL;
+        if (route_ring &&
+            xRingbufferSendAcquire(route_ring, &item, sizeof(route_item) + RX_BUF_SIZE, 0) != pdTRUE)
+            item = NULL;
+        uint8_t *out = item ? (uint8_t *)item + sizeof(route_item) : data;
+        int rxBytes;
+        if (_framer)
+        {
+            size_t length;
+            out = _framer->read(max_read, timeout, &length);
+            rxBytes = length;
+        }
+        else if (_rs485)
+            rxBytes = _rs485->read(out, max_read, timeout);
+        else
+            rxBytes = uart_read_bytes(_uart, out, max_read, timeout);
         if (rxBytes > 0)
         {
-            // Send over session if available
-            if (p_session)
-                p_session->send(data, rxBytes);
+            TRACE(UART_READ, _uart, rxBytes);
+            _serial_rx += rxBytes;
+            StreamBufferHandle_t tap;
+            {
+                // Held across the send so set_tap(NULL) waits for it to finish
+                std::lock_guard<std::mutex> lock(_tap_mutex);
+                tap = _tap;
+                if (tap)
+                    xStreamBufferSend(tap, out, rxBytes, 0);
+            }
+            if (item)
+            {
+                // Tee: the network side works on its own copy, the item
+                // belongs to the route task once handed off
+                if (!routed_only)
+                {
+                    memcpy(data, out, rxBytes);
+                    out = data;
+                }
+                hand_off(item, rxBytes, routes);
+                item = NULL;
+            }
+            else if (routes)
+                _route_drops += rxBytes;
+            // Only the network side is filtered, routes and the tap get everything
+            size_t length = routed_only ? 0 : rxBytes;
+            bool headroom = out == data;
+            if (filter && length > 0)
+            {
+                out = filter->process(out, rxBytes, &length);
+                headroom = true;
+            }
+            // Send over session if available, behind any backlog
+            if (length == 0)
+            {
+                // Every line so far filtered out
+            }
+            else if (session && !backlog && !routed_only)
+            {
+                send_session(session.get(), out, length, headroom);
+            }
+#if CONFIG_SER2IP32_MQTT
+            else if (_mqtt && !routed_only)
+                mqtt_bridge::publish(_uart, out, length);
+#endif
+            else if (via_mux)
+                mux->send_data(_uart, out, length);
+            else if (_sf && !tap && !routed_only)
+            {
+                // A batch cut short would fail its CRC, a whole one is
+                // reported instead
+                if (_framer && _framer->integrity())
+                {
+                    if (!_sf->push_whole(out, length))
+                        _framer->discard_last();
+                }
+                else
+                    _sf->push(out, length);
+                TRACE(ENQUEUE, _uart, length);
+            }
+            else if (_framer)
+                _framer->discard_last();
         }
+        // Nothing read, the item still has to be returned
+        if (item)
+            hand_off(item, 0, routes);
+        if (_sf && session)
+            forward_backlog(session.get());
+        check_pressure();
     }
     //free(data);
-}
\ No newline at end of file
+}
+
+// Sustained backlog in the driver means the RX ring is too small for the
+// stalls this port sees. The driver is reinstalled with a larger ring once
+// the current one is empty, so that no byte is freed with it
+void uart_server::check_pressure()
+{
+    size_t buffered = 0;
+    uart_get_buffered_data_len(_uart, &buffered);
+    if (_regrow_pending)
+    {
+        if (buffered == 0)
+            reinstall_driver();
+        return;
+    }
+
+    if (buffered * 100 >= uart_buffers::installed(_uart).rx * UART_PRESSURE_PERCENT)
+        _pressure_hits++;
+    int64_t now = esp_timer_get_time();
+    if (now - _pressure_window_start < UART_PRESSURE_WINDOW_US)
+        return;
+    _pressure_window_start = now;
+    _pressure_windows = _pressure_hits ? _pressure_windows + 1 : 0;
+    _pressure_hits = 0;
+    if (_pressure_windows < UART_PRESSURE_WINDOWS)
+        return;
+    _pressure_windows = 0;
+    if (uart_buffers::grow(_uart, &_regrow_sizes))
+        _regrow_pending = true;
+    else
+        ESP_LOGW("UART Server", "Uart %d: RX ring under pressure, no budget left to grow it", _uart);
+}
+
+void uart_server::reinstall_driver()
+{
+    std::lock_guard<std::mutex> lock(_driver_mutex);
+    uart_wait_tx_done(_uart, pdMS_TO_TICKS(100));
+    // From here received bytes stay in the hardware FIFO rather than going
+    // to the ring about to be freed. What reached the ring during the TX wait
+    // is read first, the regrow is tried again once it is empty. Bytes
+    // received while the driver is replaced, well under a millisecond, can
+    // still be lost
+    uart_disable_rx_intr(_uart);
+    size_t buffered = 0;
+    uart_get_buffered_data_len(_uart, &buffered);
+    if (buffered > 0)
+    {
+        uart_enable_rx_intr(_uart);
+        return;
+    }
+    _regrow_pending = false;
+    // Deleting the driver resets the UART module, so the line settings,
+    // maybe changed at runtime or by autobaud, are reapplied afterwards
+    uart_config_t config = {};
+    uint32_t baud_rate = 0;
+    uart_get_baudrate(_uart, &baud_rate);
+    config.baud_rate = baud_rate;
+    uart_get_word_length(_uart, &config.data_bits);
+    uart_get_parity(_uart, &config.parity);
+    uart_get_stop_bits(_uart, &config.stop_bits);
+    uart_get_hw_flow_ctrl(_uart, &config.flow_ctrl);
+    uart_driver_delete(_uart);
+    QueueHandle_t events = NULL;
+    if (uart_driver_install(_uart, _regrow_sizes.rx, _regrow_sizes.tx, _uart_events_wanted ? UART_EVENT_QUEUE_SIZE : 0,
+                            _uart_events_wanted ? &events : NULL, 0) != ESP_OK)
+    {
+        // Back to the sizes that were installed before
+        _regrow_sizes = uart_buffers::installed(_uart);
+        uart_driver_install(_uart, _regrow_sizes.rx, _regrow_sizes.tx, _uart_events_wanted ? UART_EVENT_QUEUE_SIZE : 0,
+                            _uart_events_wanted ? &events : NULL, 0);
+    }
+    uart_param_config(_uart, &config);
+    if (_rs485)
+        uart_set_mode(_uart, UART_MODE_RS485_HALF_DUPLEX);
+    uart_set_rx_timeout(_uart, CONFIG_SER2IP32_UART_RX_TIMEOUT_SYMBOLS);
+    if (_framer)
+        _framer->set_events(events);
+    if (_autobaud)
+        _autobaud->set_events(events);
+    uart_buffers::set_installed(_uart, _regrow_sizes);
+    _regrows++;
+    ESP_LOGI("UART Server", "Uart %d: driver reinstalled, RX ring %u, TX ring %u", _uart, _regrow_sizes.rx, _regrow_sizes.tx);
+}
+
+// Routes of all ports share one task, just below the UART tasks, that
+// writes the handed off reads to the target UARTs. A target with a full TX
+// ring holds back this task only: the sources keep reading and count drops
+// once their route rings are full
+void uart_server::enable_routing()
+{
+    std::lock_guard<std::mutex> lock(route_setup_mutex);
+    if (_route_ring)
+        return;
+    if (!route_task_handle)
+        route_task_handle = mem::create_task(route_task, "route", ROUTE_TASK_STACK, NULL, configMAX_PRIORITIES - 2,
+                                             tskNO_AFFINITY, mem::SUBSYSTEM_UART, MEM_TASK_STORAGE(route_task, 0));
+    size_t size = ROUTE_RING_ITEMS * (ROUTE_RING_ITEM_OVERHEAD + sizeof(route_item) + RX_BUF_SIZE);
+    RingbufHandle_t ring = xRingbufferCreate(size, RINGBUF_TYPE_NOSPLIT);
+    if (!ring)
+    {
+        ESP_LOGE("UART Server", "Uart %d: cannot allocate the route ring", _uart);
+        return;
+    }
+    mem::count(mem::SUBSYSTEM_UART, size);
+    _route_ring = ring;
+}
+
+// The read buffer itself changes hands, the data is not copied on the way
+// to the target drivers
+void uart_server::hand_off(void *item, int length, uint8_t routes)
+{
+    route_item *header = (route_item *)item;
+    header->length = length;
+    header->routes = routes;
+    xRingbufferSendComplete(_route_ring, item);
+    xTaskNotifyGive(route_task_handle);
+}
+
+void uart_server::route_task(void *arg)
+{
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *source = get((uart_port_t)i);
+            RingbufHandle_t ring = source ? source->_route_ring.load() : NULL;
+            if (!ring)
+                continue;
+            size_t size;
+            route_item *item;
+            while ((item = (route_item *)xRingbufferReceive(ring, &size, 0)) != NULL)
+            {
+                if (item->length > 0)
+                    source->forward_route((uint8_t *)item + sizeof(route_item), item->length, item->routes);
+                vRingbufferReturnItem(ring, item);
+            }
+        }
+    }
+}
+
+// Route task side: RS-485 targets queue without waiting and may drop
+void uart_server::forward_route(const uint8_t *data, size_t length, uint8_t routes)
+{
+    for (int i = 0; i < UART_NUM_MAX; i++)
+    {
+        uart_server *target = (routes & BIT(i)) ? get((uart_port_t)i) : NULL;
+        if (!target)
+            continue;
+        if (target->inject(data, length))
+            _routed += length;
+        else
+            _route_drops += length;
+    }
+}
+
+void uart_server::set_tap(StreamBufferHandle_t tap)
+{
+    std::lock_guard<std::mutex> lock(_tap_mutex);
+    _tap = tap;
+}
+
+void uart_server::set_route(uint8_t routes, bool tee)
+{
+    // A port never routes to itself
+    _route_tee = tee;
+    if (routes & ~BIT(_uart))
+        enable_routing();
+    _routes = routes & ~BIT(_uart);
+    ESP_LOGI("UART Server", "Uart %d: routes 0x%02x%s", _uart, (uint8_t)_routes, tee ? " (tee)" : "");
+}
+
+bool uart_server::set_filter(const char *patterns, uint32_t sample)
+{
+    std::lock_guard<std::mutex> lock(_filter_mutex);
+    if (!line_filter::valid(patterns))
+    {
+        ESP_LOGE("UART Server", "Uart %d: invalid filter patterns \"%s\"", _uart, patterns);
+        return false;
+    }
+    line_filter *filter = _filter;
+    if (!filter)
+    {
+        // Nothing to allocate while the port is left unfiltered
+        if (!patterns[0] && sample <= 1)
+            return true;
+        filter = new line_filter(RX_BUF_SIZE, SESSION_HEADROOM);
+        mem::count(mem::SUBSYSTEM_UART, sizeof(line_filter));
+    }
+    filter->configure(patterns, sample);
+    _filter = filter;
+    ESP_LOGI("UART Server", "Uart %d: filter \"%s\", 1 in %u", _uart, filter->patterns(), filter->sample());
+    return true;
+}
+
+// Host data received by the mux for this port, written by the UART task so
+// a slow UART only holds back its own port
+void uart_server::forward_mux_rx(mux_session *mux)
+{
+    size_t length;
+    const uint8_t *item;
+    while ((item = mux->rx_front(_uart, &length)) != NULL)
+    {
+        TRACE(DEQUEUE, _uart, length);
+        write_uart(item, length);
+        mux->rx_release(_uart, item, length);
+    }
+}
+
+void uart_server::write_uart(const uint8_t *data, size_t length)
+{
+    if (_rs485)
+        _rs485->transmit(data, length);
+    else
+        uart_write_bytes(_uart, (const char *)data, length);
+    _serial_tx += length;
+    TRACE(UART_WRITE, _uart, length);
+}
+
+// Socket write of the UART task, queued to the egress task when scheduled.
+// False if the session failed the write, queuing always succeeds
+bool uart_server::send_session(tcp_session *session, uint8_t *data, size_t length, bool headroom)
+{
+    if (_egress)
+    {
+        egress::push(_uart, data, length);
+        return true;
+    }
+    TRACE(SOCKET_WRITE, _uart, length);
+    bool sent = headroom ? session->send_in_place(data, length) : session->send(data, length);
+    TRACE(SOCKET_WRITE_DONE, _uart, length);
+    if (sent)
+        network::count_tx(_session_iface, length);
+    return sent;
+}
+
+// Egress task side, queued data goes to whichever session is current
+bool uart_server::write_session(const uint8_t *data, size_t length)
+{
+    auto session = std::atomic_load(&p_session);
+    bool sent = false;
+    if (session && session->ready())
+    {
+        TRACE(SOCKET_WRITE, _uart, length);
+        sent = session->send((uint8_t *)data, length);
+        TRACE(SOCKET_WRITE_DONE, _uart, length);
+    }
+    if (sent)
+        network::count_tx(_session_iface, length);
+    else if (_framer)
+        _framer->discarded(FRAMING_GAP_EGRESS, 0, length);
+    return sent;
+}
+
+// Egress task side, a port without a session is served to drop its queue
+bool uart_server::session_writable()
+{
+    auto session = std::atomic_load(&p_session);
+    return !session || !session->ready() || session->writable();
+}
+
+void uart_server::send_marker(tcp_session *session, const char *what)
+{
+    char marker[96];
+    const store_forward::stats_t &stats = _sf->stats();
+    int length = snprintf(marker, sizeof(marker), "\r\n[SER2IP32 %s port=%d seq=%u bytes=%u dropped=%llu]\r\n",
+                          what, _uart, _backlog_seq, _backlog_start_size, stats.dropped);
+    send_session(session, (uint8_t *)marker, length);
+}
+
+// Egress only: waits for the port's queue to empty, then consumes the
+// backlog chunk that was on the way unless the egress task dropped it
+bool uart_server::settle_backlog()
+{
+    if (!egress::wait_idle(_uart, pdMS_TO_TICKS(SF_EGRESS_WAIT_MS)))
+        return false;
+    if (_sf_in_flight && egress::drops(_uart) == _sf_in_flight_drops)
+        _sf->consume(_sf_in_flight);
+    _sf_in_flight = 0;
+    return true;
+}
+
+// The backlog leaves the store only once written, a failed write leaves it
+// for the next session
+bool uart_server::send_backlog(tcp_session *session, size_t length)
+{
+    if (!_egress)
+    {
+        if (!send_session(session, _sf_chunk, length))
+            return false;
+        _sf->consume(length);
+        return true;
+    }
+    // Alone in the queue, any drop until it is idle again is this chunk's
+    if (!settle_backlog())
+        return false;
+    _sf_in_flight = length;
+    _sf_in_flight_drops = egress::drops(_uart);
+    egress::push(_uart, _sf_chunk, length);
+    return settle_backlog();
+}
+
+// Streams up to SF_DRAIN_BUDGET bytes of the backlog to the session
+void uart_server::forward_backlog(tcp_session *session)
+{
+    // A chunk the egress task has not written yet still counts as backlog
+    if (_sf_in_flight && !settle_backlog())
+        return;
+    if (_sf->empty())
+    {
+        if (_backlog_session == session->id())
+        {
+            if (_sf_markers)
+                send_marker(session, "BACKLOG END");
+            _backlog_session = 0;
+        }
+        return;
+    }
+
+    if (_backlog_session != session->id())
+    {
+        // New client (or a reconnect in the middle of a backlog)
+        _backlog_session = session->id();
+        _backlog_seq++;
+        _backlog_start_size = _sf->size();
+        _sf->count_backlog();
+        if (_sf_markers)
+            send_marker(session, "BACKLOG BEGIN");
+    }
+
+    size_t budget = SF_DRAIN_BUDGET;
+    while (budget > 0 && !_sf->empty())
+    {
+        size_t n = _sf->front(_sf_chunk, std::min((size_t)RX_BUF_SIZE, budget));
+        if (n == 0)
+            break;
+        TRACE(DEQUEUE, _uart, n);
+        if (!send_backlog(session, n))
+            break;
+        budget -= n;
+    }
+}
@@ -1,15 +1,114 @@
 #ifndef _UART_SERVER_H_
 #define _UART_SERVER_H_
 
+#include <atomic>
+#include <mutex>
 #include "tcp_session.h"
+#include "network.h"
+#include "store_forward.h"
+#include "rs485.h"
+#include "mux_server.h"
+#include "framing.h"
+#include "egress.h"
+#include "autobaud.h"
+#include "uart_buffers.h"
+#include "ppp_link.h"
+#include "mqtt_bridge.h"
+#include "line_filter.h"
 #include "driver/uart.h"
+#include "freertos/stream_buffer.h"
+#include "freertos/ringbuf.h"
+
+// Per port options read from NVS, beyond the UART parameters
+struct port_options
+{
+  bool tls;
+  // WebSocket framing, for browsers connecting directly
+  bool ws;
+  // One IPv6 socket also accepting IPv4 clients, as v4-mapped addresses
+  bool ipv6;
+  network::iface_t iface;
+  // Store and forward: RAM buffer size (0 disables), flash spill, backlog markers
+  size_t sf_size;
+  bool sf_spill;
+  bool sf_markers;
+  // RS-485 half duplex: bus guard times and echo suppression
+  bool rs485;
+  uint32_t rs485_pre_guard_us;
+  uint32_t rs485_post_guard_us;
+  bool rs485_echo_suppress;
+  // UART to UART routing: bitmask of target uarts, tee also sends to the network
+  uint8_t routes;
+  bool route_tee;
+  // Egress scheduling, when built with CONFIG_SER2IP32_EGRESS
+  egress::port_config_t egress;
+  // Timestamped framing or automatic baud rate, both need the driver event queue
+  bool framing;
+  // Framing with CRC32 and gap entries (--framing=2)
+  bool integrity;
+  bool autobaud;
+  QueueHandle_t uart_events;
+  // PPP server on the line instead of a TCP client, when built with CONFIG_SER2IP32_PPP
+  bool ppp;
+  // Publish to and subscribe from the MQTT broker instead of serving a TCP
+  // client, when built with CONFIG_SER2IP32_MQTT. QoS 0 or 1
+  bool mqtt;
+  int mqtt_qos;
+  // Line filter of the data sent to the network, see line_filter.h
+  char filter[FILTER_PATTERNS_MAX + 1];
+  uint32_t sample;
+};
 
 class uart_server
 {
 public:
-  uart_server(asio::io_context* io_context, short port, uart_port_t uart);
+  uart_server(asio::io_context* io_context, short port, uart_port_t uart, const port_options &options);
   ~uart_server();
 
+  // Server of a UART, NULL if the port is not enabled
+  static uart_server *get(uart_port_t uart);
+  // Store and forward buffer, NULL if disabled
+  const store_forward *sf() const { return _sf; }
+  // RS-485 bus, NULL in full duplex mode
+  const rs485_port *rs485() const { return _rs485; }
+  // Timestamped framing, NULL if disabled
+  const frame_batcher *framer() const { return _framer; }
+  // Automatic baud rate, NULL if disabled
+  const autobaud *baud_detector() const { return _autobaud; }
+  // PPP server, NULL unless the port is in PPP mode
+  const ppp_link *ppp() const { return _ppp; }
+
+  // Bench: bytes written as if received from the client, and a stream
+  // buffer also getting everything read from the UART (NULL to detach,
+  // the UART task is done with the old tap once this returns).
+  // inject returns false when an RS-485 port had no room and dropped the data
+  bool inject(const uint8_t *data, size_t length);
+  void set_tap(StreamBufferHandle_t tap);
+
+  // Routing of this port's serial data to other uarts, applied at once
+  void set_route(uint8_t routes, bool tee);
+  uint8_t routes() const { return _routes; }
+  bool route_tee() const { return _route_tee; }
+  uint64_t routed() const { return _routed; }
+  // Routed bytes dropped: no free read buffer, or an RS-485 target queue full
+  uint64_t route_drops() const { return _route_drops; }
+
+  // Line filter of this port's data to the network, applied at once. False
+  // if the patterns are invalid
+  bool set_filter(const char *patterns, uint32_t sample);
+  // NULL if the port was never filtered
+  const line_filter *filter() const { return _filter; }
+
+  // Driver reinstalls with a larger RX ring
+  uint32_t regrows() const { return _regrows; }
+
+  // Serial bytes read from the UART and written to it, whatever their source or destination
+  uint64_t serial_rx() const { return _serial_rx; }
+  uint64_t serial_tx() const { return _serial_tx; }
+  bool connected() const { return std::atomic_load(&p_session) != nullptr; }
+  // UART task, for CPU accounting
+  TaskHandle_t task() const { return _task; }
+
 private:
   const int RX_BUF_SIZE = 1024;
   void do_accept();
@@ -19,11 +118,79 @@ private:
   void start_asio();
   void onsocket_disconection();
   void data_available(uint8_t *, std::size_t length);
+  void link_changed(network::iface_t iface, bool up);
+  void send_marker(tcp_session *session, const char *what);
+  bool settle_backlog();
+  bool send_backlog(tcp_session *session, size_t length);
+  void forward_backlog(tcp_session *session);
+  void forward_mux_rx(mux_session *mux);
+  void write_uart(const uint8_t *data, size_t length);
+  void enable_routing();
+  void hand_off(void *item, int length, uint8_t routes);
+  void forward_route(const uint8_t *data, size_t length, uint8_t routes);
+  static void route_task(void *arg);
+  bool send_session(tcp_session *session, uint8_t *data, size_t length, bool headroom = false);
+  bool write_session(const uint8_t *data, size_t length);
+  bool session_writable();
+  void check_pressure();
+  void reinstall_driver();
 
   uart_port_t _uart;
   std::shared_ptr<tcp_session> p_session;
   std::shared_ptr<asio::ip::tcp::acceptor> acceptor_;
   int _port;
+  bool _tls;
+  bool _ws;
+  bool _ipv6;
+  size_t _backlog_start_size;
+  network::iface_t _iface;
+  network::iface_t _session_iface;
+  // Set by a link loss, cleared by the next session: UART data is left in the
+  // driver ring buffer instead of being discarded in the meantime
+  std::atomic<bool> _hold;
+  store_forward *_sf;
+  bool _sf_markers;
+  uint8_t *_sf_chunk;
+  // Front of the backlog handed to the egress task, consumed once written,
+  // and the egress drop count when it was pushed
+  size_t _sf_in_flight;
+  uint32_t _sf_in_flight_drops;
+  // Id of the session the backlog is currently streamed to, for the
+  // begin/end markers, 0 for none
+  uint32_t _backlog_session;
+  uint32_t _backlog_seq;
+  rs485_port *_rs485;
+  frame_batcher *_framer;
+  autobaud *_autobaud;
+  ppp_link *_ppp;
+  bool _mqtt;
+  StreamBufferHandle_t _tap;
+  std::mutex _tap_mutex;
+  std::atomic<uint8_t> _routes;
+  std::atomic<bool> _route_tee;
+  uint64_t _routed;
+  // Reads of a routed port land in this ring and are handed to the route
+  // task as they are. Created by the first route, kept afterwards
+  std::atomic<RingbufHandle_t> _route_ring;
+  std::atomic<uint64_t> _route_drops;
+  // Created by the first set_filter, kept once the filter is turned off
+  std::atomic<line_filter *> _filter;
+  std::mutex _filter_mutex;
+  // Socket writes go through the egress scheduler
+  bool _egress;
+  // Held by writers to the driver while the UART task may reinstall it
+  std::mutex _driver_mutex;
+  bool _uart_events_wanted;
+  // Reads that left the RX ring mostly full, per window
+  uint32_t _pressure_hits;
+  uint32_t _pressure_windows;
+  int64_t _pressure_window_start;
+  bool _regrow_pending;
+  uart_buffers::sizes_t _regrow_sizes;
+  uint32_t _regrows;
+  std::atomic<uint64_t> _serial_rx;
+  std::atomic<uint64_t> _serial_tx;
+  TaskHandle_t _task;
   asio::io_context *_io_context;
 };
 
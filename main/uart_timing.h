@@ -0,0 +1,21 @@
+#ifndef _UART_TIMING_H_
+#define _UART_TIMING_H_
+
+#include "driver/uart.h"
+
+// Duration of one character on the line with the UART's current settings, in us
+static inline uint32_t uart_char_time_us(uart_port_t uart)
+{
+    uint32_t baud = 115200;
+    uart_word_length_t data_bits = UART_DATA_8_BITS;
+    uart_parity_t parity = UART_PARITY_DISABLE;
+    uart_stop_bits_t stop_bits = UART_STOP_BITS_1;
+    uart_get_baudrate(uart, &baud);
+    uart_get_word_length(uart, &data_bits);
+    uart_get_parity(uart, &parity);
+    uart_get_stop_bits(uart, &stop_bits);
+    uint32_t frame_bits = 1 + (5 + data_bits) + (parity == UART_PARITY_DISABLE ? 0 : 1) + (stop_bits == UART_STOP_BITS_1 ? 1 : 2);
+    return frame_bits * 1000000 / (baud ? baud : 1);
+}
+
+#endif
@@ -0,0 +1,256 @@
+#include "web.h"
+
+#if CONFIG_SER2IP32_WEB
+
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+#include "network.h"
+#include "uart_server.h"
+#include "esp_http_server.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#define WEB_SAMPLE_SIZE (4 + UART_NUM_MAX * 8)
+#define WEB_HEADER_SIZE 12
+#define WEB_FRAME_MAX (WEB_HEADER_SIZE + WEB_RING_SAMPLES * WEB_SAMPLE_SIZE)
+// Besides the WebSocket clients, a page load needs a couple of sockets at once
+#define WEB_MAX_SOCKETS 4
+
+extern const uint8_t index_html_gz_start[] asm("_binary_index_html_gz_start");
+extern const uint8_t index_html_gz_end[] asm("_binary_index_html_gz_end");
+
+namespace web
+{
+    static const char *TAG = "WEB";
+
+    struct sample_t
+    {
+        uint8_t connected;
+        uint32_t rx[UART_NUM_MAX];
+        uint32_t tx[UART_NUM_MAX];
+    };
+
+    static httpd_handle_t server = NULL;
+    static esp_timer_handle_t sample_timer = NULL;
+    static sample_t ring[WEB_RING_SAMPLES];
+    // Sequence number of the next sample, the ring holds the last WEB_RING_SAMPLES
+    static uint32_t next_seq = 0;
+    static uint32_t pushed_seq = 0;
+    static uint64_t last_rx[UART_NUM_MAX];
+    static uint64_t last_tx[UART_NUM_MAX];
+    static stats_t counters = {};
+    static int ws_clients = 0;
+    // Only used from the server task
+    static uint8_t frame[WEB_FRAME_MAX];
+
+    static void put16(uint8_t *p, uint16_t value)
+    {
+        p[0] = value;
+        p[1] = value >> 8;
+    }
+
+    static void put32(uint8_t *p, uint32_t value)
+    {
+        put16(p, value);
+        put16(p + 2, value >> 16);
+    }
+
+    // Samples first_seq up to next_seq, the ones still in the ring. The
+    // oldest slot is left out, the sampler may be overwriting it
+    static size_t build_frame(uint32_t first_seq)
+    {
+        uint32_t last = next_seq;
+        uint32_t available = std::min(last, (uint32_t)WEB_RING_SAMPLES - 1);
+        if (last - first_seq > available)
+            first_seq = last - available;
+        uint16_t count = last - first_seq;
+        frame[0] = WEB_FRAME_VERSION;
+        frame[1] = UART_NUM_MAX;
+        put16(frame + 2, count);
+        put32(frame + 4, first_seq);
+        put16(frame + 8, CONFIG_SER2IP32_WEB_SAMPLE_MS);
+        put16(frame + 10, 0);
+        uint8_t *p = frame + WEB_HEADER_SIZE;
+        for (uint32_t seq = first_seq; seq != last; seq++)
+        {
+            const sample_t &s = ring[seq % WEB_RING_SAMPLES];
+            memset(p, 0, 4);
+            p[0] = s.connected;
+            p += 4;
+            for (int i = 0; i < UART_NUM_MAX; i++)
+            {
+                put32(p, s.rx[i]);
+                put32(p + 4, s.tx[i]);
+                p += 8;
+            }
+        }
+        return p - frame;
+    }
+
+    static bool send_frame(int fd, size_t length)
+    {
+        httpd_ws_frame_t ws = {};
+        ws.type = HTTPD_WS_TYPE_BINARY;
+        ws.payload = frame;
+        ws.len = length;
+        esp_err_t err = httpd_ws_send_frame_async(server, fd, &ws);
+        if (err == ESP_OK)
+            counters.frames_sent++;
+        else
+            counters.send_errors++;
+        return err == ESP_OK;
+    }
+
+    // Server task: one frame for all clients
+    static void push_batch(void *arg)
+    {
+        int64_t start = esp_timer_get_time();
+        size_t fds = CONFIG_LWIP_MAX_SOCKETS;
+        int client_fds[CONFIG_LWIP_MAX_SOCKETS];
+        if (httpd_get_client_list(server, &fds, client_fds) != ESP_OK)
+            return;
+        size_t length = build_frame(pushed_seq);
+        pushed_seq = next_seq;
+        int clients = 0;
+        for (size_t i = 0; i < fds; i++)
+            if (httpd_ws_get_fd_info(server, client_fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET)
+            {
+                send_frame(client_fds[i], length);
+                clients++;
+            }
+        ws_clients = clients;
+        counters.batches++;
+        counters.push_us += esp_timer_get_time() - start;
+    }
+
+    // esp_timer task, a few loads and stores per port
+    static void sample(void *arg)
+    {
+        int64_t start = esp_timer_get_time();
+        sample_t &s = ring[next_seq % WEB_RING_SAMPLES];
+        s.connected = 0;
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uart_server *port = uart_server::get((uart_port_t)i);
+            uint64_t rx = port ? port->serial_rx() : 0;
+            uint64_t tx = port ? port->serial_tx() : 0;
+            s.rx[i] = rx - last_rx[i];
+            s.tx[i] = tx - last_tx[i];
+            last_rx[i] = rx;
+            last_tx[i] = tx;
+            if (port && port->connected())
+                s.connected |= BIT(i);
+        }
+        next_seq++;
+        counters.samples++;
+        counters.sample_us += esp_timer_get_time() - start;
+        if (next_seq % CONFIG_SER2IP32_WEB_BATCH == 0 && ws_clients > 0)
+            httpd_queue_work(server, push_batch, NULL);
+    }
+
+    static esp_err_t index_handler(httpd_req_t *req)
+    {
+        httpd_resp_set_type(req, "text/html");
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+        httpd_resp_set_hdr(req, "Cache-Control", "max-age=3600");
+        return httpd_resp_send(req, (const char *)index_html_gz_start, index_html_gz_end - index_html_gz_start);
+    }
+
+    static esp_err_t status_handler(httpd_req_t *req)
+    {
+        char json[768];
+        int n = snprintf(json, sizeof(json), "{\"uptime\":%lld,\"links\":{", esp_timer_get_time() / 1000000);
+        for (int i = network::IFACE_ETHERNET; i < network::IFACE_COUNT; i++)
+            n += snprintf(json + n, sizeof(json) - n, "%s\"%s\":%s", i > network::IFACE_ETHERNET ? "," : "",
+                          network::iface_name((network::iface_t)i), network::link_up((network::iface_t)i) ? "true" : "false");
+        n += snprintf(json + n, sizeof(json) - n, "},\"ports\":[");
+        for (int i = 0; i < UART_NUM_MAX; i++)
+        {
+            uint32_t bauds = 0;
+            uart_server *port = uart_server::get((uart_port_t)i);
+            if (port)
+                uart_get_baudrate((uart_port_t)i, &bauds);
+            n += snprintf(json + n, sizeof(json) - n, "%s{\"uart\":%d,\"enabled\":%s,\"bauds\":%u,\"rx\":%llu,\"tx\":%llu}",
+                          i ? "," : "", i, port ? "true" : "false", bauds, port ? port->serial_rx() : 0ULL,
+                          port ? port->serial_tx() : 0ULL);
+        }
+        n += snprintf(json + n, sizeof(json) - n, "],\"web\":{\"sample_us\":%llu,\"push_us\":%llu,\"samples\":%u,\"batches\":%u}}",
+                      counters.sample_us, counters.push_us, counters.samples, counters.batches);
+        httpd_resp_set_type(req, "application/json");
+        return httpd_resp_send(req, json, n < (int)sizeof(json) ? n : sizeof(json) - 1);
+    }
+
+    static esp_err_t ws_handler(httpd_req_t *req)
+    {
+        // Handshake: the new client starts with the whole ring
+        if (req->method == HTTP_GET)
+        {
+            ws_clients++;
+            send_frame(httpd_req_to_sockfd(req), build_frame(0));
+            return ESP_OK;
+        }
+        // Nothing is expected from the page, frames are read and dropped
+        httpd_ws_frame_t ws = {};
+        uint8_t discard[16];
+        ws.payload = discard;
+        esp_err_t err = httpd_ws_recv_frame(req, &ws, 0);
+        if (err != ESP_OK || ws.len > sizeof(discard))
+            return ESP_FAIL;
+        return httpd_ws_recv_frame(req, &ws, ws.len);
+    }
+
+    void start(int port)
+    {
+        httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+        config.server_port = port;
+        config.ctrl_port = port + 1;
+        config.max_open_sockets = WEB_MAX_SOCKETS;
+        config.lru_purge_enable = true;
+        config.task_priority = tskIDLE_PRIORITY + 1;
+        if (httpd_start(&server, &config) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Cannot start the server on port %d", port);
+            return;
+        }
+
+        httpd_uri_t index = {};
+        index.uri = "/";
+        index.method = HTTP_GET;
+        index.handler = index_handler;
+        httpd_register_uri_handler(server, &index);
+
+        httpd_uri_t status = {};
+        status.uri = "/api/status";
+        status.method = HTTP_GET;
+        status.handler = status_handler;
+        httpd_register_uri_handler(server, &status);
+
+        httpd_uri_t ws = {};
+        ws.uri = "/ws";
+        ws.method = HTTP_GET;
+        ws.handler = ws_handler;
+        ws.is_websocket = true;
+        httpd_register_uri_handler(server, &ws);
+
+        esp_timer_create_args_t timer_args = {};
+        timer_args.callback = &sample;
+        timer_args.name = "web_sample";
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sample_timer));
+        ESP_ERROR_CHECK(esp_timer_start_periodic(sample_timer, CONFIG_SER2IP32_WEB_SAMPLE_MS * 1000));
+        ESP_LOGI(TAG, "Dashboard on port %d, %u bytes page", port, index_html_gz_end - index_html_gz_start);
+    }
+
+    const stats_t &stats()
+    {
+        return counters;
+    }
+
+    int clients()
+    {
+        return ws_clients;
+    }
+}
+
+#endif
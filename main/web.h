@@ -0,0 +1,40 @@
+#ifndef _WEB_H_
+#define _WEB_H_
+
+#include <stdint.h>
+#include "driver/uart.h"
+#include "sdkconfig.h"
+
+// Read only status dashboard, built with CONFIG_SER2IP32_WEB. The page is
+// gzipped at build time and served from flash as is. Port counters are
+// sampled every CONFIG_SER2IP32_WEB_SAMPLE_MS into a fixed ring, whatever the
+// number of viewers, and every CONFIG_SER2IP32_WEB_BATCH samples the new ones
+// are sent to all WebSocket clients in one binary frame, little endian:
+//
+//   | version (1) | ports (1) | count (2) | first seq (4) | interval ms (2) | reserved (2) |
+//   then count samples of | connected mask (1) | reserved (3) | per port: rx delta (4) | tx delta (4) |
+//
+// Deltas are serial bytes read from and written to the UART during the
+// interval. A new client first gets the whole ring.
+#define WEB_RING_SAMPLES 64
+#define WEB_FRAME_VERSION 1
+
+namespace web
+{
+    struct stats_t
+    {
+        uint32_t samples;
+        uint32_t batches;
+        uint32_t frames_sent;
+        uint32_t send_errors;
+        // Time spent sampling and building and sending batches, for the dashboard's own cost
+        uint64_t sample_us;
+        uint64_t push_us;
+    };
+
+    void start(int port);
+    const stats_t &stats();
+    int clients();
+}
+
+#endif
@@ -0,0 +1,8 @@
+#!/usr/bin/env python3
+"""Gzips a dashboard asset for embedding, without a timestamp so builds are reproducible."""
+
+import gzip
+import sys
+
+with open(sys.argv[1], "rb") as source, open(sys.argv[2], "wb") as target:
+    target.write(gzip.compress(source.read(), compresslevel=9, mtime=0))
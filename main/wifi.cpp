@@ -5,19 +5,43 @@
 #include "esp_system.h"
 #include <string.h>
 
+#include "esp_timer.h"
+#include "esp_wnm.h"
+
 #include "wifi.h"
+#include "network.h"
+#include "storage.h"
+#include "storage_keys.h"
 /* The event group allows multiple bits for each event, but we only care about two events:
  * - we are connected to the AP with an IP
  * - we failed to connect after the maximum amount of retries */
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
 
+// constants.h redefines WIFI_MODE_AP, keep it out of this file
+#define STORAGE_NAMESPACE "storage"
+
+// Station reconnection and roaming
+#define WIFI_RECONNECT_BACKOFF_MIN_MS 100
+#define WIFI_RECONNECT_BACKOFF_MAX_MS 30000
+#define WIFI_DIRECT_CONNECT_ATTEMPTS 2
+#define WIFI_ROAM_RSSI_THRESHOLD -70
+#define WIFI_ROAM_RSSI_HYSTERESIS 8
+#define WIFI_ROAM_SCAN_MAX_APS 16
+// A disconnection this soon after a BSS transition query may be the AP steering us
+#define WIFI_BTM_TRANSITION_MS 10000
+
 const char *TAG_WIFI = "SER2IP32_wifi";
 
 // AP
 void wifi::wifi_event_handler_softAP(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
-    if (event_id == WIFI_EVENT_AP_STACONNECTED) {
+    if (event_id == WIFI_EVENT_AP_START) {
+        network::start_ipv6(network::IFACE_WIFI);
+        network::set_link(network::IFACE_WIFI, true);
+    } else if (event_id == WIFI_EVENT_AP_STOP) {
+        network::set_link(network::IFACE_WIFI, false);
+    } else if (event_id == WIFI_EVENT_AP_STACONNECTED) {
         wifi_event_ap_staconnected_t* event = (wifi_event_ap_staconnected_t*) event_data;
         ESP_LOGI(TAG_WIFI, "station " MACSTR" join, AID=%d",
                  MAC2STR(event->mac), event->aid);
@@ -30,8 +54,8 @@ void wifi::wifi_event_handler_softAP(void* arg, esp_event_base_t event_base, int
 
 void wifi::wifi_init_softap(const char * ssid, const char * password, uint8_t max_connections, uint8_t _channel)
 {
-    esp_netif_init();
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    network::init();
+    network::register_netif(network::IFACE_WIFI, esp_netif_create_default_wifi_ap());
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -65,86 +89,253 @@ void wifi::wifi_init_softap(const char * ssid, const char * password, uint8_t ma
 }
 
 // STATION
+//
+// Reconnection engine:
+// - The BSSID/channel of the last association is cached in NVS and used for a
+//   direct connect (no full scan) on boot and after a disconnection.
+// - Failed attempts back off exponentially, and fall back to a full scan after
+//   WIFI_DIRECT_CONNECT_ATTEMPTS direct attempts.
+// - When the RSSI drops below WIFI_ROAM_RSSI_THRESHOLD, an 802.11v BSS transition
+//   query lets the AP steer us. Without 802.11v, a scan for a stronger AP of the
+//   same SSID is done and we roam to it directly. A disconnection that may be
+//   the transition reconnects without the cached BSSID, so as not to undo it.
+static wifi_config_t sta_config;
+static uint8_t cached_bssid[6];
+static uint8_t cached_channel = 0;
+static uint32_t failed_attempts = 0;
+static esp_timer_handle_t reconnect_timer = NULL;
+static volatile wifi::state_t sta_state = wifi::STATE_DISCONNECTED;
+static int64_t disconnected_at = 0;
+static bool roam_scan_pending = false;
+static int64_t btm_query_at = 0;
+static wifi::reconnect_stats sta_stats = {};
+
+void wifi::sta_connect(bool pin_bssid)
+{
+    bool direct = pin_bssid && cached_channel != 0 && failed_attempts < WIFI_DIRECT_CONNECT_ATTEMPTS;
+    sta_config.sta.bssid_set = direct;
+    if (direct)
+    {
+        memcpy(sta_config.sta.bssid, cached_bssid, sizeof(cached_bssid));
+        sta_config.sta.channel = cached_channel;
+        sta_config.sta.scan_method = WIFI_FAST_SCAN;
+    }
+    else
+    {
+        sta_config.sta.channel = 0;
+        sta_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    }
+    esp_wifi_set_config(WIFI_IF_STA, &sta_config);
+
+    ESP_LOGI(TAG_WIFI, "connecting (%s, attempt %u)", direct ? "direct" : "scan", failed_attempts + 1);
+    sta_state = STATE_CONNECTING;
+    sta_stats.attempts++;
+    esp_wifi_connect();
+}
+
+void wifi::reconnect_timer_callback(void* arg)
+{
+    sta_connect();
+}
+
+void wifi::sta_roam_scan_done()
+{
+    static wifi_ap_record_t records[WIFI_ROAM_SCAN_MAX_APS];
+    uint16_t count = WIFI_ROAM_SCAN_MAX_APS;
+    wifi_ap_record_t current;
+
+    if (esp_wifi_scan_get_ap_records(&count, records) != ESP_OK || esp_wifi_sta_get_ap_info(&current) != ESP_OK)
+        return;
+
+    // Records are sorted by RSSI, the first other BSSID is the best candidate
+    for (int i = 0; i < count; i++)
+    {
+        if (memcmp(records[i].bssid, current.bssid, sizeof(current.bssid)) == 0)
+            continue;
+        if (records[i].rssi < current.rssi + WIFI_ROAM_RSSI_HYSTERESIS)
+            break;
+
+        ESP_LOGI(TAG_WIFI, "roaming to " MACSTR " (%d dBm, current %d dBm)",
+                 MAC2STR(records[i].bssid), records[i].rssi, current.rssi);
+        memcpy(cached_bssid, records[i].bssid, sizeof(cached_bssid));
+        cached_channel = records[i].primary;
+        failed_attempts = 0;
+        sta_state = STATE_ROAMING;
+        esp_wifi_disconnect();
+        return;
+    }
+    // Nothing better, get notified again on the next drop
+    esp_wifi_set_rssi_threshold(WIFI_ROAM_RSSI_THRESHOLD);
+}
+
 void wifi::wifi_event_handler_station(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
-    ESP_LOGI("wifi_station", "event_handler");
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
+        sta_connect();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        wifi_event_sta_connected_t* event = (wifi_event_sta_connected_t*) event_data;
+        ESP_LOGI(TAG_WIFI, "associated to " MACSTR " channel %d", MAC2STR(event->bssid), event->channel);
+        network::start_ipv6(network::IFACE_WIFI);
+        // Cache for the next direct connect, only written when it changed
+        if (cached_channel != event->channel || memcmp(cached_bssid, event->bssid, sizeof(cached_bssid)) != 0)
+        {
+            memcpy(cached_bssid, event->bssid, sizeof(cached_bssid));
+            cached_channel = event->channel;
+            storage::write_blob(STORAGE_NAMESPACE, STORAGE_WIFI_BSSID, cached_bssid, sizeof(cached_bssid));
+            storage::write_int32(STORAGE_NAMESPACE, STORAGE_WIFI_STA_CHANNEL, cached_channel);
+        }
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        //if (s_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY) {
-            esp_wifi_connect();
-            //s_retry_num++;
-            ESP_LOGI(TAG_WIFI, "retry to connect to the AP");
-        //} else {
-        //    xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
-        //}
-        //ESP_LOGI(TAG,"connect to the AP fail");
+        wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
+        network::set_link(network::IFACE_WIFI, false);
+
+        if (sta_state == STATE_CONNECTED || sta_state == STATE_ROAMING)
+        {
+            disconnected_at = esp_timer_get_time();
+            sta_stats.disconnections++;
+        }
+
+        if (sta_state == STATE_ROAMING)
+        {
+            // Deliberate disconnection, go straight to the new AP
+            sta_stats.roams++;
+            sta_connect();
+        }
+        else if (sta_state == STATE_CONNECTED)
+        {
+            bool steered = btm_query_at != 0 && esp_timer_get_time() - btm_query_at < WIFI_BTM_TRANSITION_MS * 1000LL;
+            btm_query_at = 0;
+            failed_attempts = 0;
+            if (steered)
+            {
+                // The AP may be moving us to another BSS, the old BSSID would undo it
+                ESP_LOGI(TAG_WIFI, "disconnected after a BSS transition query, reason %d", event->reason);
+                sta_connect(false);
+            }
+            else
+            {
+                // First attempt is immediate, to the cached AP
+                ESP_LOGI(TAG_WIFI, "disconnected, reason %d", event->reason);
+                sta_connect();
+            }
+        }
+        else
+        {
+            failed_attempts++;
+            uint32_t shift = failed_attempts - 1 < 16 ? failed_attempts - 1 : 16;
+            uint32_t backoff_ms = WIFI_RECONNECT_BACKOFF_MIN_MS << shift;
+            if (backoff_ms > WIFI_RECONNECT_BACKOFF_MAX_MS)
+                backoff_ms = WIFI_RECONNECT_BACKOFF_MAX_MS;
+            ESP_LOGI(TAG_WIFI, "connect failed, reason %d, retry in %u ms", event->reason, backoff_ms);
+            sta_state = STATE_DISCONNECTED;
+            esp_timer_start_once(reconnect_timer, (uint64_t)backoff_ms * 1000);
+        }
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_BSS_RSSI_LOW) {
+        wifi_event_bss_rssi_low_t* event = (wifi_event_bss_rssi_low_t*) event_data;
+        ESP_LOGI(TAG_WIFI, "RSSI low (%d dBm)", event->rssi);
+        if (esp_wnm_is_btm_supported_connection())
+        {
+            // The AP answers with a BSS transition request that the supplicant follows by itself
+            if (esp_wnm_send_bss_transition_mgmt_query(REASON_FRAME_LOSS, NULL, 0) == 0)
+                btm_query_at = esp_timer_get_time();
+            esp_wifi_set_rssi_threshold(WIFI_ROAM_RSSI_THRESHOLD);
+        }
+        else
+        {
+            wifi_scan_config_t scan_config = {};
+            scan_config.ssid = sta_config.sta.ssid;
+            roam_scan_pending = esp_wifi_scan_start(&scan_config, false) == ESP_OK;
+        }
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
+        if (roam_scan_pending)
+        {
+            roam_scan_pending = false;
+            sta_roam_scan_done();
+        }
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG_WIFI, "got ip:" IPSTR "\n",
                  IP2STR(&event->ip_info.ip));
-        //s_retry_num = 0;
-        //xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        if (disconnected_at != 0)
+        {
+            uint32_t reconnect_ms = (esp_timer_get_time() - disconnected_at) / 1000;
+            sta_stats.last_reconnect_ms = reconnect_ms;
+            if (reconnect_ms > sta_stats.max_reconnect_ms)
+                sta_stats.max_reconnect_ms = reconnect_ms;
+            disconnected_at = 0;
+            ESP_LOGI(TAG_WIFI, "reconnected in %u ms", reconnect_ms);
+        }
+        failed_attempts = 0;
+        sta_state = STATE_CONNECTED;
+        esp_wifi_set_rssi_threshold(WIFI_ROAM_RSSI_THRESHOLD);
+        network::set_link(network::IFACE_WIFI, true);
     }
 }
 
 void wifi::wifi_init_sta(const char * ssid, const char * password)
 {
-    //s_wifi_event_group = xEventGroupCreate();
-
-    esp_netif_init();
-
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    network::init();
+    network::register_netif(network::IFACE_WIFI, esp_netif_create_default_wifi_sta());
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    // Connection parameters are managed here, not by the driver's own NVS copy
+    esp_wifi_set_storage(WIFI_STORAGE_RAM);
 
     ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler_station, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler_station, NULL));
 
-    wifi_config_t wifi_config = {
-        .sta = {
-            // .ssid = "wZ",
-            // .password = "pesicola",
-            .pmf_cfg = {
-                .capable = true,
-                .required = false
-            },
-        },
-    };
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback = &reconnect_timer_callback;
+    timer_args.name = "wifi_reconnect";
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &reconnect_timer));
+
+    // Cached AP, a channel of 0 means none
+    int32_t channel = 0;
+    size_t bssid_length = sizeof(cached_bssid);
+    if (storage::read_int32(STORAGE_NAMESPACE, STORAGE_WIFI_STA_CHANNEL, &channel) == ESP_OK &&
+        storage::read_blob(STORAGE_NAMESPACE, STORAGE_WIFI_BSSID, cached_bssid, &bssid_length) == ESP_OK &&
+        bssid_length == sizeof(cached_bssid))
+        cached_channel = channel;
 
-    strlcpy((char *)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid));
-    strlcpy((char *)wifi_config.sta.password, password, sizeof(wifi_config.sta.password));
+    memset(&sta_config, 0, sizeof(sta_config));
+    strlcpy((char *)sta_config.sta.ssid, ssid, sizeof(sta_config.sta.ssid));
+    strlcpy((char *)sta_config.sta.password, password, sizeof(sta_config.sta.password));
+    sta_config.sta.pmf_cfg.capable = true;
+    sta_config.sta.pmf_cfg.required = false;
+    sta_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    // 802.11k radio measurements and 802.11v BSS transition
+    sta_config.sta.rm_enabled = 1;
+    sta_config.sta.btm_enabled = 1;
 
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &sta_config) );
     esp_wifi_set_ps (WIFI_PS_NONE);
     ESP_ERROR_CHECK(esp_wifi_start() );
 
     ESP_LOGI(TAG_WIFI, "wifi_init_sta finished.");
+}
+
+wifi::state_t wifi::get_state()
+{
+    return sta_state;
+}
 
-    /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-     * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-    // EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-    //         WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-    //         pdFALSE,
-    //         pdFALSE,
-    //         portMAX_DELAY);
-
-    // /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-    //  * happened. */
-    // if (bits & WIFI_CONNECTED_BIT) {
-    //     ESP_LOGI(TAG, "connected to ap SSID:%s password:%s",
-    //              ssid, password);
-    // } else if (bits & WIFI_FAIL_BIT) {
-    //     ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s",
-    //              ssid, password);
-    // } else {
-    //     ESP_LOGE(TAG, "UNEXPECTED EVENT");
-    // }
-
-    //ESP_ERROR_CHECK(esp_event_handler_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler_station));
-    //ESP_ERROR_CHECK(esp_event_handler_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler_station));
-    //vEventGroupDelete(s_wifi_event_group);
+const char *wifi::state_name(state_t state)
+{
+    switch (state)
+    {
+    case STATE_CONNECTING:
+        return "connecting";
+    case STATE_CONNECTED:
+        return "connected";
+    case STATE_ROAMING:
+        return "roaming";
+    default:
+        return "disconnected";
+    }
 }
 
+void wifi::get_reconnect_stats(reconnect_stats *stats)
+{
+    *stats = sta_stats;
+}
@@ -6,13 +6,38 @@
 
 class wifi
 {
+    public:
+     // Station connectivity, as seen by the reconnection engine
+     enum state_t
+     {
+         STATE_DISCONNECTED,
+         STATE_CONNECTING,
+         STATE_CONNECTED,
+         STATE_ROAMING
+     };
+
+     struct reconnect_stats
+     {
+         uint32_t disconnections;
+         uint32_t roams;
+         uint32_t last_reconnect_ms;
+         uint32_t max_reconnect_ms;
+         uint32_t attempts;
+     };
+
     private:
      static void wifi_event_handler_softAP(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
      static void wifi_event_handler_station(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+     static void reconnect_timer_callback(void* arg);
+     static void sta_connect(bool pin_bssid = true);
+     static void sta_roam_scan_done();
 
     public:
      static void wifi_init_softap(const char * ssid, const char * password, uint8_t max_connections, uint8_t channel);
      static void wifi_init_sta(const char * ssid, const char * password);
+     static state_t get_state();
+     static const char *state_name(state_t state);
+     static void get_reconnect_stats(reconnect_stats *stats);
 };
 
-#endif
\ No newline at end of file
+#endif
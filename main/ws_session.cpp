@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <array>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "ws_session.h"
+#include "esp_log.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/base64.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+#define WS_FIN 0x80
+#define WS_MASKED 0x80
+// Server frames are never masked: 2 bytes, plus 2 or 8 of extended length
+#define WS_MAX_HEADER 10
+
+static const char *TAG = "WS SESSION";
+
+static_assert(SESSION_HEADROOM >= WS_MAX_HEADER, "Session headroom too small for a WebSocket header");
+
+// Size of the header of a server frame carrying length bytes
+static std::size_t header_size(std::size_t length)
+{
+    return length < 126 ? 2 : length <= 0xFFFF ? 4 : 10;
+}
+
+// Writes the header_size(length) bytes of a server frame header at out
+static void put_header(uint8_t *out, uint8_t opcode, std::size_t length)
+{
+    out[0] = WS_FIN | opcode;
+    if (length < 126)
+        out[1] = length;
+    else if (length <= 0xFFFF)
+    {
+        out[1] = 126;
+        out[2] = length >> 8;
+        out[3] = length;
+    }
+    else
+    {
+        out[1] = 127;
+        for (int i = 0; i < 8; i++)
+            out[2 + i] = (uint64_t)length >> (56 - 8 * i);
+    }
+}
+
+// XORs data in place with the masking key, starting at offset in the key.
+// Bytes up to the first word boundary go one by one, then whole words with
+// the key rotated to match. Returns the key offset after the last byte
+static std::size_t unmask(uint8_t *data, std::size_t length, const uint8_t key[4], std::size_t offset)
+{
+    while (length > 0 && ((uintptr_t)data & 3))
+    {
+        *data++ ^= key[offset++ & 3];
+        length--;
+    }
+    if (length >= 4)
+    {
+        uint8_t rotated[4] = {key[offset & 3], key[(offset + 1) & 3], key[(offset + 2) & 3], key[(offset + 3) & 3]};
+        uint32_t word;
+        memcpy(&word, rotated, 4);
+        uint32_t *words = (uint32_t *)data;
+        std::size_t count = length / 4;
+        for (std::size_t i = 0; i < count; i++)
+            words[i] ^= word;
+        data += count * 4;
+        length -= count * 4;
+    }
+    while (length > 0)
+    {
+        *data++ ^= key[offset++ & 3];
+        length--;
+    }
+    return offset & 3;
+}
+
+ws_session::ws_session(asio::ip::tcp::socket socket, std::function<void()> _onSocketError, std::function<void(uint8_t *, std::size_t)> _dataAvailable)
+    : tcp_session(std::move(socket), _onSocketError, _dataAvailable),
+      open_(false), request_len_(0), header_len_(0), in_payload_(false), opcode_(0), remaining_(0), mask_offset_(0), control_len_(0)
+{
+}
+
+// Header and payload as two buffers, for data without headroom
+bool ws_session::send(uint8_t *data, int length)
+{
+    // Nothing can be sent until the upgrade, drop like a missing session
+    if (!open_)
+        return false;
+    uint8_t header[WS_MAX_HEADER];
+    put_header(header, WS_OP_BINARY, length);
+    std::array<asio::const_buffer, 2> buffers = {asio::buffer(header, header_size(length)), asio::buffer(data, length)};
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    std::error_code ec;
+    asio::write(socket_, buffers, ec);
+    return !ec;
+}
+
+// The header goes in the headroom, the frame leaves in one write
+bool ws_session::send_in_place(uint8_t *data, int length)
+{
+    if (!open_)
+        return false;
+    std::size_t header = header_size(length);
+    put_header(data - header, WS_OP_BINARY, length);
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    std::error_code ec;
+    asio::write(socket_, asio::buffer(data - header, header + length), ec);
+    return !ec;
+}
+
+void ws_session::write_frame(uint8_t opcode, const uint8_t *data, std::size_t length)
+{
+    uint8_t header[WS_MAX_HEADER];
+    put_header(header, opcode, length);
+    std::array<asio::const_buffer, 2> buffers = {asio::buffer(header, header_size(length)), asio::buffer(data, length)};
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    std::error_code ec;
+    asio::write(socket_, buffers, ec);
+}
+
+void ws_session::do_read()
+{
+    auto self(shared_from_this());
+    socket_.async_read_some(asio::buffer(data_, max_length),
+                            [this, self](std::error_code ec, std::size_t length) {
+                                if (!ec)
+                                {
+                                    if (open_ ? process_frames(data_, length) : handshake(length))
+                                    {
+                                        do_read();
+                                        return;
+                                    }
+                                }
+                                else
+                                    ESP_LOGI(TAG, "Read error");
+                                OnSocketError();
+                            });
+}
+
+// Collects the upgrade request and answers it. Returns false when the
+// session must be closed
+bool ws_session::handshake(std::size_t length)
+{
+    std::size_t copy = std::min(length, sizeof(request_) - 1 - request_len_);
+    memcpy(request_ + request_len_, data_, copy);
+    request_len_ += copy;
+    request_[request_len_] = '\0';
+    char *end = strstr(request_, "\r\n\r\n");
+    if (!end)
+    {
+        if (request_len_ < sizeof(request_) - 1)
+            return true;
+        ESP_LOGI(TAG, "Handshake request too long");
+        return false;
+    }
+    end += 4;
+
+    const char *key = NULL;
+    std::size_t key_length = 0;
+    if (!strncmp(request_, "GET ", 4))
+        for (char *line = strstr(request_, "\r\n"); line && line + 2 < end; line = strstr(line + 2, "\r\n"))
+        {
+            if (strncasecmp(line + 2, "Sec-WebSocket-Key:", 18))
+                continue;
+            key = line + 2 + 18;
+            while (*key == ' ')
+                key++;
+            key_length = strcspn(key, " \r");
+            break;
+        }
+
+    std::error_code ec;
+    if (!key || key_length == 0 || key_length > 64)
+    {
+        static const char refused[] = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+        asio::write(socket_, asio::buffer(refused, sizeof(refused) - 1), ec);
+        ESP_LOGI(TAG, "Not a WebSocket upgrade");
+        return false;
+    }
+
+    char accept_source[64 + sizeof(WS_GUID)];
+    memcpy(accept_source, key, key_length);
+    memcpy(accept_source + key_length, WS_GUID, sizeof(WS_GUID) - 1);
+    unsigned char digest[20];
+    mbedtls_sha1_ret((const unsigned char *)accept_source, key_length + sizeof(WS_GUID) - 1, digest);
+    unsigned char accept[32];
+    std::size_t accept_length = 0;
+    mbedtls_base64_encode(accept, sizeof(accept), &accept_length, digest, sizeof(digest));
+
+    char response[160];
+    int n = snprintf(response, sizeof(response),
+                     "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %.*s\r\n\r\n",
+                     (int)accept_length, accept);
+    asio::write(socket_, asio::buffer(response, n), ec);
+    if (ec)
+        return false;
+    open_ = true;
+    ESP_LOGI(TAG, "Upgraded");
+
+    // A client may not wait for the response before its first frame
+    std::size_t rest = request_ + request_len_ - end;
+    return rest == 0 || process_frames((uint8_t *)end, rest);
+}
+
+// Parses frames out of a read, payloads are unmasked where they lie.
+// Returns false when the session must be closed
+bool ws_session::process_frames(uint8_t *data, std::size_t length)
+{
+    while (length > 0)
+    {
+        if (!in_payload_)
+        {
+            header_[header_len_++] = *data++;
+            length--;
+            if (header_len_ < 2)
+                continue;
+            uint8_t size = header_[1] & 0x7F;
+            std::size_t needed = 2 + (size == 126 ? 2 : size == 127 ? 8 : 0) + 4;
+            if (header_len_ < needed)
+                continue;
+
+            // Client frames are always masked (RFC 6455 5.1)
+            if (!(header_[1] & WS_MASKED))
+            {
+                ESP_LOGI(TAG, "Unmasked client frame");
+                return false;
+            }
+            opcode_ = header_[0] & 0x0F;
+            remaining_ = size;
+            if (size == 126)
+                remaining_ = (header_[2] << 8) | header_[3];
+            else if (size == 127)
+            {
+                remaining_ = 0;
+                for (int i = 0; i < 8; i++)
+                    remaining_ = (remaining_ << 8) | header_[2 + i];
+            }
+            memcpy(mask_, header_ + needed - 4, 4);
+            mask_offset_ = 0;
+            header_len_ = 0;
+            control_len_ = 0;
+            if (opcode_ & 0x08)
+            {
+                if (!(header_[0] & WS_FIN) || remaining_ > WS_CONTROL_MAX)
+                {
+                    ESP_LOGI(TAG, "Bad control frame");
+                    return false;
+                }
+            }
+            else if (opcode_ != WS_OP_CONTINUATION && opcode_ != WS_OP_TEXT && opcode_ != WS_OP_BINARY)
+            {
+                ESP_LOGI(TAG, "Unknown opcode %d", opcode_);
+                return false;
+            }
+            in_payload_ = true;
+            if (remaining_ == 0 && !end_frame())
+                return false;
+            continue;
+        }
+
+        std::size_t n = std::min((uint64_t)length, remaining_);
+        mask_offset_ = unmask(data, n, mask_, mask_offset_);
+        if (opcode_ & 0x08)
+        {
+            memcpy(control_ + control_len_, data, n);
+            control_len_ += n;
+        }
+        else
+            DataAvailable(data, n);
+        data += n;
+        length -= n;
+        remaining_ -= n;
+        if (remaining_ == 0 && !end_frame())
+            return false;
+    }
+    return true;
+}
+
+// Acts on a complete control frame. Returns false after a close
+bool ws_session::end_frame()
+{
+    in_payload_ = false;
+    switch (opcode_)
+    {
+    case WS_OP_PING:
+        write_frame(WS_OP_PONG, control_, control_len_);
+        break;
+    case WS_OP_CLOSE:
+        // Echo the status code, the client then closes the connection
+        write_frame(WS_OP_CLOSE, control_, std::min(control_len_, (std::size_t)2));
+        ESP_LOGI(TAG, "Closed by client");
+        return false;
+    default:
+        break;
+    }
+    return true;
+}
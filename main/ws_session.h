@@ -0,0 +1,56 @@
+#ifndef _WS_SESSION_H_
+#define _WS_SESSION_H_
+
+#include <atomic>
+#include <mutex>
+#include "tcp_session.h"
+
+// Longest handshake request accepted, browsers send well under this
+#define WS_REQUEST_MAX 1024
+// Control frame payloads are at most 125 bytes (RFC 6455 5.5)
+#define WS_CONTROL_MAX 125
+
+// WebSocket server session layered over tcp_session, so a browser reaches a
+// port without a proxy. Serial data goes out as unmasked binary frames; data
+// frames from the client, binary or text, are unmasked in place in the read
+// buffer and handed to the port as they arrive, fragments included. Pings
+// are answered and a close frame ends the session.
+class ws_session : public tcp_session
+{
+public:
+  ws_session(asio::ip::tcp::socket socket, std::function<void()> _onSocketError, std::function<void(uint8_t *, std::size_t)> _dataAvailable);
+
+  bool send(uint8_t* data, int length) override;
+  bool send_in_place(uint8_t* data, int length) override;
+  bool ready() override { return open_; }
+
+protected:
+  void do_read() override;
+
+private:
+  bool handshake(std::size_t length);
+  bool process_frames(uint8_t *data, std::size_t length);
+  bool end_frame();
+  void write_frame(uint8_t opcode, const uint8_t *data, std::size_t length);
+
+  // Writes come from the UART or egress task and from the event loop (pongs)
+  std::mutex write_mutex_;
+  // Set once the upgrade response is sent, the session is not ready before
+  std::atomic<bool> open_;
+
+  char request_[WS_REQUEST_MAX];
+  std::size_t request_len_;
+
+  // Frame being received, its header may straddle reads
+  uint8_t header_[14];
+  std::size_t header_len_;
+  bool in_payload_;
+  uint8_t opcode_;
+  uint64_t remaining_;
+  uint8_t mask_[4];
+  std::size_t mask_offset_;
+  uint8_t control_[WS_CONTROL_MAX];
+  std::size_t control_len_;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Lock time and accuracy test of the Ser2IP32 automatic baud rate mode.
+
+A USB serial adapter is wired to the RX pin of a port configured with
+uart_config <n> 1 <any> --autobaud=1. For every rate the adapter sends a
+text pattern until it comes out intact on the port's TCP socket, which
+requires the device to have found the exact rate. The time this takes is
+the lock time:
+
+    ser2ip32_autobaud.py /dev/ttyUSB0 192.168.4.1 2221 --rates 9600 57600 115200 921600
+
+Between rates the script sends garbage at the new rate, to cause the
+framing error burst that starts detection again. Needs pyserial.
+"""
+
+import argparse
+import socket
+import time
+
+import serial
+
+PATTERN = b"The quick brown fox jumps over the lazy dog 0123456789\r\n"
+
+
+def lock(adapter, sock, timeout):
+    sock.settimeout(0.05)
+    received = b""
+    start = time.monotonic()
+    while time.monotonic() - start < timeout:
+        adapter.write(PATTERN)
+        adapter.flush()
+        try:
+            while True:
+                chunk = sock.recv(4096)
+                if not chunk:
+                    raise OSError("port closed")
+                received += chunk
+        except socket.timeout:
+            pass
+        if PATTERN in received:
+            return time.monotonic() - start
+        received = received[-len(PATTERN):]
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("serial")
+    parser.add_argument("host")
+    parser.add_argument("port", type=int)
+    parser.add_argument("--rates", type=int, nargs="+", default=[9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600])
+    parser.add_argument("--rounds", type=int, default=3, help="locks per rate")
+    parser.add_argument("--timeout", type=float, default=10)
+    args = parser.parse_args()
+
+    sock = socket.create_connection((args.host, args.port))
+    adapter = serial.Serial(args.serial, args.rates[0])
+    failures = 0
+    for rate in args.rates:
+        times = []
+        for _ in range(args.rounds):
+            adapter.baudrate = rate
+            # Alternating bits and 0xFF bytes decode as framing errors at any other rate
+            adapter.write(b"\x55\xff\x00" * 200)
+            adapter.flush()
+            elapsed = lock(adapter, sock, args.timeout)
+            if elapsed is None:
+                failures += 1
+            else:
+                times.append(elapsed * 1000)
+        if times:
+            print("%8d baud  locked %d/%d  min %6.0f  avg %6.0f  max %6.0f ms" % (
+                rate, len(times), args.rounds, min(times), sum(times) / len(times), max(times)))
+        else:
+            print("%8d baud  never locked" % rate)
+    adapter.close()
+    sock.close()
+    raise SystemExit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,318 @@
+#!/usr/bin/env python3
+"""Client of the Ser2IP32 control plane (CONFIG_SER2IP32_CONTROL_PORT).
+
+Reads and writes the settings of one device or pushes a configuration to many:
+
+    ser2ip32_ctl.py 192.168.4.1 list
+    ser2ip32_ctl.py 192.168.4.1 get UART_BAUDS_1 WIFI_SSID
+    ser2ip32_ctl.py 192.168.4.1 set UART_BAUDS_1=9600 UART_PARITY_1=2 WIFI_SSID=plant
+    ser2ip32_ctl.py 192.168.4.1 set UART_RS485_2=     (empty: back to the default)
+    ser2ip32_ctl.py 192.168.4.1 stats
+    ser2ip32_ctl.py 192.168.4.1 restart
+    ser2ip32_ctl.py 192.168.4.1 ota build/Ser2IP32.bin --probe 2220
+    ser2ip32_ctl.py units.txt push site.json --restart
+
+push takes a file with one host per line instead of a host, and a JSON
+object of setting names to values: integers, strings, a "aa:bb:cc:dd:ee:ff"
+string for WIFI_BSSID, or null for the default. Each device gets the whole
+object as one SET, applied entirely or not at all.
+
+ota uploads a firmware image and restarts the device into it. With --probe,
+a looped back serial port (TX wired to RX) is pinged during the upload and
+round trip percentiles are printed for before and during the update.
+
+The Client class can be imported by other tools.
+"""
+
+import argparse
+import concurrent.futures
+import json
+import socket
+import struct
+import sys
+import threading
+import time
+
+VERSION = 1
+HEADER = struct.Struct(">BBH")
+
+OP_HELLO = 0x01
+OP_AUTH = 0x02
+OP_GET = 0x10
+OP_SET = 0x11
+OP_LIST = 0x12
+OP_STATS = 0x20
+OP_RESTART = 0x30
+OP_OTA_BEGIN = 0x40
+OP_OTA_DATA = 0x41
+OP_OTA_END = 0x42
+
+TYPE_UNSET = 0
+TYPE_INT32 = 1
+TYPE_STRING = 2
+TYPE_BLOB = 3
+TYPE_U64 = 4
+
+FLAG_RESTART = 0x01
+
+STATUS = ["ok", "bad request", "unknown key", "bad type", "out of range", "storage error",
+          "authentication required", "write only", "update failed", "updates disabled"]
+
+STRING_KEYS = {"WIFI_SSID", "WIFI_PASSWD", "UART_FILTER_0", "UART_FILTER_1", "UART_FILTER_2"}
+BLOB_KEYS = {"WIFI_BSSID"}
+
+
+class ControlError(Exception):
+    def __init__(self, status, entry=None):
+        self.status = status
+        self.entry = entry
+        name = STATUS[status] if status < len(STATUS) else "status %d" % status
+        super().__init__(name if entry is None else "%s (entry %d)" % (name, entry))
+
+
+def encode_entry(name, value):
+    """Entry of a SET, the type is taken from the key name and the value."""
+    raw_name = name.encode()
+    if value is None:
+        kind, raw = TYPE_UNSET, b""
+    elif name in BLOB_KEYS:
+        kind = TYPE_BLOB
+        raw = value if isinstance(value, bytes) else bytes(int(x, 16) for x in value.split(":"))
+    elif name in STRING_KEYS:
+        kind, raw = TYPE_STRING, str(value).encode()
+    else:
+        kind, raw = TYPE_INT32, struct.pack(">i", int(value))
+    return struct.pack(">B", len(raw_name)) + raw_name + struct.pack(">BH", kind, len(raw)) + raw
+
+
+def decode_entries(payload):
+    entries = []
+    offset = 0
+    while offset < len(payload):
+        name_length = payload[offset]
+        name = payload[offset + 1:offset + 1 + name_length].decode()
+        offset += 1 + name_length
+        kind, length = struct.unpack_from(">BH", payload, offset)
+        offset += 3
+        raw = payload[offset:offset + length]
+        offset += length
+        if kind == TYPE_INT32:
+            value = struct.unpack(">i", raw)[0]
+        elif kind == TYPE_U64:
+            value = struct.unpack(">Q", raw)[0]
+        elif kind == TYPE_STRING:
+            value = raw.decode(errors="replace")
+        elif kind == TYPE_BLOB:
+            value = ":".join("%02x" % b for b in raw)
+        else:
+            value = None
+        entries.append((name, value))
+    return entries
+
+
+class Client:
+    def __init__(self, host, port, token=None, timeout=10):
+        self.sock = socket.create_connection((host, port), timeout=timeout)
+        self.next_id = 0
+        op, _, payload = self._read()
+        if op != OP_HELLO or payload[0] != VERSION:
+            raise ControlError(1)
+        self.auth_required = bool(payload[1])
+        self.ports = [i for i in range(8) if payload[2] & (1 << i)]
+        if self.auth_required:
+            self._request(OP_AUTH, (token or "").encode())
+
+    def close(self):
+        self.sock.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def _recv(self, size):
+        data = b""
+        while len(data) < size:
+            chunk = self.sock.recv(size - len(data))
+            if not chunk:
+                raise ConnectionError("connection closed")
+            data += chunk
+        return data
+
+    def _read(self):
+        op, request_id, length = HEADER.unpack(self._recv(HEADER.size))
+        return op, request_id, self._recv(length)
+
+    def _request(self, op, payload=b""):
+        request_id = self.next_id
+        self.next_id = (self.next_id + 1) & 0xFF
+        self.sock.sendall(HEADER.pack(op, request_id, len(payload)) + payload)
+        reply_op, reply_id, reply = self._read()
+        if reply_op != op or reply_id != request_id:
+            raise ConnectionError("out of sequence response")
+        if reply[0] != 0:
+            raise ControlError(reply[0], reply[1] if op == OP_SET and len(reply) > 1 else None)
+        return reply[1:]
+
+    def get(self, *names):
+        payload = b"".join(struct.pack(">B", len(n)) + n.encode() for n in names)
+        return dict(decode_entries(self._request(OP_GET, payload)))
+
+    def set(self, values):
+        """Writes all values or none. True if some only apply after a restart."""
+        payload = b"".join(encode_entry(name, value) for name, value in values.items())
+        reply = self._request(OP_SET, payload)
+        return bool(reply[1] & FLAG_RESTART)
+
+    def list(self):
+        return dict(decode_entries(self._request(OP_LIST)))
+
+    def stats(self):
+        return dict(decode_entries(self._request(OP_STATS)))
+
+    def restart(self):
+        self._request(OP_RESTART)
+
+    def ota(self, image, chunk=2048, progress=None):
+        """Writes image to the inactive slot, it boots after restart()."""
+        self._request(OP_OTA_BEGIN, struct.pack(">I", len(image)))
+        for offset in range(0, len(image), chunk):
+            self._request(OP_OTA_DATA, image[offset:offset + chunk])
+            if progress:
+                progress(offset + len(image[offset:offset + chunk]), len(image))
+        self._request(OP_OTA_END)
+
+
+class Probe:
+    """Round trips of small blocks on a looped back serial port."""
+
+    def __init__(self, host, port):
+        self.sock = socket.create_connection((host, port), timeout=2)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.samples = []
+        self.lost = 0
+        self.running = True
+        self.thread = threading.Thread(target=self.run, daemon=True)
+        self.thread.start()
+
+    def run(self):
+        block = b"ser2ip32 probe!\n"
+        while self.running:
+            start = time.monotonic()
+            self.sock.sendall(block)
+            received = b""
+            try:
+                while len(received) < len(block):
+                    received += self.sock.recv(len(block) - len(received))
+                self.samples.append((time.monotonic() - start) * 1000)
+            except socket.timeout:
+                self.lost += 1
+            time.sleep(0.02)
+
+    def take(self):
+        samples, self.samples = self.samples, []
+        lost, self.lost = self.lost, 0
+        return samples, lost
+
+    def stop(self):
+        self.running = False
+        self.thread.join()
+        self.sock.close()
+
+
+def report(label, samples, lost):
+    if not samples:
+        print("%-7s no round trip, %d lost" % (label, lost))
+        return
+    ordered = sorted(samples)
+    at = lambda p: ordered[min(len(ordered) - 1, int(len(ordered) * p / 100))]
+    print("%-7s %5d round trips, p50 %.1f ms, p99 %.1f ms, max %.1f ms, %d lost" %
+          (label, len(ordered), at(50), at(99), ordered[-1], lost))
+
+
+def parse_assignments(items):
+    values = {}
+    for item in items:
+        name, _, value = item.partition("=")
+        values[name] = value if value != "" else None
+    return values
+
+
+def push(host, args, values):
+    try:
+        with Client(host, args.port, args.token) as client:
+            restart = client.set(values)
+            if restart and args.restart:
+                client.restart()
+            return host, "ok" + (", restarted" if restart and args.restart else ", restart needed" if restart else "")
+    except (OSError, ControlError) as e:
+        return host, "failed: %s" % e
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host", help="device address, for push a file of addresses")
+    parser.add_argument("command", choices=["get", "set", "list", "stats", "restart", "push", "ota"])
+    parser.add_argument("args", nargs="*")
+    parser.add_argument("--port", type=int, default=2240)
+    parser.add_argument("--token")
+    parser.add_argument("--restart", action="store_true", help="push: restart devices that need it")
+    parser.add_argument("--jobs", type=int, default=32)
+    parser.add_argument("--probe", type=int, help="ota: TCP port of a looped back UART to measure latency on")
+    parser.add_argument("--baseline", type=float, default=10, help="ota: seconds of probing before the upload")
+    args = parser.parse_args()
+
+    if args.command == "push":
+        if len(args.args) != 1:
+            parser.error("push takes a JSON file")
+        with open(args.args[0]) as f:
+            values = json.load(f)
+        with open(args.host) as f:
+            hosts = [line.strip() for line in f if line.strip() and not line.startswith("#")]
+        failed = 0
+        with concurrent.futures.ThreadPoolExecutor(args.jobs) as pool:
+            for host, result in pool.map(lambda h: push(h, args, values), hosts):
+                print("%-20s %s" % (host, result))
+                failed += not result.startswith("ok")
+        return 1 if failed else 0
+
+    with Client(args.host, args.port, args.token) as client:
+        if args.command == "get":
+            for name, value in client.get(*args.args).items():
+                print("%s=%s" % (name, "" if value is None else value))
+        elif args.command == "list":
+            for name, value in sorted(client.list().items()):
+                print("%s=%s" % (name, value))
+        elif args.command == "stats":
+            for name, value in client.stats().items():
+                print("%-28s %d" % (name, value))
+        elif args.command == "set":
+            if client.set(parse_assignments(args.args)):
+                print("stored, some values apply after a restart")
+            else:
+                print("applied")
+        elif args.command == "restart":
+            client.restart()
+        elif args.command == "ota":
+            if len(args.args) != 1:
+                parser.error("ota takes an image file")
+            with open(args.args[0], "rb") as f:
+                image = f.read()
+            probe = Probe(args.host, args.probe) if args.probe else None
+            if probe:
+                time.sleep(args.baseline)
+                report("before", *probe.take())
+            start = time.monotonic()
+            client.ota(image, progress=lambda done, total: print("\r%d/%d" % (done, total), end="", flush=True))
+            elapsed = time.monotonic() - start
+            print("\r%d bytes in %.1f s, %.1f KB/s" % (len(image), elapsed, len(image) / 1024 / elapsed))
+            if probe:
+                report("during", *probe.take())
+                probe.stop()
+            client.restart()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
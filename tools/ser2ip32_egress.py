@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Control port latency under load, for the Ser2IP32 egress scheduler.
+
+Every UART used must echo: TX wired to RX, or a device echoing the line. The
+control port gets small probes and each round trip is timed, first alone and
+then while the load ports are kept saturated from the host:
+
+    ser2ip32_egress.py 192.168.4.1 --control 2220 --load 2221 2222 --seconds 20
+
+Run it with CONFIG_SER2IP32_EGRESS disabled, then enabled with the control
+port given a higher priority (uart_config 0 ... --priority=1) and, if needed,
+rate caps on the load ports, and compare the percentiles.
+"""
+
+import argparse
+import os
+import socket
+import threading
+import time
+
+
+def percentile(values, p):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p / 100))]
+
+
+class Load:
+    """Writes to a port as fast as it takes data and counts what comes back."""
+
+    def __init__(self, host, port, size):
+        self.sock = socket.create_connection((host, port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.block = os.urandom(size)
+        self.received = 0
+        self.running = True
+        self.threads = [threading.Thread(target=self.write, daemon=True), threading.Thread(target=self.read, daemon=True)]
+        for thread in self.threads:
+            thread.start()
+
+    def write(self):
+        try:
+            while self.running:
+                self.sock.sendall(self.block)
+        except OSError:
+            pass
+
+    def read(self):
+        try:
+            while self.running:
+                chunk = self.sock.recv(65536)
+                if not chunk:
+                    break
+                self.received += len(chunk)
+        except OSError:
+            pass
+
+    def stop(self):
+        self.running = False
+        self.sock.close()
+
+
+def probe(host, port, seconds, size, interval, timeout):
+    sock = socket.create_connection((host, port))
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    sock.settimeout(timeout)
+    rtts = []
+    lost = 0
+    end = time.monotonic() + seconds
+    sequence = 0
+    while time.monotonic() < end:
+        payload = (b"%08d" % sequence).ljust(size, b".")
+        sequence += 1
+        start = time.monotonic()
+        sock.sendall(payload)
+        got = b""
+        try:
+            while len(got) < len(payload):
+                chunk = sock.recv(len(payload) - len(got))
+                if not chunk:
+                    raise OSError("control port closed")
+                got += chunk
+            rtts.append((time.monotonic() - start) * 1000)
+        except socket.timeout:
+            lost += 1
+            # Drain late echoes so the next probe starts clean
+            sock.settimeout(0.5)
+            try:
+                while sock.recv(4096):
+                    pass
+            except socket.timeout:
+                pass
+            sock.settimeout(timeout)
+        time.sleep(interval / 1000)
+    sock.close()
+    return rtts, lost
+
+
+def report(label, rtts, lost):
+    if not rtts:
+        print("%-10s no round trip completed, %d lost" % (label, lost))
+        return
+    print("%-10s %5d probes  p50 %7.2f  p95 %7.2f  p99 %7.2f  max %7.2f ms  lost %d" % (
+        label, len(rtts), percentile(rtts, 50), percentile(rtts, 95), percentile(rtts, 99), max(rtts), lost))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("--control", type=int, required=True, help="latency critical port")
+    parser.add_argument("--load", type=int, nargs="+", required=True, help="ports kept saturated")
+    parser.add_argument("--seconds", type=float, default=10)
+    parser.add_argument("--size", type=int, default=16, help="probe bytes")
+    parser.add_argument("--interval", type=float, default=20, help="ms between probes")
+    parser.add_argument("--load-size", type=int, default=4096, help="bytes per load write")
+    parser.add_argument("--timeout", type=float, default=2, help="seconds before a probe counts as lost")
+    args = parser.parse_args()
+
+    rtts, lost = probe(args.host, args.control, args.seconds, args.size, args.interval, args.timeout)
+    report("idle", rtts, lost)
+
+    loads = [Load(args.host, port, args.load_size) for port in args.load]
+    time.sleep(1)
+    start = time.monotonic()
+    rtts, lost = probe(args.host, args.control, args.seconds, args.size, args.interval, args.timeout)
+    elapsed = time.monotonic() - start
+    report("loaded", rtts, lost)
+    for port, load in zip(args.load, loads):
+        print("load %-5d %.0f B/s echoed" % (port, load.received / (elapsed + 1)))
+        load.stop()
+
+
+if __name__ == "__main__":
+    main()
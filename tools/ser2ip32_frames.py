@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+"""Decoder for the Ser2IP32 timestamped framing mode (uart_config --framing=1).
+
+The device sends batches of serial frames, one header per batch (see
+main/framing.h). This prints one line per frame with its timestamp, sequence
+number, flags and data, and reports sequence gaps:
+
+    ser2ip32_frames.py 192.168.4.1 2221
+    ser2ip32_frames.py --file capture.bin --csv
+
+With --framing=2 (integrity mode) every batch carries a CRC32 and the device
+reports what it lost in gap entries. --verify checks the CRCs, resynchronizes
+after a corrupted or partial batch, and reports the losses by location:
+
+    ser2ip32_frames.py 192.168.4.1 2221 --verify --seconds 60
+    ser2ip32_frames.py --bench-crc
+
+Decoder can also be used as a library: iterate decode(stream) to get Frame
+tuples, and Gap and Skip tuples in integrity mode.
+"""
+
+import argparse
+import collections
+import socket
+import struct
+import sys
+import time
+import zlib
+
+BATCH = struct.Struct(">2sBBIQ")
+CRC = struct.Struct(">I")
+FRAME = struct.Struct(">IHBB")
+GAP = struct.Struct(">II")
+MAGIC = b"ST"
+VERSION = 1
+VERSION_INTEGRITY = 2
+# Largest batch the device sends, headers included
+BATCH_MAX = 1024
+
+FLAGS = [
+    (0x01, "end"),
+    (0x02, "overflow"),
+    (0x04, "buffer_full"),
+    (0x08, "break"),
+    (0x10, "error"),
+    (0x20, "delayed"),
+    (0x40, "gap"),
+]
+FLAG_GAP = 0x40
+
+# Gap locations, FRAMING_GAP_* in main/framing.h
+LOCATIONS = ["fifo", "ring", "no_client", "egress"]
+
+Frame = collections.namedtuple("Frame", "seq timestamp_us flags data")
+# count and bytes as documented per location in main/framing.h
+Gap = collections.namedtuple("Gap", "location timestamp_us count bytes")
+# Bytes skipped to find the next valid batch
+Skip = collections.namedtuple("Skip", "bytes reason")
+
+
+def flag_names(flags):
+    return "|".join(name for bit, name in FLAGS if flags & bit)
+
+
+def location_name(location):
+    return LOCATIONS[location] if location < len(LOCATIONS) else "location %d" % location
+
+
+def batch_crc(batch):
+    """CRC32 of a version 2 batch: header bytes 0-15, then what follows the CRC field."""
+    return zlib.crc32(batch[BATCH.size + CRC.size:], zlib.crc32(batch[:BATCH.size]))
+
+
+def decode(read, resync=False):
+    """Yields Frame, Gap and Skip tuples. read(n) returns up to n bytes, b"" at the end.
+
+    Without resync a bad header or CRC raises ValueError. With it, the
+    decoder skips to the next batch that checks out and yields a Skip."""
+    buf = bytearray()
+
+    def fill(n):
+        while len(buf) < n:
+            chunk = read(65536)
+            if not chunk:
+                return False
+            buf.extend(chunk)
+        return True
+
+    skipped = 0
+    reason = None
+    while True:
+        if not fill(BATCH.size):
+            if skipped or buf:
+                yield Skip(skipped + len(buf), reason or "truncated")
+            return
+        magic, version, count, seq, base = BATCH.unpack_from(buf)
+        header = BATCH.size + (CRC.size if version == VERSION_INTEGRITY else 0) + count * FRAME.size
+        bad = None
+        if magic != MAGIC or version not in (VERSION, VERSION_INTEGRITY):
+            bad = "bad header"
+        elif header > BATCH_MAX:
+            bad = "bad count"
+        elif not fill(header):
+            yield Skip(skipped + len(buf), "truncated")
+            return
+        else:
+            first_entry = header - count * FRAME.size
+            entries = [FRAME.unpack_from(buf, first_entry + i * FRAME.size) for i in range(count)]
+            total = header + sum(length for _, length, _, _ in entries)
+            if total > BATCH_MAX:
+                bad = "bad length"
+            elif not fill(total):
+                yield Skip(skipped + len(buf), "truncated")
+                return
+            elif version == VERSION_INTEGRITY and CRC.unpack_from(buf, BATCH.size)[0] != batch_crc(bytes(buf[:total])):
+                bad = "bad crc"
+
+        if bad:
+            if not resync:
+                raise ValueError("%s %r, stream out of sync" % (bad, bytes(buf[:BATCH.size])))
+            # Next candidate header, past this one's magic
+            next_magic = buf.find(MAGIC, 1)
+            n = next_magic if next_magic > 0 else max(len(buf) - 1, 1)
+            del buf[:n]
+            skipped += n
+            reason = reason or bad
+            continue
+
+        if skipped:
+            yield Skip(skipped, reason)
+            skipped = 0
+            reason = None
+        offset = header
+        for delta, length, flags, location in entries:
+            data = bytes(buf[offset:offset + length])
+            offset += length
+            if flags & FLAG_GAP and version == VERSION_INTEGRITY:
+                gap_count, gap_bytes = GAP.unpack(data)
+                yield Gap(location, base + delta, gap_count, gap_bytes)
+                continue
+            # Gap entries take no sequence number
+            yield Frame(seq, base + delta, flags, data)
+            seq = (seq + 1) & 0xFFFFFFFF
+        del buf[:total]
+
+
+def verify(items, deadline=None):
+    """Counts frames, sequence gaps and gap entries, returns the report lines."""
+    frames = 0
+    serial_bytes = 0
+    expected = None
+    unexplained = 0
+    gaps = collections.Counter()
+    gap_bytes = collections.Counter()
+    skips = collections.Counter()
+    skipped_bytes = 0
+    first_ts = last_ts = None
+    for item in items:
+        if isinstance(item, Skip):
+            skips[item.reason] += 1
+            skipped_bytes += item.bytes
+            continue
+        if isinstance(item, Gap):
+            gaps[item.location] += item.count
+            gap_bytes[item.location] += item.bytes
+            continue
+        if expected is not None and item.seq != expected:
+            unexplained += (item.seq - expected) & 0xFFFFFFFF
+        expected = (item.seq + 1) & 0xFFFFFFFF
+        frames += 1
+        serial_bytes += len(item.data)
+        first_ts = item.timestamp_us if first_ts is None else first_ts
+        last_ts = item.timestamp_us
+        if deadline and time.monotonic() > deadline:
+            break
+
+    # Frames the device dropped took their sequence numbers, the rest of the
+    # sequence gaps happened after the device
+    device_frames = gaps[LOCATIONS.index("no_client")]
+    transport_frames = max(unexplained - device_frames, 0)
+    lost = device_frames + transport_frames
+    seconds = (last_ts - first_ts) / 1e6 if frames > 1 else 0
+    lines = ["frames %d, serial bytes %d, over %.1f s of device time" % (frames, serial_bytes, seconds)]
+    for location in range(len(LOCATIONS)):
+        if gaps[location] or gap_bytes[location]:
+            lines.append("device %-9s  count %-8d  bytes %d" % (location_name(location), gaps[location], gap_bytes[location]))
+    lines.append("sequence gaps  %d frames, %d reported by the device (no_client), %d lost after it"
+                 % (unexplained, min(unexplained, device_frames), transport_frames))
+    for reason, n in sorted(skips.items()):
+        lines.append("resync %-10s  %d times" % (reason, n))
+    if skipped_bytes:
+        lines.append("skipped bytes  %d" % skipped_bytes)
+    if frames + lost:
+        rate = " (%.2f frames/s)" % (lost / seconds) if seconds else ""
+        lines.append("frame loss     %.4f%%%s" % (100.0 * lost / (frames + lost), rate))
+    return lines
+
+
+def bench_crc(megabytes):
+    """zlib.crc32 cost per MB, over device sized batches."""
+    batch = bytes(range(256)) * (BATCH_MAX // 256)
+    count = megabytes * 1024 * 1024 // len(batch)
+    start = time.perf_counter()
+    crc = 0
+    for _ in range(count):
+        crc = zlib.crc32(batch, crc)
+    elapsed = time.perf_counter() - start
+    return elapsed * 1e6 / (count * len(batch) / 1e6)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host", nargs="?")
+    parser.add_argument("port", nargs="?", type=int)
+    parser.add_argument("--file", help="decode a capture instead of connecting")
+    parser.add_argument("--csv", action="store_true", help="seq,timestamp_us,flags,hex data")
+    parser.add_argument("--verify", action="store_true", help="integrity report instead of the frames")
+    parser.add_argument("--seconds", type=float, help="stop verifying after this long")
+    parser.add_argument("--bench-crc", action="store_true", help="host CRC32 cost per MB")
+    args = parser.parse_args()
+
+    if args.bench_crc:
+        print("host crc32  %.0f us/MB" % bench_crc(64))
+        return
+
+    if args.file:
+        stream = open(args.file, "rb")
+        read = stream.read
+    elif args.host and args.port:
+        sock = socket.create_connection((args.host, args.port))
+        read = sock.recv
+    else:
+        parser.error("host and port, or --file, are required")
+
+    if args.verify:
+        deadline = time.monotonic() + args.seconds if args.seconds else None
+        try:
+            report = verify(decode(read, resync=True), deadline)
+        except KeyboardInterrupt:
+            return
+        print("\n".join(report))
+        return
+
+    if args.csv:
+        print("seq,timestamp_us,flags,data")
+    expected = None
+    previous = None
+    for item in decode(read, resync=True):
+        if isinstance(item, Skip):
+            print("# skipped %d bytes: %s" % (item.bytes, item.reason), file=sys.stderr)
+            continue
+        if isinstance(item, Gap):
+            print("# device gap at %d us: %s count %d bytes %d"
+                  % (item.timestamp_us, location_name(item.location), item.count, item.bytes), file=sys.stderr)
+            continue
+        frame = item
+        if expected is not None and frame.seq != expected:
+            print("# sequence gap: expected %d, got %d" % (expected, frame.seq), file=sys.stderr)
+        expected = (frame.seq + 1) & 0xFFFFFFFF
+        if args.csv:
+            print("%d,%d,%s,%s" % (frame.seq, frame.timestamp_us, flag_names(frame.flags), frame.data.hex()))
+        else:
+            gap = "" if previous is None else "+%d us" % (frame.timestamp_us - previous)
+            print("%10d  %14d  %-10s  %-20s  %r" % (frame.seq, frame.timestamp_us, gap, flag_names(frame.flags), frame.data))
+        previous = frame.timestamp_us
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""IPv4 / IPv6 parity check for a Ser2IP32 port configured with --ipv6=1.
+
+A dual-stack port accepts IPv4 clients and IPv6 clients on the same
+listener. This connects to it once over each address family and compares
+round trip latency (small writes echoed one at a time) and throughput.
+Loop TX to RX on the UART so the device echoes the data:
+
+    ser2ip32_ipv6.py 192.168.1.40 2001:db8::40 --port 2221
+
+A link-local IPv6 address needs its scope, e.g. fe80::1234%eth0.
+"""
+
+import argparse
+import os
+import socket
+import statistics
+import threading
+import time
+
+
+def connect(host, port):
+    family = socket.AF_INET6 if ":" in host else socket.AF_INET
+    address = socket.getaddrinfo(host, port, family, socket.SOCK_STREAM)[0][4]
+    sock = socket.socket(family, socket.SOCK_STREAM)
+    sock.settimeout(10)
+    sock.connect(address)
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    return sock
+
+
+def recv_exactly(sock, length):
+    data = b""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if not chunk:
+            raise ConnectionError("port closed the connection")
+        data += chunk
+    return data
+
+
+def latency(sock, count, size):
+    samples = []
+    for _ in range(count):
+        payload = os.urandom(size)
+        start = time.perf_counter()
+        sock.sendall(payload)
+        if recv_exactly(sock, size) != payload:
+            raise ValueError("echo does not match, is TX looped to RX?")
+        samples.append((time.perf_counter() - start) * 1000)
+    return samples
+
+
+def throughput(sock, seconds, size):
+    payload = os.urandom(size)
+    stop = time.monotonic() + seconds
+
+    def writer():
+        while time.monotonic() < stop:
+            sock.sendall(payload)
+
+    threading.Thread(target=writer, daemon=True).start()
+    sock.settimeout(0.5)
+    received = 0
+    start = time.monotonic()
+    while time.monotonic() < stop:
+        try:
+            data = sock.recv(65536)
+        except socket.timeout:
+            continue
+        if not data:
+            break
+        received += len(data)
+    return received / (time.monotonic() - start)
+
+
+def run(host, args):
+    # One client per port: each family gets the port to itself
+    sock = connect(host, args.port)
+    samples = latency(sock, args.count, args.size)
+    sock.close()
+    time.sleep(0.5)
+    sock = connect(host, args.port)
+    rate = throughput(sock, args.seconds, args.write)
+    sock.close()
+    time.sleep(0.5)
+    return samples, rate
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("ipv4")
+    parser.add_argument("ipv6")
+    parser.add_argument("--port", type=int, default=2221)
+    parser.add_argument("--count", type=int, default=200, help="round trips")
+    parser.add_argument("--size", type=int, default=16, help="bytes per round trip")
+    parser.add_argument("--seconds", type=float, default=10, help="throughput run length")
+    parser.add_argument("--write", type=int, default=1024, help="bytes per throughput write")
+    args = parser.parse_args()
+
+    results = {}
+    for name, host in (("ipv4", args.ipv4), ("ipv6", args.ipv6)):
+        samples, rate = run(host, args)
+        results[name] = (statistics.median(samples), max(samples), rate)
+        print("%s  rtt median %.2f ms  max %.2f ms  %.1f KB/s" % (name, results[name][0], results[name][1], rate / 1024))
+
+    v4, v6 = results["ipv4"], results["ipv6"]
+    if v4[0] and v4[2]:
+        print("ipv6/ipv4  rtt %.2f  throughput %.2f" % (v6[0] / v4[0], v6[2] / v4[2]))
+
+
+if __name__ == "__main__":
+    main()
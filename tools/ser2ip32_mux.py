@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+"""Host side of the Ser2IP32 multiplexed channel.
+
+All UARTs of a device are carried over one TCP connection (see
+main/mux_server.h for the frame format). MuxClient demultiplexes them and
+handles the per port credit flow control:
+
+    client = MuxClient("192.168.4.1", 2230)
+    client.send(1, b"hello")
+    port, data = client.recv()
+
+Run as a script it compares the throughput of the mux listener against one
+socket per port. Loop TX to RX on every UART so the device echoes the data:
+
+    ser2ip32_mux.py bench 192.168.4.1 --mux-port 2230 --ports 2220 2221 2222
+"""
+
+import argparse
+import os
+import queue
+import socket
+import struct
+import threading
+import time
+
+HEADER = struct.Struct(">BBH")
+FLAG_CREDIT = 0x01
+FLAG_HELLO = 0x02
+PORT_CONTROL = 0xFF
+MAX_PAYLOAD = 0xFFFF
+
+
+class MuxClient:
+    def __init__(self, host, port, timeout=10):
+        self.sock = socket.create_connection((host, port), timeout=timeout)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.sock.settimeout(None)
+        self.write_lock = threading.Lock()
+        self.credit_cond = threading.Condition()
+        self.queue = queue.Queue()
+        self.closed = False
+
+        port, flags, payload = self._read_frame()
+        if port != PORT_CONTROL or not flags & FLAG_HELLO:
+            raise ConnectionError("expected hello frame")
+        self.version, mask, self.window = struct.unpack(">BBI", payload)
+        self.ports = [i for i in range(8) if mask & (1 << i)]
+        # Bytes we may send per port, and bytes received not yet granted back
+        self.credit = {i: self.window for i in self.ports}
+        self.consumed = {i: 0 for i in self.ports}
+
+        self.reader = threading.Thread(target=self._read_loop, daemon=True)
+        self.reader.start()
+
+    def _read_exact(self, n):
+        buf = bytearray()
+        while len(buf) < n:
+            chunk = self.sock.recv(n - len(buf))
+            if not chunk:
+                raise ConnectionError("connection closed")
+            buf += chunk
+        return bytes(buf)
+
+    def _read_frame(self):
+        port, flags, length = HEADER.unpack(self._read_exact(HEADER.size))
+        return port, flags, self._read_exact(length) if length else b""
+
+    def _read_loop(self):
+        try:
+            while True:
+                port, flags, payload = self._read_frame()
+                if flags & FLAG_CREDIT:
+                    with self.credit_cond:
+                        self.credit[port] += struct.unpack(">I", payload)[0]
+                        self.credit_cond.notify_all()
+                elif port in self.consumed:
+                    self.queue.put((port, payload))
+        except (ConnectionError, OSError):
+            pass
+        self.closed = True
+        self.queue.put((None, b""))
+        with self.credit_cond:
+            self.credit_cond.notify_all()
+
+    def _write_frame(self, port, flags, payload):
+        with self.write_lock:
+            self.sock.sendall(HEADER.pack(port, flags, len(payload)) + payload)
+
+    def send(self, port, data):
+        """Sends data to a UART, blocking while the port has no credit."""
+        view = memoryview(data)
+        while view:
+            with self.credit_cond:
+                while self.credit[port] == 0 and not self.closed:
+                    self.credit_cond.wait()
+                if self.closed:
+                    raise ConnectionError("connection closed")
+                n = min(len(view), self.credit[port], MAX_PAYLOAD)
+                self.credit[port] -= n
+            self._write_frame(port, 0, bytes(view[:n]))
+            view = view[n:]
+
+    def recv(self, timeout=None):
+        """Returns (port, data) of the next data frame, (None, b"") once closed.
+
+        Credit is granted back to the device as data is handed out, so a port
+        that is not read stops at its window without affecting the others.
+        """
+        port, data = self.queue.get(timeout=timeout)
+        if port is not None:
+            self.consumed[port] += len(data)
+            if self.consumed[port] >= self.window // 4:
+                self._write_frame(port, FLAG_CREDIT, struct.pack(">I", self.consumed[port]))
+                self.consumed[port] = 0
+        return port, data
+
+    def close(self):
+        self.sock.close()
+
+
+def bench_mux(host, port, seconds, size):
+    client = MuxClient(host, port)
+    payload = os.urandom(size)
+    received = {p: 0 for p in client.ports}
+    stop = time.monotonic() + seconds
+
+    def writer(p):
+        while time.monotonic() < stop:
+            client.send(p, payload)
+
+    threads = [threading.Thread(target=writer, args=(p,), daemon=True) for p in client.ports]
+    for t in threads:
+        t.start()
+    start = time.monotonic()
+    while time.monotonic() < stop:
+        try:
+            p, data = client.recv(timeout=0.5)
+        except queue.Empty:
+            continue
+        if p is None:
+            break
+        received[p] += len(data)
+    elapsed = time.monotonic() - start
+    client.close()
+    return received, elapsed
+
+
+def bench_sockets(host, ports, seconds, size):
+    payload = os.urandom(size)
+    received = {p: 0 for p in ports}
+    stop = time.monotonic() + seconds
+
+    def run(p):
+        sock = socket.create_connection((host, p), timeout=10)
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        sock.settimeout(0.5)
+
+        def writer():
+            while time.monotonic() < stop:
+                sock.sendall(payload)
+
+        threading.Thread(target=writer, daemon=True).start()
+        while time.monotonic() < stop:
+            try:
+                data = sock.recv(65536)
+            except socket.timeout:
+                continue
+            if not data:
+                break
+            received[p] += len(data)
+        sock.close()
+
+    threads = [threading.Thread(target=run, args=(p,)) for p in ports]
+    start = time.monotonic()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return received, time.monotonic() - start
+
+
+def report(name, received, elapsed):
+    total = sum(received.values())
+    per_port = "  ".join("%s: %.1f KB/s" % (p, n / elapsed / 1024) for p, n in sorted(received.items()))
+    print("%-8s total %.1f KB/s  %s" % (name, total / elapsed / 1024, per_port))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    bench = sub.add_parser("bench", help="compare mux and per port sockets throughput")
+    bench.add_argument("host")
+    bench.add_argument("--mux-port", type=int, default=2230)
+    bench.add_argument("--ports", type=int, nargs="+", default=[2220, 2221, 2222])
+    bench.add_argument("--seconds", type=float, default=10)
+    bench.add_argument("--size", type=int, default=1024, help="bytes per write")
+
+    dump = sub.add_parser("dump", help="print data received on every port")
+    dump.add_argument("host")
+    dump.add_argument("--mux-port", type=int, default=2230)
+
+    args = parser.parse_args()
+    if args.command == "bench":
+        report("mux", *bench_mux(args.host, args.mux_port, args.seconds, args.size))
+        report("sockets", *bench_sockets(args.host, args.ports, args.seconds, args.size))
+    else:
+        client = MuxClient(args.host, args.mux_port)
+        print("version %d, ports %s, window %d" % (client.version, client.ports, client.window))
+        while True:
+            port, data = client.recv()
+            if port is None:
+                break
+            print("[%d] %r" % (port, data))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Fetches and converts Ser2IP32 hot path traces (CONFIG_SER2IP32_TRACE).
+
+The device dumps its per core trace rings to every client of the trace port
+(see main/trace.h). This saves the binary dump and/or converts it to Chrome
+trace-event JSON, to open in chrome://tracing or https://ui.perfetto.dev:
+
+    ser2ip32_trace.py fetch 192.168.4.1 --port 2299 -o trace.bin --json trace.json
+    ser2ip32_trace.py convert trace.bin trace.json
+
+Socket writes become duration events, everything else instant events. One
+process per serial port, one thread per core.
+"""
+
+import argparse
+import json
+import socket
+import struct
+
+RECORD = struct.Struct("<QHBBI")
+
+EVENTS = {
+    1: "uart_event",
+    2: "uart_read",
+    3: "enqueue",
+    4: "dequeue",
+    5: "socket_write",
+    6: "socket_write_done",
+    7: "tcp_read",
+    8: "uart_write",
+}
+SOCKET_WRITE = 5
+SOCKET_WRITE_DONE = 6
+MUX_PORT = 0xFF
+
+
+def parse(dump):
+    if dump[:4] != b"S2TR":
+        raise ValueError("not a trace dump")
+    version, cores, record_size = struct.unpack_from("<BBH", dump, 4)
+    if version != 1 or record_size != RECORD.size:
+        raise ValueError("unsupported dump version %d, record size %d" % (version, record_size))
+    records = []
+    offset = 8
+    for _ in range(cores):
+        (count,) = struct.unpack_from("<I", dump, offset)
+        offset += 4
+        for _ in range(count):
+            records.append(RECORD.unpack_from(dump, offset))
+            offset += RECORD.size
+    records.sort(key=lambda r: r[0])
+    return records
+
+
+def to_chrome(records):
+    events = []
+    open_writes = {}
+    for timestamp, event, port, core, arg in records:
+        name = EVENTS.get(event, "event_%d" % event)
+        base = {"pid": port, "tid": core, "ts": timestamp}
+        if event == SOCKET_WRITE:
+            open_writes[(port, core)] = (timestamp, arg)
+        elif event == SOCKET_WRITE_DONE and (port, core) in open_writes:
+            start, length = open_writes.pop((port, core))
+            events.append(dict(base, name="socket_write", ph="X", ts=start, dur=timestamp - start, args={"bytes": length}))
+        else:
+            args = {"bytes": arg}
+            if event == 1:
+                args = {"type": arg >> 16, "size": arg & 0xFFFF}
+            events.append(dict(base, name=name, ph="i", s="t", args=args))
+    for port in sorted({r[2] for r in records}):
+        label = "mux" if port == MUX_PORT else "uart %d" % port
+        events.append({"name": "process_name", "ph": "M", "pid": port, "args": {"name": label}})
+    return {"traceEvents": events, "displayTimeUnit": "ms"}
+
+
+def fetch(host, port):
+    sock = socket.create_connection((host, port), timeout=10)
+    chunks = []
+    while True:
+        chunk = sock.recv(65536)
+        if not chunk:
+            break
+        chunks.append(chunk)
+    sock.close()
+    return b"".join(chunks)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+    f = sub.add_parser("fetch", help="download a dump from the device")
+    f.add_argument("host")
+    f.add_argument("--port", type=int, default=2299)
+    f.add_argument("-o", "--output", help="binary dump file")
+    f.add_argument("--json", help="Chrome trace JSON file")
+    c = sub.add_parser("convert", help="convert a binary dump")
+    c.add_argument("dump")
+    c.add_argument("json")
+    args = parser.parse_args()
+
+    if args.command == "fetch":
+        dump = fetch(args.host, args.port)
+        if args.output:
+            with open(args.output, "wb") as out:
+                out.write(dump)
+        json_path = args.json
+    else:
+        with open(args.dump, "rb") as f:
+            dump = f.read()
+        json_path = args.json
+
+    records = parse(dump)
+    print("%d records" % len(records))
+    if json_path:
+        with open(json_path, "w") as out:
+            json.dump(to_chrome(records), out)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+"""WebSocket client for Ser2IP32 ports configured with --ws=1.
+
+A port in WebSocket mode carries the serial data in binary frames, so a
+browser terminal connects to ws://<ip>:<port>/ without a proxy. WsClient is
+the same thing for scripts:
+
+    client = WsClient("192.168.4.1", 2221)
+    client.send(b"hello")
+    data = client.recv()
+
+Run as a script it compares the throughput of a WebSocket port against a raw
+TCP port. Loop TX to RX on both UARTs so the device echoes the data:
+
+    ser2ip32_ws.py bench 192.168.4.1 --ws-port 2221 --tcp-port 2222
+"""
+
+import argparse
+import base64
+import hashlib
+import os
+import socket
+import struct
+import threading
+import time
+
+GUID = b"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+OP_BINARY = 0x2
+OP_CLOSE = 0x8
+OP_PING = 0x9
+OP_PONG = 0xA
+
+
+class WsClient:
+    def __init__(self, host, port, timeout=10):
+        self.sock = socket.create_connection((host, port), timeout=timeout)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        key = base64.b64encode(os.urandom(16))
+        self.sock.sendall(b"GET / HTTP/1.1\r\nHost: %s:%d\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                          b"Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n" % (host.encode(), port, key))
+        response = b""
+        while b"\r\n\r\n" not in response:
+            chunk = self.sock.recv(1024)
+            if not chunk:
+                raise ConnectionError("connection closed during the handshake")
+            response += chunk
+        head, self.pending = response.split(b"\r\n\r\n", 1)
+        expected = base64.b64encode(hashlib.sha1(key + GUID).digest())
+        if not head.startswith(b"HTTP/1.1 101") or expected not in head:
+            raise ConnectionError("upgrade refused: %r" % head.split(b"\r\n")[0])
+        self.send_lock = threading.Lock()
+
+    def _frame(self):
+        """Opcode and payload of the buffered frame, None while incomplete."""
+        if len(self.pending) < 2:
+            return None
+        first, second = self.pending[0], self.pending[1]
+        length, at = second & 0x7F, 2
+        if length == 126:
+            if len(self.pending) < 4:
+                return None
+            length, at = struct.unpack(">H", self.pending[2:4])[0], 4
+        elif length == 127:
+            if len(self.pending) < 10:
+                return None
+            length, at = struct.unpack(">Q", self.pending[2:10])[0], 10
+        if len(self.pending) < at + length:
+            return None
+        payload, self.pending = self.pending[at:at + length], self.pending[at + length:]
+        return first & 0x0F, payload
+
+    def _write_frame(self, opcode, payload):
+        # Client frames are masked (RFC 6455 5.3)
+        mask = os.urandom(4)
+        length = len(payload)
+        if length < 126:
+            header = struct.pack(">BB", 0x80 | opcode, 0x80 | length)
+        elif length <= 0xFFFF:
+            header = struct.pack(">BBH", 0x80 | opcode, 0x80 | 126, length)
+        else:
+            header = struct.pack(">BBQ", 0x80 | opcode, 0x80 | 127, length)
+        word = int.from_bytes(mask * ((length + 3) // 4), "big")
+        masked = (int.from_bytes(payload, "big") ^ (word >> (8 * (-length % 4)))).to_bytes(length, "big")
+        with self.send_lock:
+            self.sock.sendall(header + mask + masked)
+
+    def send(self, data):
+        self._write_frame(OP_BINARY, data)
+
+    def recv(self):
+        """Payload of the next data frame, None once the device closes.
+
+        A socket timeout leaves the partial frame buffered for the next call.
+        """
+        while True:
+            frame = self._frame()
+            if frame is None:
+                chunk = self.sock.recv(65536)
+                if not chunk:
+                    return None
+                self.pending += chunk
+                continue
+            opcode, payload = frame
+            if opcode == OP_CLOSE:
+                return None
+            if opcode == OP_PING:
+                self._write_frame(OP_PONG, payload)
+                continue
+            return payload
+
+    def close(self):
+        try:
+            self._write_frame(OP_CLOSE, struct.pack(">H", 1000))
+        except OSError:
+            pass
+        self.sock.close()
+
+
+def bench(recv, send, seconds, size):
+    payload = os.urandom(size)
+    stop = time.monotonic() + seconds
+
+    def writer():
+        while time.monotonic() < stop:
+            send(payload)
+
+    threading.Thread(target=writer, daemon=True).start()
+    received = 0
+    start = time.monotonic()
+    while time.monotonic() < stop:
+        try:
+            data = recv()
+        except socket.timeout:
+            continue
+        if not data:
+            break
+        received += len(data)
+    return received, time.monotonic() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    run = sub.add_parser("bench", help="compare WebSocket and raw TCP port throughput")
+    run.add_argument("host")
+    run.add_argument("--ws-port", type=int, default=2221)
+    run.add_argument("--tcp-port", type=int, default=2222)
+    run.add_argument("--seconds", type=float, default=10)
+    run.add_argument("--size", type=int, default=1024, help="bytes per write")
+
+    dump = sub.add_parser("dump", help="print data received on a WebSocket port")
+    dump.add_argument("host")
+    dump.add_argument("--ws-port", type=int, default=2221)
+
+    args = parser.parse_args()
+    if args.command == "bench":
+        client = WsClient(args.host, args.ws_port)
+        client.sock.settimeout(0.5)
+        ws = bench(client.recv, client.send, args.seconds, args.size)
+        client.close()
+
+        sock = socket.create_connection((args.host, args.tcp_port), timeout=10)
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        sock.settimeout(0.5)
+        tcp = bench(lambda: sock.recv(65536), sock.sendall, args.seconds, args.size)
+        sock.close()
+
+        for name, (received, elapsed) in (("ws", ws), ("tcp", tcp)):
+            print("%-4s %.1f KB/s" % (name, received / elapsed / 1024))
+        if tcp[0]:
+            print("ws/tcp %.2f" % ((ws[0] / ws[1]) / (tcp[0] / tcp[1])))
+    else:
+        client = WsClient(args.host, args.ws_port)
+        while True:
+            data = client.recv()
+            if data is None:
+                break
+            print(repr(data))
+
+
+if __name__ == "__main__":
+    main()